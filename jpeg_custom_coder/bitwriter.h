@@ -0,0 +1,164 @@
+#ifndef BITWRITER_H
+#define BITWRITER_H
+
+/**
+ * @file bitwriter.h
+ * @brief Bit writer for entropy coded JPEG data
+ *
+ * Bits are collected in 64 bit accumulator and written out as whole words
+ * into reserved capacity of 'out'. 0xFF bytes are followed by stuffed 0x00
+ * (JPEG spec. F.1.2.3), words without 0xFF skip the per byte check
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "buffer.h"
+
+// worst case bytes of single flushed word: 8 bytes, every one stuffed
+#define BITWRITER_WORD_MAX 16
+
+typedef struct bitwriter
+{
+    uint64_t acc; // pending bits, right aligned
+    int bits;     // number of pending bits in 'acc'
+    buffer_t out;
+    size_t pos; // end of written data, out->size is updated by bitwriter_flush()
+} bitwriter;
+
+/**
+ * @brief Start writing at the end of 'out'
+ *
+ * @param bw
+ * @param out
+ */
+static inline void bitwriter_init(bitwriter *bw, buffer_t out)
+{
+    bw->acc = 0;
+    bw->bits = 0;
+    bw->out = out;
+    bw->pos = out->size;
+}
+
+/**
+ * @brief Make sure next 'n' bytes can be written without checks
+ *
+ * @note Call before writing up to n / BITWRITER_WORD_MAX words worth of bits
+ *
+ * @param bw
+ * @param n
+ */
+static inline void bitwriter_reserve(bitwriter *bw, size_t n)
+{
+    if (bw->pos + n > bw->out->capacity)
+        buffer_grow(bw->out, bw->pos + n);
+}
+
+/**
+ * @brief Write 8 bytes of 'word' big endian, stuffing 0x00 after 0xFF
+ */
+static inline void bitwriter_emit_word(bitwriter *bw, uint64_t word)
+{
+    uint8_t *dst = bw->out->data + bw->pos;
+
+    // ~word has zero byte <=> word has 0xFF byte
+    const uint64_t ones = 0x0101010101010101ull;
+    const uint64_t highs = 0x8080808080808080ull;
+    if ((((~word) - ones) & word & highs) == 0)
+    {
+        for (int i = 0; i < 8; i++)
+            dst[i] = (uint8_t)(word >> (56 - 8 * i));
+        bw->pos += 8;
+        return;
+    }
+
+    for (int i = 0; i < 8; i++)
+    {
+        uint8_t c = (uint8_t)(word >> (56 - 8 * i));
+        *dst++ = c;
+        if (c == 0xFF)
+            *dst++ = 0;
+    }
+    bw->pos = dst - bw->out->data;
+}
+
+/**
+ * @brief Push 'size' low bits of 'code', most significant first
+ *
+ * @param bw
+ * @param code
+ * @param size 1..32
+ */
+static inline void bitwriter_put(bitwriter *bw, uint32_t code, int size)
+{
+    if (bw->bits + size <= 64)
+    {
+        // size may be 32, shift of uint64_t is fine
+        bw->acc = (bw->acc << size) | code;
+        bw->bits += size;
+        return;
+    }
+
+    // fill accumulator up to 64 bits, write it, keep the rest
+    int n = 64 - bw->bits;
+    int rest = size - n;
+    uint64_t word = (bw->acc << n) | ((uint64_t)code >> rest);
+
+    bitwriter_emit_word(bw, word);
+
+    bw->acc = code & ((1ull << rest) - 1);
+    bw->bits = rest;
+}
+
+/**
+ * @brief Hands out whole bytes written so far, pending bits stay in 'acc'
+ *
+ * @details Bytes are at out->data and valid until next write,
+ *          writing continues from start of 'out'
+ *
+ * @param bw
+ * @return size_t number of bytes
+ */
+static inline size_t bitwriter_take(bitwriter *bw)
+{
+    size_t n = bw->pos;
+
+    bw->pos = 0;
+    bw->out->size = 0;
+
+    return n;
+}
+
+/**
+ * @brief Pad to byte boundary with 1s and write pending bytes
+ *
+ * @details out->size is set to number of written bytes
+ *
+ * @param bw
+ */
+static inline void bitwriter_flush(bitwriter *bw)
+{
+    int pad = (8 - (bw->bits & 7)) & 7;
+
+    bitwriter_reserve(bw, BITWRITER_WORD_MAX);
+
+    if (pad != 0)
+        bitwriter_put(bw, (1u << pad) - 1, pad);
+
+    // at most 8 whole bytes left
+    uint8_t *dst = bw->out->data + bw->pos;
+    for (int i = bw->bits - 8; i >= 0; i -= 8)
+    {
+        uint8_t c = (uint8_t)(bw->acc >> i);
+        *dst++ = c;
+        if (c == 0xFF)
+            *dst++ = 0;
+    }
+    bw->pos = dst - bw->out->data;
+    bw->acc = 0;
+    bw->bits = 0;
+
+    bw->out->size = bw->pos;
+}
+
+#endif // BITWRITER_H
@@ -5,6 +5,7 @@ buffer_t buffer_alloc(size_t size)
     buffer_t buf = (buffer_t)malloc(sizeof(struct resizable_buffer));
 
     buf->size = size;
+    buf->capacity = size;
     buf->data = NULL;
 
     if (buf->size != 0)
@@ -31,25 +32,48 @@ void buffer_append(buffer_t buf, uint8_t *data, size_t size)
     assert(buf != NULL);
     assert(data != NULL);
 
-    if (buf->size == 0)
-        buf->data = (uint8_t *)malloc(size);
-    else
-        buf->data = (uint8_t *)realloc(buf->data, buf->size + size);
+    if (buf->size + size > buf->capacity)
+        buffer_grow(buf, buf->size + size);
 
     memcpy(buf->data + buf->size, data, size);
 
     buf->size += size;
 }
 
+void buffer_reserve(buffer_t buf, size_t capacity)
+{
+    assert(buf != NULL);
+
+    if (capacity <= buf->capacity)
+        return;
+
+    buf->data = (uint8_t *)realloc(buf->data, capacity);
+    assert(buf->data != NULL);
+
+    buf->capacity = capacity;
+}
+
+void buffer_grow(buffer_t buf, size_t capacity)
+{
+    assert(buf != NULL);
+
+    if (capacity <= buf->capacity)
+        return;
+
+    if (capacity < buf->capacity * 2)
+        capacity = buf->capacity * 2;
+
+    buffer_reserve(buf, capacity);
+}
+
 buffer_t buffer_deep_copy(buffer_t buf)
 {
     assert(buf);
 
     buffer_t new = buffer_alloc(buf->size);
 
-    new->data = (uint8_t *)malloc(buf->size);
-    memcpy(new->data, buf->data, buf->size);
-    new->size = buf->size;
+    if (buf->size != 0)
+        memcpy(new->data, buf->data, buf->size);
 
     return new;
 }
@@ -58,34 +82,27 @@ buffer_t buffer_shallow_copy(buffer_t buf)
 {
     assert(buf);
 
-    buffer_t new = buffer_alloc(buf->size);
+    buffer_t new = buffer_alloc(0);
 
     new->data = buf->data;
     new->size = buf->size;
+    new->capacity = buf->size;
 
     return new;
 }
 
 void buffer_reset(buffer_t buf, size_t new_size){
-    if (buf->size != 0)
-        free(buf->data);
+    // keeps allocation, only clears it
+    buffer_reserve(buf, new_size);
 
     buf->size = new_size;
     if (buf->size != 0)
-    {
-        buf->data = (uint8_t *)malloc(buf->size);
         memset(buf->data, 0, buf->size);
-    }
 }
 
 void buffer_resize(buffer_t buf, size_t new_size){
-    if (buf->size == 0){
-        buf->data = (uint8_t*)malloc(new_size);
-        buf->size = new_size;
-        return;
-    }
+    buffer_grow(buf, new_size);
 
-    buf->data = (uint8_t*)realloc(buf->data, new_size);
     if (new_size > buf->size){
         memset(buf->data + buf->size, 0, new_size - buf->size);
     }
@@ -10,11 +10,16 @@
 
 /**
  * @brief Resizable buffer API
+ *
+ * @details 'size' - bytes in use
+ *          'capacity' - bytes allocated for 'data'. Grows geometrically
+ *          on append so appending n bytes costs O(n) copies in total
  */
 struct resizable_buffer
 {
     uint8_t *data;
     size_t size;
+    size_t capacity;
 };
 
 typedef struct resizable_buffer *buffer_t;
@@ -43,6 +48,55 @@ void buffer_free(buffer_t buf);
  */
 void buffer_append(buffer_t buf, uint8_t *data, size_t size);
 
+/**
+ * @brief Make sure buffer can hold 'capacity' bytes without reallocation
+ *
+ * @note Allocates exactly 'capacity' bytes when growing. Size is not changed
+ *
+ * @param buf
+ * @param capacity
+ */
+void buffer_reserve(buffer_t buf, size_t capacity);
+
+/**
+ * @brief Same as buffer_reserve() but grows at least twice
+ *
+ * @details Use when space is requested piece by piece
+ *
+ * @param buf
+ * @param capacity
+ */
+void buffer_grow(buffer_t buf, size_t capacity);
+
+/**
+ * @brief Append single byte
+ *
+ * @param buf
+ * @param value
+ */
+static inline void buffer_append_u8(buffer_t buf, uint8_t value)
+{
+    if (buf->size + 1 > buf->capacity)
+        buffer_grow(buf, buf->size + 1);
+
+    buf->data[buf->size++] = value;
+}
+
+/**
+ * @brief Append 16 bit value as big endian
+ *
+ * @param buf
+ * @param value
+ */
+static inline void buffer_append_u16be(buffer_t buf, uint16_t value)
+{
+    if (buf->size + 2 > buf->capacity)
+        buffer_grow(buf, buf->size + 2);
+
+    buf->data[buf->size++] = (uint8_t)(value >> 8);
+    buf->data[buf->size++] = (uint8_t)(value & 0xFF);
+}
+
 /**
  * @brief Create copy of buffer and data
  *
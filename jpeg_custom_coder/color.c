@@ -0,0 +1,269 @@
+#include "color.h"
+#include "jpeg_util.h"
+
+#ifdef COLOR_HAVE_AVX2
+#include <immintrin.h>
+#endif
+
+void color_row_scalar(const uint8_t *r, const uint8_t *g, const uint8_t *b, int step, int n,
+                      float *y, float *cb, float *cr)
+{
+    float ycbcr[3];
+
+    for (int i = 0; i < n; i++)
+    {
+        rgb_to_ycbcr(r[i * step], g[i * step], b[i * step], ycbcr);
+        y[i] = ycbcr[0];
+        cb[i] = ycbcr[1];
+        cr[i] = ycbcr[2];
+    }
+}
+
+void color_row_fixed_scalar(const uint8_t *r, const uint8_t *g, const uint8_t *b, int step, int n,
+                            int16_t *y, int16_t *cb, int16_t *cr)
+{
+    int16_t ycbcr[3];
+
+    for (int i = 0; i < n; i++)
+    {
+        rgb_to_ycbcr_fixed(r[i * step], g[i * step], b[i * step], ycbcr);
+        y[i] = ycbcr[0];
+        cb[i] = ycbcr[1];
+        cr[i] = ycbcr[2];
+    }
+}
+
+void color_gray_row(const uint8_t *src, int step, int n, float *y)
+{
+    for (int i = 0; i < n; i++)
+        y[i] = (float)src[i * step] - 128;
+}
+
+void color_gray_row_fixed(const uint8_t *src, int step, int n, int16_t *y)
+{
+    for (int i = 0; i < n; i++)
+        y[i] = (int16_t)(src[i * step] - 128);
+}
+
+static inline uint8_t color_clamp(int32_t v)
+{
+    return (uint8_t)(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+void color_ycc_row(const uint8_t *y, const uint8_t *cb, const uint8_t *cr, int n, uint8_t *rgb)
+{
+    // FIX(1.402), FIX(0.34414), FIX(0.71414), FIX(1.772) with 16 fractional bits
+    const int32_t half = 1 << 15;
+
+    for (int i = 0; i < n; i++)
+    {
+        int32_t l = y[i];
+        int32_t u = cb[i] - 128;
+        int32_t v = cr[i] - 128;
+
+        rgb[0] = color_clamp(l + ((91881 * v + half) >> 16));
+        rgb[1] = color_clamp(l + ((-22554 * u - 46802 * v + half) >> 16));
+        rgb[2] = color_clamp(l + ((116130 * u + half) >> 16));
+        rgb += 3;
+    }
+}
+
+#ifdef COLOR_HAVE_AVX2
+#define AVX2_FN __attribute__((target("avx2")))
+
+/**
+ * @brief Loads 8 pixels as 8 x 32 bit lanes per channel
+ *
+ * @details step 3: bytes 0..15 and 8..23 from lowest channel pointer are
+ *          loaded and every channel is picked from both with pshufb.
+ *          step 4: one 32 byte load, channel is shifted down and masked.
+ *          step 1: 8 bytes from every channel.
+ *          Lowest channel must be first byte of pixel (RGBA, BGRA, not ARGB),
+ *          then last byte of 8th pixel is never passed
+ *
+ * @param base lowest of r, g, b pointers
+ * @param mask step 3 shuffles: [channel][0 - low half, 1 - high half]
+ * @param shift step 4 bit offsets of channels
+ */
+AVX2_FN static inline void color_avx2_load8(const uint8_t *r, const uint8_t *g, const uint8_t *b, int step,
+                                            const uint8_t *base, const __m128i mask[3][2], const __m256i shift[3],
+                                            __m256i out[3])
+{
+    if (step == 3)
+    {
+        const __m128i lo = _mm_loadu_si128((const __m128i *)base);
+        const __m128i hi = _mm_loadu_si128((const __m128i *)(base + 8));
+
+        for (int k = 0; k < 3; k++)
+            out[k] = _mm256_cvtepu8_epi32(_mm_or_si128(_mm_shuffle_epi8(lo, mask[k][0]),
+                                                       _mm_shuffle_epi8(hi, mask[k][1])));
+    }
+    else if (step == 4)
+    {
+        const __m256i v = _mm256_loadu_si256((const __m256i *)base);
+        const __m256i byte = _mm256_set1_epi32(0xFF);
+
+        for (int k = 0; k < 3; k++)
+            out[k] = _mm256_and_si256(_mm256_srlv_epi32(v, shift[k]), byte);
+    }
+    else
+    {
+        out[0] = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)r));
+        out[1] = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)g));
+        out[2] = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)b));
+    }
+}
+
+/**
+ * @brief Shuffles and shifts of color_avx2_load8() for channel order
+ *
+ * @return const uint8_t* lowest channel pointer
+ */
+AVX2_FN static inline const uint8_t *color_avx2_setup(const uint8_t *r, const uint8_t *g, const uint8_t *b, int step,
+                                                      __m128i mask[3][2], __m256i shift[3])
+{
+    const uint8_t *ch[3] = {r, g, b};
+    const uint8_t *base;
+    int8_t m[2][16];
+
+    // planar rows are loaded directly
+    if (step == 1)
+        return r;
+
+    base = r < g ? (r < b ? r : b) : (g < b ? g : b);
+
+    for (int k = 0; k < 3; k++)
+    {
+        int off = (int)(ch[k] - base);
+
+        // pixels whose byte is in bytes 0..15 come from low half, rest from bytes 8..23
+        memset(m, -1, sizeof(m));
+        for (int p = 0; p < 8 && step == 3; p++)
+        {
+            int i = p * 3 + off;
+            if (i < 16)
+                m[0][p] = (int8_t)i;
+            else
+                m[1][p] = (int8_t)(i - 8);
+        }
+        mask[k][0] = _mm_loadu_si128((const __m128i *)m[0]);
+        mask[k][1] = _mm_loadu_si128((const __m128i *)m[1]);
+
+        shift[k] = _mm256_set1_epi32(8 * off);
+    }
+
+    return base;
+}
+
+AVX2_FN void color_row_avx2(const uint8_t *r, const uint8_t *g, const uint8_t *b, int step, int n,
+                            float *y, float *cb, float *cr)
+{
+    // same constants and order of operations as rgb_to_ycbcr()
+    const __m256 y_r = _mm256_set1_ps(0.299f), y_g = _mm256_set1_ps(0.587f), y_b = _mm256_set1_ps(0.114f);
+    const __m256 cb_r = _mm256_set1_ps(-0.1687f), cb_g = _mm256_set1_ps(0.3313f), cb_b = _mm256_set1_ps(0.5f);
+    const __m256 cr_r = _mm256_set1_ps(0.5f), cr_g = _mm256_set1_ps(0.4187f), cr_b = _mm256_set1_ps(0.0813f);
+    const __m256 center = _mm256_set1_ps(128.0f);
+    __m128i mask[3][2];
+    __m256i shift[3], rgb[3];
+    int i = 0;
+
+    if (step != 1 && step != 3 && step != 4)
+    {
+        color_row_scalar(r, g, b, step, n, y, cb, cr);
+        return;
+    }
+
+    const uint8_t *base = color_avx2_setup(r, g, b, step, mask, shift);
+
+    for (; i + 8 <= n; i += 8)
+    {
+        size_t off = (size_t)i * step;
+        color_avx2_load8(r + off, g + off, b + off, step, base + off, mask, shift, rgb);
+
+        __m256 vr = _mm256_cvtepi32_ps(rgb[0]);
+        __m256 vg = _mm256_cvtepi32_ps(rgb[1]);
+        __m256 vb = _mm256_cvtepi32_ps(rgb[2]);
+
+        __m256 vy = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(y_r, vr), _mm256_mul_ps(y_g, vg)), _mm256_mul_ps(y_b, vb));
+        __m256 vcb = _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(cb_r, vr), _mm256_mul_ps(cb_g, vg)), _mm256_mul_ps(cb_b, vb));
+        __m256 vcr = _mm256_sub_ps(_mm256_sub_ps(_mm256_mul_ps(cr_r, vr), _mm256_mul_ps(cr_g, vg)), _mm256_mul_ps(cr_b, vb));
+
+        _mm256_storeu_ps(y + i, _mm256_sub_ps(vy, center));
+        _mm256_storeu_ps(cb + i, vcb);
+        _mm256_storeu_ps(cr + i, vcr);
+    }
+
+    size_t off = (size_t)i * step;
+    color_row_scalar(r + off, g + off, b + off, step, n - i, y + i, cb + i, cr + i);
+}
+
+// 8 x 32 bit lanes to 8 x int16 after '>> 16' and centering
+AVX2_FN static inline void color_avx2_store_fixed(int16_t *dst, __m256i v)
+{
+    v = _mm256_sub_epi32(_mm256_srai_epi32(v, 16), _mm256_set1_epi32(128));
+    __m128i packed = _mm_packs_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    _mm_storeu_si128((__m128i *)dst, packed);
+}
+
+AVX2_FN void color_row_fixed_avx2(const uint8_t *r, const uint8_t *g, const uint8_t *b, int step, int n,
+                                  int16_t *y, int16_t *cb, int16_t *cr)
+{
+    // same constants as rgb_to_ycbcr_fixed()
+    const __m256i y_r = _mm256_set1_epi32(19595), y_g = _mm256_set1_epi32(38470), y_b = _mm256_set1_epi32(7471);
+    const __m256i cb_r = _mm256_set1_epi32(-11059), cb_g = _mm256_set1_epi32(-21709), cb_b = _mm256_set1_epi32(32768);
+    const __m256i cr_r = _mm256_set1_epi32(32768), cr_g = _mm256_set1_epi32(-27439), cr_b = _mm256_set1_epi32(-5329);
+    const __m256i half = _mm256_set1_epi32(1 << 15);
+    const __m256i offset = _mm256_set1_epi32((128 << 16) + (1 << 15) - 1);
+    __m128i mask[3][2];
+    __m256i shift[3], rgb[3];
+    int i = 0;
+
+    if (step != 1 && step != 3 && step != 4)
+    {
+        color_row_fixed_scalar(r, g, b, step, n, y, cb, cr);
+        return;
+    }
+
+    const uint8_t *base = color_avx2_setup(r, g, b, step, mask, shift);
+
+    for (; i + 8 <= n; i += 8)
+    {
+        size_t off = (size_t)i * step;
+        color_avx2_load8(r + off, g + off, b + off, step, base + off, mask, shift, rgb);
+
+        __m256i vy = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(y_r, rgb[0]), _mm256_mullo_epi32(y_g, rgb[1])),
+                                      _mm256_add_epi32(_mm256_mullo_epi32(y_b, rgb[2]), half));
+        __m256i vcb = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(cb_r, rgb[0]), _mm256_mullo_epi32(cb_g, rgb[1])),
+                                       _mm256_add_epi32(_mm256_mullo_epi32(cb_b, rgb[2]), offset));
+        __m256i vcr = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(cr_r, rgb[0]), _mm256_mullo_epi32(cr_g, rgb[1])),
+                                       _mm256_add_epi32(_mm256_mullo_epi32(cr_b, rgb[2]), offset));
+
+        color_avx2_store_fixed(y + i, vy);
+        color_avx2_store_fixed(cb + i, vcb);
+        color_avx2_store_fixed(cr + i, vcr);
+    }
+
+    size_t off = (size_t)i * step;
+    color_row_fixed_scalar(r + off, g + off, b + off, step, n - i, y + i, cb + i, cr + i);
+}
+
+#undef AVX2_FN
+#endif // COLOR_HAVE_AVX2
+
+color_row_fn color_row_select()
+{
+#ifdef COLOR_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2"))
+        return color_row_avx2;
+#endif
+    return color_row_scalar;
+}
+
+color_row_fixed_fn color_row_fixed_select()
+{
+#ifdef COLOR_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2"))
+        return color_row_fixed_avx2;
+#endif
+    return color_row_fixed_scalar;
+}
@@ -0,0 +1,108 @@
+#ifndef COLOR_H
+#define COLOR_H
+
+/**
+ * @file color.h
+ * @brief Row wise RGB to YCbCr conversion and back
+ *
+ * Row of pixels is split into planar Y, Cb, Cr rows. All components
+ * are centered over zero, same as rgb_to_ycbcr() and rgb_to_ycbcr_fixed()
+ *
+ * Channels are addressed by pointers to first R, G and B sample and
+ * distance between pixels in bytes, so one kernel reads any layout:
+ * RGB (r, r + 1, r + 2, 3), BGRA (b + 2, b + 1, b, 4), planar (r, g, b, 1)
+ */
+
+#include <stdint.h>
+
+/**
+ * @brief Converts 'n' pixels into float planes
+ *
+ * @param r first red sample
+ * @param g first green sample
+ * @param b first blue sample
+ * @param step bytes between pixels: 1 (planar), 3 or 4
+ * @param n pixels
+ */
+typedef void (*color_row_fn)(const uint8_t *r, const uint8_t *g, const uint8_t *b, int step, int n,
+                             float *y, float *cb, float *cr);
+
+/**
+ * @brief Converts 'n' pixels into 16 bit fixed-point planes
+ *
+ * @note Result is bit-exact with rgb_to_ycbcr_fixed() for every kernel
+ */
+typedef void (*color_row_fixed_fn)(const uint8_t *r, const uint8_t *g, const uint8_t *b, int step, int n,
+                                   int16_t *y, int16_t *cb, int16_t *cr);
+
+/**
+ * @brief Picks fastest float kernel supported by the CPU
+ *
+ * @details checked at runtime via CPUID. Falls back to color_row_scalar()
+ *
+ * @return color_row_fn
+ */
+color_row_fn color_row_select();
+
+/**
+ * @brief Same as color_row_select() for fixed-point kernels
+ *
+ * @return color_row_fixed_fn
+ */
+color_row_fixed_fn color_row_fixed_select();
+
+/**
+ * @brief rgb_to_ycbcr() of every pixel
+ */
+void color_row_scalar(const uint8_t *r, const uint8_t *g, const uint8_t *b, int step, int n,
+                      float *y, float *cb, float *cr);
+
+/**
+ * @brief rgb_to_ycbcr_fixed() of every pixel
+ */
+void color_row_fixed_scalar(const uint8_t *r, const uint8_t *g, const uint8_t *b, int step, int n,
+                            int16_t *y, int16_t *cb, int16_t *cr);
+
+/**
+ * @brief Gray samples centered over zero, 'step' bytes apart
+ */
+void color_gray_row(const uint8_t *src, int step, int n, float *y);
+
+/**
+ * @brief Same as color_gray_row() for fixed-point path
+ */
+void color_gray_row_fixed(const uint8_t *src, int step, int n, int16_t *y);
+
+/**
+ * @brief Converts 'n' decoded pixels back to packed RGB
+ *
+ * @details 16 bit fixed-point math same as libjpeg's jdcolor.c.
+ *          Input is not centered, Cb and Cr are stored with +128 offset
+ */
+void color_ycc_row(const uint8_t *y, const uint8_t *cb, const uint8_t *cr, int n, uint8_t *rgb);
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define COLOR_HAVE_AVX2 1
+
+/**
+ * @brief 8 pixels per step widened to 8 x 32 bit lanes and converted at once
+ *
+ * @details 3 byte pixels are deinterleaved with byte shuffles built for
+ *          channel order, 4 byte pixels with shifts, planar rows are
+ *          loaded directly. Other steps fall back to scalar
+ *
+ * @warning CPU must support AVX2. Use color_row_select()
+ */
+void color_row_avx2(const uint8_t *r, const uint8_t *g, const uint8_t *b, int step, int n,
+                    float *y, float *cb, float *cr);
+
+/**
+ * @brief Fixed-point version of color_row_avx2()
+ *
+ * @warning CPU must support AVX2. Use color_row_fixed_select()
+ */
+void color_row_fixed_avx2(const uint8_t *r, const uint8_t *g, const uint8_t *b, int step, int n,
+                          int16_t *y, int16_t *cb, int16_t *cr);
+#endif
+
+#endif // COLOR_H
@@ -1,8 +1,26 @@
 #include "dct.h"
 
+#include <string.h>
+
+#ifdef DCT_HAVE_AVX
+#include <immintrin.h>
+#endif
+
 #define PI_DIV_16 0.196349540849 // PI / 16
 #define ONE_DIV_SQRT2 0.707106781187 // 1 / sqrt(2)
 
+// dct_cos[x][u] = C(u) / 2 * cos((2x + 1) * u * PI / 16); C(0) = 1 / sqrt(2), C(u) = 1
+static const float dct_cos[8][8] = {
+    {0.353553391f, 0.490392640f, 0.461939766f, 0.415734806f, 0.353553391f, 0.277785117f, 0.191341716f, 0.097545161f},
+    {0.353553391f, 0.415734806f, 0.191341716f, -0.097545161f, -0.353553391f, -0.490392640f, -0.461939766f, -0.277785117f},
+    {0.353553391f, 0.277785117f, -0.191341716f, -0.490392640f, -0.353553391f, 0.097545161f, 0.461939766f, 0.415734806f},
+    {0.353553391f, 0.097545161f, -0.461939766f, -0.277785117f, 0.353553391f, 0.415734806f, -0.191341716f, -0.490392640f},
+    {0.353553391f, -0.097545161f, -0.461939766f, 0.277785117f, 0.353553391f, -0.415734806f, -0.191341716f, 0.490392640f},
+    {0.353553391f, -0.277785117f, -0.191341716f, 0.490392640f, -0.353553391f, -0.097545161f, 0.461939766f, -0.415734806f},
+    {0.353553391f, -0.415734806f, 0.191341716f, 0.097545161f, -0.353553391f, 0.490392640f, -0.461939766f, 0.277785117f},
+    {0.353553391f, -0.490392640f, 0.461939766f, -0.415734806f, 0.353553391f, -0.277785117f, 0.191341716f, -0.097545161f},
+};
+
 void dct_2d_8x8(float in[8][8], float out[8][8])
 {
 	// s - sum of spatial freq
@@ -76,33 +94,719 @@ void dct_2d(float in[64], float out[64]){
 	}
 }
 
-void inverse_dct_2d_8x8(float in[8][8], float out[8][8])
+void dct_2d_separable(const float in[64], float out[64])
 {
-	float s, k;
-	for (int x = 0; x < 8; x++)
+	float tmp[64];
+
+	// rows: tmp[y][u] = sum(in[y][x] * dct_cos[x][u])
+	for (int y = 0; y < 8; y++)
 	{
+		for (int u = 0; u < 8; u++)
+			tmp[y * 8 + u] = 0;
+
+		for (int x = 0; x < 8; x++)
+		{
+			float s = in[y * 8 + x];
+			for (int u = 0; u < 8; u++)
+				tmp[y * 8 + u] += s * dct_cos[x][u];
+		}
+	}
+
+	// columns: out[v][u] = sum(dct_cos[y][v] * tmp[y][u])
+	for (int v = 0; v < 8; v++)
+	{
+		for (int u = 0; u < 8; u++)
+			out[v * 8 + u] = 0;
+
 		for (int y = 0; y < 8; y++)
 		{
+			float c = dct_cos[y][v];
+			for (int u = 0; u < 8; u++)
+				out[v * 8 + u] += c * tmp[y * 8 + u];
+		}
+	}
+}
 
-			s = 0;
-			for (int i = 0; i < 8; i++)
-			{
-				for (int j = 0; j < 8; j++)
-				{
-					if (i == 0 && j == 0)
-						k = 0.5;
-					else if ((i == 0 && j != 0) || (i != 0 && j == 0))
-						k = 1 / sqrt(2.0);
-					else
-						k = 1.0;
-
-					s += k * in[i][j] * cos((2 * x + 1) * M_PI * i / 16) * cos((2 * y + 1) * M_PI * j / 16);
-				}
-			}
+void idct_2d_separable(const float in[64], float out[64])
+{
+	float tmp[64];
 
-			out[x][y] = s * 2 / 8;
+	// rows: tmp[v][x] = sum(in[v][u] * dct_cos[x][u])
+	for (int v = 0; v < 8; v++)
+	{
+		for (int x = 0; x < 8; x++)
+		{
+			float s = 0;
+			for (int u = 0; u < 8; u++)
+				s += in[v * 8 + u] * dct_cos[x][u];
+			tmp[v * 8 + x] = s;
 		}
 	}
+
+	// columns: out[y][x] = sum(dct_cos[y][v] * tmp[v][x])
+	for (int y = 0; y < 8; y++)
+	{
+		for (int x = 0; x < 8; x++)
+			out[y * 8 + x] = 0;
+
+		for (int v = 0; v < 8; v++)
+		{
+			float c = dct_cos[y][v];
+			for (int x = 0; x < 8; x++)
+				out[y * 8 + x] += c * tmp[v * 8 + x];
+		}
+	}
+}
+
+void idct_table_init(idct_table *t, const uint16_t q[64])
+{
+	float scale[8];
+
+	scale[0] = 1;
+	for (int k = 1; k < 8; k++)
+		scale[k] = (float)(sqrt(2.0) * cos(k * M_PI / 16));
+
+	for (int i = 0; i < 64; i++)
+	{
+		t->q[i] = q[i];
+		t->aan[i] = q[i] * scale[i / 8] * scale[i % 8] / 8;
+	}
+}
+
+static inline uint8_t idct_clamp(int v)
+{
+	return (uint8_t)(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+// 1 - only DC is nonzero, 4 - nonzero coeffs. only in top-left 4x4, 8 - any
+static inline int idct_extent(const int16_t coef[64])
+{
+	uint64_t w[16], any = 0;
+
+	// row 'v' is two words, second one holds columns 4..7
+	memcpy(w, coef, sizeof(w));
+
+	for (int i = 8; i < 16; i++)
+		any |= w[i];
+	if (any | w[1] | w[3] | w[5] | w[7])
+		return 8;
+
+	if ((w[2] | w[4] | w[6]) == 0 && (coef[1] | coef[2] | coef[3]) == 0)
+		return 1;
+
+	return 4;
+}
+
+// 'n' x 'n' samples of single value, DC-only blocks
+static inline void idct_fill(uint8_t *out, size_t stride, int n, int value)
+{
+	uint8_t v = idct_clamp(value);
+
+	for (int y = 0; y < n; y++)
+		memset(out + y * stride, v, (size_t)n);
+}
+
+void idct_separable(const int16_t coef[64], const idct_table *t, uint8_t *out, size_t stride)
+{
+	float in[64], pix[64];
+
+	for (int i = 0; i < 64; i++)
+		in[i] = (float)coef[i] * t->q[i];
+
+	idct_2d_separable(in, pix);
+
+	for (int y = 0; y < 8; y++)
+		for (int x = 0; x < 8; x++)
+			out[y * stride + x] = idct_clamp((int)lrintf(pix[y * 8 + x]) + 128);
+}
+
+// one AAN pass over 8 values 'in_stride' apart. 'n' - leading inputs which may be nonzero (4 or 8)
+static inline void idct_aan_1d(const float *in, int in_stride, float *out, int out_stride, int n)
+{
+	float tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+	float tmp10, tmp11, tmp12, tmp13;
+	float z5, z10, z11, z12, z13;
+
+	// Even part
+	tmp0 = in[0 * in_stride];
+	tmp1 = in[2 * in_stride];
+	tmp2 = n > 4 ? in[4 * in_stride] : 0;
+	tmp3 = n > 4 ? in[6 * in_stride] : 0;
+
+	tmp10 = tmp0 + tmp2;
+	tmp11 = tmp0 - tmp2;
+	tmp13 = tmp1 + tmp3;
+	tmp12 = (tmp1 - tmp3) * 1.414213562f - tmp13; // 2 * c4
+
+	tmp0 = tmp10 + tmp13;
+	tmp3 = tmp10 - tmp13;
+	tmp1 = tmp11 + tmp12;
+	tmp2 = tmp11 - tmp12;
+
+	// Odd part
+	tmp4 = in[1 * in_stride];
+	tmp5 = in[3 * in_stride];
+	tmp6 = n > 4 ? in[5 * in_stride] : 0;
+	tmp7 = n > 4 ? in[7 * in_stride] : 0;
+
+	z13 = tmp6 + tmp5;
+	z10 = tmp6 - tmp5;
+	z11 = tmp4 + tmp7;
+	z12 = tmp4 - tmp7;
+
+	tmp7 = z11 + z13;
+	tmp11 = (z11 - z13) * 1.414213562f; // 2 * c4
+
+	z5 = (z10 + z12) * 1.847759065f;    // 2 * c2
+	tmp10 = 1.082392200f * z12 - z5;    // 2 * (c2 - c6)
+	tmp12 = -2.613125930f * z10 + z5;   // -2 * (c2 + c6)
+
+	tmp6 = tmp12 - tmp7;
+	tmp5 = tmp11 - tmp6;
+	tmp4 = tmp10 + tmp5;
+
+	out[0 * out_stride] = tmp0 + tmp7;
+	out[7 * out_stride] = tmp0 - tmp7;
+	out[1 * out_stride] = tmp1 + tmp6;
+	out[6 * out_stride] = tmp1 - tmp6;
+	out[2 * out_stride] = tmp2 + tmp5;
+	out[5 * out_stride] = tmp2 - tmp5;
+	out[4 * out_stride] = tmp3 + tmp4;
+	out[3 * out_stride] = tmp3 - tmp4;
+}
+
+void idct_aan_scalar(const int16_t coef[64], const idct_table *t, uint8_t *out, size_t stride)
+{
+	float in[64], ws[64], row[8];
+	int n = idct_extent(coef);
+
+	if (n == 1)
+	{
+		idct_fill(out, stride, 8, (int)lrintf(coef[0] * t->aan[0]) + 128);
+		return;
+	}
+
+	for (int v = 0; v < n; v++)
+		for (int u = 0; u < n; u++)
+			in[v * 8 + u] = coef[v * 8 + u] * t->aan[v * 8 + u];
+
+	// columns, only first 'n' may be nonzero
+	for (int u = 0; u < n; u++)
+		idct_aan_1d(in + u, 8, ws + u, 8, n);
+
+	// rows. +0.5 rounds, negative values are clamped to 0 anyway
+	for (int y = 0; y < 8; y++)
+	{
+		idct_aan_1d(ws + y * 8, 1, row, 1, n);
+
+		for (int x = 0; x < 8; x++)
+			out[y * stride + x] = idct_clamp((int)(row[x] + 128.5f));
+	}
+}
+
+// islow fixed-point constants. FIX(x) = x * 2^ISLOW_CONST_BITS
+#define ISLOW_CONST_BITS 13
+#define ISLOW_PASS1_BITS 2
+#define FIX_0_298631336 ((int32_t)2446)
+#define FIX_0_390180644 ((int32_t)3196)
+#define FIX_0_541196100 ((int32_t)4433)
+#define FIX_0_765366865 ((int32_t)6270)
+#define FIX_0_899976223 ((int32_t)7373)
+#define FIX_1_175875602 ((int32_t)9633)
+#define FIX_1_501321110 ((int32_t)12299)
+#define FIX_1_847759065 ((int32_t)15137)
+#define FIX_1_961570560 ((int32_t)16069)
+#define FIX_2_053119869 ((int32_t)16819)
+#define FIX_2_562915447 ((int32_t)20995)
+#define FIX_3_072711026 ((int32_t)25172)
+#define DESCALE(x, n) (((x) + ((int32_t)1 << ((n)-1))) >> (n))
+
+// one 1D islow pass over 8 values 'stride' apart
+// 'pass1' - rows pass keeps ISLOW_PASS1_BITS of extra precision, columns pass removes it
+static inline void dct_islow_1d(int32_t* d, int stride, int pass1)
+{
+	int32_t tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+	int32_t tmp10, tmp11, tmp12, tmp13;
+	int32_t z1, z2, z3, z4, z5;
+	int shift = pass1 ? ISLOW_CONST_BITS - ISLOW_PASS1_BITS : ISLOW_CONST_BITS + ISLOW_PASS1_BITS;
+
+	tmp0 = d[0 * stride] + d[7 * stride];
+	tmp7 = d[0 * stride] - d[7 * stride];
+	tmp1 = d[1 * stride] + d[6 * stride];
+	tmp6 = d[1 * stride] - d[6 * stride];
+	tmp2 = d[2 * stride] + d[5 * stride];
+	tmp5 = d[2 * stride] - d[5 * stride];
+	tmp3 = d[3 * stride] + d[4 * stride];
+	tmp4 = d[3 * stride] - d[4 * stride];
+
+	// Even part
+	tmp10 = tmp0 + tmp3;
+	tmp13 = tmp0 - tmp3;
+	tmp11 = tmp1 + tmp2;
+	tmp12 = tmp1 - tmp2;
+
+	if (pass1)
+	{
+		d[0 * stride] = (tmp10 + tmp11) * (1 << ISLOW_PASS1_BITS);
+		d[4 * stride] = (tmp10 - tmp11) * (1 << ISLOW_PASS1_BITS);
+	}
+	else
+	{
+		d[0 * stride] = DESCALE(tmp10 + tmp11, ISLOW_PASS1_BITS);
+		d[4 * stride] = DESCALE(tmp10 - tmp11, ISLOW_PASS1_BITS);
+	}
+
+	z1 = (tmp12 + tmp13) * FIX_0_541196100;
+	d[2 * stride] = DESCALE(z1 + tmp13 * FIX_0_765366865, shift);
+	d[6 * stride] = DESCALE(z1 - tmp12 * FIX_1_847759065, shift);
+
+	// Odd part
+	z1 = tmp4 + tmp7;
+	z2 = tmp5 + tmp6;
+	z3 = tmp4 + tmp6;
+	z4 = tmp5 + tmp7;
+	z5 = (z3 + z4) * FIX_1_175875602;
+
+	tmp4 *= FIX_0_298631336;
+	tmp5 *= FIX_2_053119869;
+	tmp6 *= FIX_3_072711026;
+	tmp7 *= FIX_1_501321110;
+	z1 *= -FIX_0_899976223;
+	z2 *= -FIX_2_562915447;
+	z3 *= -FIX_1_961570560;
+	z4 *= -FIX_0_390180644;
+
+	z3 += z5;
+	z4 += z5;
+
+	d[7 * stride] = DESCALE(tmp4 + z1 + z3, shift);
+	d[5 * stride] = DESCALE(tmp5 + z2 + z4, shift);
+	d[3 * stride] = DESCALE(tmp6 + z2 + z3, shift);
+	d[1 * stride] = DESCALE(tmp7 + z1 + z4, shift);
+}
+
+void dct_islow(const int16_t in[64], int32_t out[64])
+{
+	for (int i = 0; i < 64; i++)
+		out[i] = in[i];
+
+	// rows, result scaled up by 2^ISLOW_PASS1_BITS
+	for (int y = 0; y < 8; y++)
+		dct_islow_1d(out + y * 8, 1, 1);
+
+	// columns, removes extra scaling. result is 8 * DCT
+	for (int x = 0; x < 8; x++)
+		dct_islow_1d(out + x, 8, 0);
+}
+
+// idct_cos4[x][u] = C(u) / 2 * cos((2x + 1) * u * PI / 8)
+// 4 point basis with 8 point scaling, DC keeps its level
+static const float idct_cos4[4][4] = {
+    {0.353553391f, 0.461939766f, 0.353553391f, 0.191341716f},
+    {0.353553391f, 0.191341716f, -0.353553391f, -0.461939766f},
+    {0.353553391f, -0.191341716f, -0.353553391f, 0.461939766f},
+    {0.353553391f, -0.461939766f, 0.353553391f, -0.191341716f},
+};
+
+void idct_4x4(const int16_t coef[64], const idct_table *t, uint8_t *out, size_t stride)
+{
+	float in[16], tmp[16];
+	int ac = 0;
+
+	for (int v = 0; v < 4; v++)
+	{
+		for (int u = 0; u < 4; u++)
+		{
+			in[v * 4 + u] = (float)coef[v * 8 + u] * t->q[v * 8 + u];
+			ac |= (v | u) ? coef[v * 8 + u] : 0;
+		}
+	}
+
+	if (!ac)
+	{
+		idct_fill(out, stride, 4, (int)lrintf(in[0] / 8) + 128);
+		return;
+	}
+
+	// rows: tmp[v][x] = sum(in[v][u] * idct_cos4[x][u])
+	for (int v = 0; v < 4; v++)
+		for (int x = 0; x < 4; x++)
+			tmp[v * 4 + x] = in[v * 4 + 0] * idct_cos4[x][0] + in[v * 4 + 1] * idct_cos4[x][1] +
+			                 in[v * 4 + 2] * idct_cos4[x][2] + in[v * 4 + 3] * idct_cos4[x][3];
+
+	// columns: out[y][x] = sum(idct_cos4[y][v] * tmp[v][x])
+	for (int y = 0; y < 4; y++)
+	{
+		for (int x = 0; x < 4; x++)
+		{
+			float s = idct_cos4[y][0] * tmp[0 * 4 + x] + idct_cos4[y][1] * tmp[1 * 4 + x] +
+			          idct_cos4[y][2] * tmp[2 * 4 + x] + idct_cos4[y][3] * tmp[3 * 4 + x];
+			out[y * stride + x] = idct_clamp((int)(s + 128.5f));
+		}
+	}
+}
+
+void idct_2x2(const int16_t coef[64], const idct_table *t, uint8_t *out, size_t stride)
+{
+	// 2 point basis is +-C(0) / 2, every product is +-1/8
+	float a = (float)coef[0] * t->q[0];
+	float b = (float)coef[1] * t->q[1];
+	float c = (float)coef[8] * t->q[8];
+	float d = (float)coef[9] * t->q[9];
+
+	out[0] = idct_clamp((int)((a + b + c + d) / 8 + 128.5f));
+	out[1] = idct_clamp((int)((a - b + c - d) / 8 + 128.5f));
+	out[stride] = idct_clamp((int)((a + b - c - d) / 8 + 128.5f));
+	out[stride + 1] = idct_clamp((int)((a - b - c + d) / 8 + 128.5f));
+}
+
+void idct_1x1(const int16_t coef[64], const idct_table *t, uint8_t *out, size_t stride)
+{
+	(void)stride;
+	out[0] = idct_clamp((int)lrintf((float)coef[0] * t->q[0] / 8) + 128);
+}
+
+// one islow inverse pass over 8 values 'in_stride' apart, descaled by 'shift'
+// 'n' - leading inputs which may be nonzero (4 or 8)
+static inline void idct_islow_1d(const int32_t *in, int in_stride, int32_t *out, int out_stride, int n, int shift)
+{
+	int32_t tmp0, tmp1, tmp2, tmp3;
+	int32_t tmp10, tmp11, tmp12, tmp13;
+	int32_t z1, z2, z3, z4, z5;
+
+	// Even part
+	z2 = in[2 * in_stride];
+	z3 = n > 4 ? in[6 * in_stride] : 0;
+
+	z1 = (z2 + z3) * FIX_0_541196100;
+	tmp2 = z1 - z3 * FIX_1_847759065;
+	tmp3 = z1 + z2 * FIX_0_765366865;
+
+	z2 = in[0 * in_stride];
+	z3 = n > 4 ? in[4 * in_stride] : 0;
+
+	tmp0 = (z2 + z3) * (1 << ISLOW_CONST_BITS);
+	tmp1 = (z2 - z3) * (1 << ISLOW_CONST_BITS);
+
+	tmp10 = tmp0 + tmp3;
+	tmp13 = tmp0 - tmp3;
+	tmp11 = tmp1 + tmp2;
+	tmp12 = tmp1 - tmp2;
+
+	// Odd part
+	tmp0 = n > 4 ? in[7 * in_stride] : 0;
+	tmp1 = n > 4 ? in[5 * in_stride] : 0;
+	tmp2 = in[3 * in_stride];
+	tmp3 = in[1 * in_stride];
+
+	z1 = tmp0 + tmp3;
+	z2 = tmp1 + tmp2;
+	z3 = tmp0 + tmp2;
+	z4 = tmp1 + tmp3;
+	z5 = (z3 + z4) * FIX_1_175875602;
+
+	tmp0 *= FIX_0_298631336;
+	tmp1 *= FIX_2_053119869;
+	tmp2 *= FIX_3_072711026;
+	tmp3 *= FIX_1_501321110;
+	z1 *= -FIX_0_899976223;
+	z2 *= -FIX_2_562915447;
+	z3 *= -FIX_1_961570560;
+	z4 *= -FIX_0_390180644;
+
+	z3 += z5;
+	z4 += z5;
+
+	tmp0 += z1 + z3;
+	tmp1 += z2 + z4;
+	tmp2 += z2 + z3;
+	tmp3 += z1 + z4;
+
+	out[0 * out_stride] = DESCALE(tmp10 + tmp3, shift);
+	out[7 * out_stride] = DESCALE(tmp10 - tmp3, shift);
+	out[1 * out_stride] = DESCALE(tmp11 + tmp2, shift);
+	out[6 * out_stride] = DESCALE(tmp11 - tmp2, shift);
+	out[2 * out_stride] = DESCALE(tmp12 + tmp1, shift);
+	out[5 * out_stride] = DESCALE(tmp12 - tmp1, shift);
+	out[3 * out_stride] = DESCALE(tmp13 + tmp0, shift);
+	out[4 * out_stride] = DESCALE(tmp13 - tmp0, shift);
+}
+
+void idct_islow(const int16_t coef[64], const idct_table *t, uint8_t *out, size_t stride)
+{
+	int32_t in[64], ws[64], row[8];
+	int n = idct_extent(coef);
+
+	// same value as full path: (DC << PASS1_BITS) descaled by PASS1_BITS + 3
+	if (n == 1)
+	{
+		idct_fill(out, stride, 8, DESCALE(coef[0] * (int32_t)t->q[0], 3) + 128);
+		return;
+	}
+
+	for (int v = 0; v < n; v++)
+		for (int u = 0; u < n; u++)
+			in[v * 8 + u] = coef[v * 8 + u] * (int32_t)t->q[v * 8 + u];
+
+	// columns, result scaled up by 2^ISLOW_PASS1_BITS
+	for (int u = 0; u < n; u++)
+		idct_islow_1d(in + u, 8, ws + u, 8, n, ISLOW_CONST_BITS - ISLOW_PASS1_BITS);
+
+	// rows, removes extra scaling and divides by 8
+	for (int y = 0; y < 8; y++)
+	{
+		idct_islow_1d(ws + y * 8, 1, row, 1, n, ISLOW_CONST_BITS + ISLOW_PASS1_BITS + 3);
+
+		for (int x = 0; x < 8; x++)
+			out[y * stride + x] = idct_clamp(row[x] + 128);
+	}
+}
+
+void dct_aan_scalar(float data[64])
+{
+	tjei_fdct(data);
+}
+
+#ifdef DCT_HAVE_AVX
+#define AVX_FN __attribute__((target("avx")))
+
+// transpose 8x8 matrix held in 8 registers
+AVX_FN static inline void dct_avx_transpose(__m256 r[8])
+{
+	__m256 t[8], tt[8];
+
+	t[0] = _mm256_unpacklo_ps(r[0], r[1]);
+	t[1] = _mm256_unpackhi_ps(r[0], r[1]);
+	t[2] = _mm256_unpacklo_ps(r[2], r[3]);
+	t[3] = _mm256_unpackhi_ps(r[2], r[3]);
+	t[4] = _mm256_unpacklo_ps(r[4], r[5]);
+	t[5] = _mm256_unpackhi_ps(r[4], r[5]);
+	t[6] = _mm256_unpacklo_ps(r[6], r[7]);
+	t[7] = _mm256_unpackhi_ps(r[6], r[7]);
+
+	tt[0] = _mm256_shuffle_ps(t[0], t[2], _MM_SHUFFLE(1, 0, 1, 0));
+	tt[1] = _mm256_shuffle_ps(t[0], t[2], _MM_SHUFFLE(3, 2, 3, 2));
+	tt[2] = _mm256_shuffle_ps(t[1], t[3], _MM_SHUFFLE(1, 0, 1, 0));
+	tt[3] = _mm256_shuffle_ps(t[1], t[3], _MM_SHUFFLE(3, 2, 3, 2));
+	tt[4] = _mm256_shuffle_ps(t[4], t[6], _MM_SHUFFLE(1, 0, 1, 0));
+	tt[5] = _mm256_shuffle_ps(t[4], t[6], _MM_SHUFFLE(3, 2, 3, 2));
+	tt[6] = _mm256_shuffle_ps(t[5], t[7], _MM_SHUFFLE(1, 0, 1, 0));
+	tt[7] = _mm256_shuffle_ps(t[5], t[7], _MM_SHUFFLE(3, 2, 3, 2));
+
+	r[0] = _mm256_permute2f128_ps(tt[0], tt[4], 0x20);
+	r[1] = _mm256_permute2f128_ps(tt[1], tt[5], 0x20);
+	r[2] = _mm256_permute2f128_ps(tt[2], tt[6], 0x20);
+	r[3] = _mm256_permute2f128_ps(tt[3], tt[7], 0x20);
+	r[4] = _mm256_permute2f128_ps(tt[0], tt[4], 0x31);
+	r[5] = _mm256_permute2f128_ps(tt[1], tt[5], 0x31);
+	r[6] = _mm256_permute2f128_ps(tt[2], tt[6], 0x31);
+	r[7] = _mm256_permute2f128_ps(tt[3], tt[7], 0x31);
+}
+
+// one AAN pass across registers. same steps as tjei_fdct()
+AVX_FN static inline void dct_avx_aan_pass(__m256 d[8])
+{
+	const __m256 c4 = _mm256_set1_ps(0.707106781f);
+	const __m256 c6 = _mm256_set1_ps(0.382683433f);
+	const __m256 c2_c6 = _mm256_set1_ps(0.541196100f);
+	const __m256 c2c6 = _mm256_set1_ps(1.306562965f);
+
+	__m256 tmp0 = _mm256_add_ps(d[0], d[7]);
+	__m256 tmp7 = _mm256_sub_ps(d[0], d[7]);
+	__m256 tmp1 = _mm256_add_ps(d[1], d[6]);
+	__m256 tmp6 = _mm256_sub_ps(d[1], d[6]);
+	__m256 tmp2 = _mm256_add_ps(d[2], d[5]);
+	__m256 tmp5 = _mm256_sub_ps(d[2], d[5]);
+	__m256 tmp3 = _mm256_add_ps(d[3], d[4]);
+	__m256 tmp4 = _mm256_sub_ps(d[3], d[4]);
+
+	// Even part
+	__m256 tmp10 = _mm256_add_ps(tmp0, tmp3);
+	__m256 tmp13 = _mm256_sub_ps(tmp0, tmp3);
+	__m256 tmp11 = _mm256_add_ps(tmp1, tmp2);
+	__m256 tmp12 = _mm256_sub_ps(tmp1, tmp2);
+
+	d[0] = _mm256_add_ps(tmp10, tmp11);
+	d[4] = _mm256_sub_ps(tmp10, tmp11);
+
+	__m256 z1 = _mm256_mul_ps(_mm256_add_ps(tmp12, tmp13), c4);
+	d[2] = _mm256_add_ps(tmp13, z1);
+	d[6] = _mm256_sub_ps(tmp13, z1);
+
+	// Odd part
+	tmp10 = _mm256_add_ps(tmp4, tmp5);
+	tmp11 = _mm256_add_ps(tmp5, tmp6);
+	tmp12 = _mm256_add_ps(tmp6, tmp7);
+
+	__m256 z5 = _mm256_mul_ps(_mm256_sub_ps(tmp10, tmp12), c6);
+	__m256 z2 = _mm256_add_ps(_mm256_mul_ps(c2_c6, tmp10), z5);
+	__m256 z4 = _mm256_add_ps(_mm256_mul_ps(c2c6, tmp12), z5);
+	__m256 z3 = _mm256_mul_ps(tmp11, c4);
+
+	__m256 z11 = _mm256_add_ps(tmp7, z3);
+	__m256 z13 = _mm256_sub_ps(tmp7, z3);
+
+	d[5] = _mm256_add_ps(z13, z2);
+	d[3] = _mm256_sub_ps(z13, z2);
+	d[1] = _mm256_add_ps(z11, z4);
+	d[7] = _mm256_sub_ps(z11, z4);
+}
+
+AVX_FN void dct_aan_avx(float data[64])
+{
+	// explicit loads/stores keep 'r' in registers, loops make gcc spill it
+	__m256 r[8] = {
+		_mm256_loadu_ps(data + 0), _mm256_loadu_ps(data + 8),
+		_mm256_loadu_ps(data + 16), _mm256_loadu_ps(data + 24),
+		_mm256_loadu_ps(data + 32), _mm256_loadu_ps(data + 40),
+		_mm256_loadu_ps(data + 48), _mm256_loadu_ps(data + 56)};
+
+	// rows: transpose so every register holds a column, then butterfly
+	dct_avx_transpose(r);
+	dct_avx_aan_pass(r);
+
+	// columns: back to rows of coeffs., butterfly across rows
+	dct_avx_transpose(r);
+	dct_avx_aan_pass(r);
+
+	_mm256_storeu_ps(data + 0, r[0]);
+	_mm256_storeu_ps(data + 8, r[1]);
+	_mm256_storeu_ps(data + 16, r[2]);
+	_mm256_storeu_ps(data + 24, r[3]);
+	_mm256_storeu_ps(data + 32, r[4]);
+	_mm256_storeu_ps(data + 40, r[5]);
+	_mm256_storeu_ps(data + 48, r[6]);
+	_mm256_storeu_ps(data + 56, r[7]);
+}
+
+#undef AVX_FN
+#endif // DCT_HAVE_AVX
+
+#ifdef IDCT_HAVE_AVX2
+#define AVX2_FN __attribute__((target("avx2")))
+
+// one inverse AAN pass across registers. same steps as idct_aan_1d()
+AVX2_FN static inline void idct_avx2_aan_pass(__m256 d[8])
+{
+	const __m256 c4x2 = _mm256_set1_ps(1.414213562f);
+	const __m256 c2x2 = _mm256_set1_ps(1.847759065f);
+	const __m256 c2_c6 = _mm256_set1_ps(1.082392200f);
+	const __m256 c2c6 = _mm256_set1_ps(-2.613125930f);
+
+	// Even part
+	__m256 tmp10 = _mm256_add_ps(d[0], d[4]);
+	__m256 tmp11 = _mm256_sub_ps(d[0], d[4]);
+	__m256 tmp13 = _mm256_add_ps(d[2], d[6]);
+	__m256 tmp12 = _mm256_sub_ps(_mm256_mul_ps(_mm256_sub_ps(d[2], d[6]), c4x2), tmp13);
+
+	__m256 tmp0 = _mm256_add_ps(tmp10, tmp13);
+	__m256 tmp3 = _mm256_sub_ps(tmp10, tmp13);
+	__m256 tmp1 = _mm256_add_ps(tmp11, tmp12);
+	__m256 tmp2 = _mm256_sub_ps(tmp11, tmp12);
+
+	// Odd part
+	__m256 z13 = _mm256_add_ps(d[5], d[3]);
+	__m256 z10 = _mm256_sub_ps(d[5], d[3]);
+	__m256 z11 = _mm256_add_ps(d[1], d[7]);
+	__m256 z12 = _mm256_sub_ps(d[1], d[7]);
+
+	__m256 tmp7 = _mm256_add_ps(z11, z13);
+	tmp11 = _mm256_mul_ps(_mm256_sub_ps(z11, z13), c4x2);
+
+	__m256 z5 = _mm256_mul_ps(_mm256_add_ps(z10, z12), c2x2);
+	tmp10 = _mm256_sub_ps(_mm256_mul_ps(c2_c6, z12), z5);
+	tmp12 = _mm256_add_ps(_mm256_mul_ps(c2c6, z10), z5);
+
+	__m256 tmp6 = _mm256_sub_ps(tmp12, tmp7);
+	__m256 tmp5 = _mm256_sub_ps(tmp11, tmp6);
+	__m256 tmp4 = _mm256_add_ps(tmp10, tmp5);
+
+	d[0] = _mm256_add_ps(tmp0, tmp7);
+	d[7] = _mm256_sub_ps(tmp0, tmp7);
+	d[1] = _mm256_add_ps(tmp1, tmp6);
+	d[6] = _mm256_sub_ps(tmp1, tmp6);
+	d[2] = _mm256_add_ps(tmp2, tmp5);
+	d[5] = _mm256_sub_ps(tmp2, tmp5);
+	d[4] = _mm256_add_ps(tmp3, tmp4);
+	d[3] = _mm256_sub_ps(tmp3, tmp4);
+}
+
+// row 'v' of coeffs. widened to float and dequantized
+AVX2_FN static inline __m256 idct_avx2_load(const int16_t *coef, const float *aan, int v)
+{
+	__m256i c = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(coef + v * 8)));
+	return _mm256_mul_ps(_mm256_cvtepi32_ps(c), _mm256_loadu_ps(aan + v * 8));
+}
+
+// rows 'a' and 'b' rounded, level shifted and saturated to 16 bit, in order
+AVX2_FN static inline __m256i idct_avx2_pack(__m256 a, __m256 b)
+{
+	const __m256 bias = _mm256_set1_ps(128.0f);
+	__m256i lo = _mm256_cvtps_epi32(_mm256_add_ps(a, bias));
+	__m256i hi = _mm256_cvtps_epi32(_mm256_add_ps(b, bias));
+
+	// packs works per 128 bit lane: a0..3 b0..3 a4..7 b4..7
+	return _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8);
+}
+
+AVX2_FN void idct_aan_avx2(const int16_t coef[64], const idct_table *t, uint8_t *out, size_t stride)
+{
+	uint8_t pix[64];
+
+	if (idct_extent(coef) == 1)
+	{
+		idct_fill(out, stride, 8, (int)lrintf(coef[0] * t->aan[0]) + 128);
+		return;
+	}
+
+	__m256 r[8] = {
+		idct_avx2_load(coef, t->aan, 0), idct_avx2_load(coef, t->aan, 1),
+		idct_avx2_load(coef, t->aan, 2), idct_avx2_load(coef, t->aan, 3),
+		idct_avx2_load(coef, t->aan, 4), idct_avx2_load(coef, t->aan, 5),
+		idct_avx2_load(coef, t->aan, 6), idct_avx2_load(coef, t->aan, 7)};
+
+	// columns: butterflies across row registers
+	idct_avx2_aan_pass(r);
+
+	// rows: transpose so every register holds a column, then back to rows of samples
+	dct_avx_transpose(r);
+	idct_avx2_aan_pass(r);
+	dct_avx_transpose(r);
+
+	// packus interleaves lanes again: rows 0 2 1 3, fixed by 64 bit permute
+	__m256i rows0 = _mm256_packus_epi16(idct_avx2_pack(r[0], r[1]), idct_avx2_pack(r[2], r[3]));
+	__m256i rows4 = _mm256_packus_epi16(idct_avx2_pack(r[4], r[5]), idct_avx2_pack(r[6], r[7]));
+	_mm256_storeu_si256((__m256i *)pix, _mm256_permute4x64_epi64(rows0, 0xD8));
+	_mm256_storeu_si256((__m256i *)(pix + 32), _mm256_permute4x64_epi64(rows4, 0xD8));
+
+	for (int y = 0; y < 8; y++)
+		memcpy(out + y * stride, pix + y * 8, 8);
+}
+
+#undef AVX2_FN
+#endif // IDCT_HAVE_AVX2
+
+idct_fn idct_select()
+{
+#ifdef IDCT_HAVE_AVX2
+	if (__builtin_cpu_supports("avx2"))
+		return idct_aan_avx2;
+#endif
+	return idct_aan_scalar;
+}
+
+dct_aan_fn dct_aan_select()
+{
+#ifdef DCT_HAVE_AVX
+	if (__builtin_cpu_supports("avx"))
+		return dct_aan_avx;
+#endif
+	return dct_aan_scalar;
+}
+
+void inverse_dct_2d_8x8(float in[8][8], float out[8][8])
+{
+	idct_2d_separable(&in[0][0], &out[0][0]);
 }
 
 void dct_1d(float in[8], float out[8])
@@ -3,12 +3,30 @@
 
 #include <math.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #ifndef M_PI
 #define M_PI 3.1415926535897932384626433832795028841971693993751058209
 #endif
 
+/**
+ * @brief Forward DCT implementations available to the encoder
+ *
+ * @details DCT_SEPARABLE - row/column transform with precomputed cosines (default)
+ *          DCT_AAN - Arai-Agui-Nakajima, output scaling folded into quantization
+ *          DCT_REFERENCE - direct formula with cos() per term. Slow, validation only
+ *          DCT_ISLOW - integer pipeline: fixed-point color conversion, DCT
+ *          and quantization. Output is bit-exact on every machine
+ */
+typedef enum dct_method
+{
+    DCT_SEPARABLE = 0,
+    DCT_AAN,
+    DCT_REFERENCE,
+    DCT_ISLOW
+} dct_method;
+
 /**
  * @brief Discrete Cosine Transform of 8x8 matrix
  *
@@ -17,11 +35,179 @@
  */
 void dct_2d_8x8(float in[8][8], float out[8][8]);
 
+/**
+ * @brief Reference DCT of 8x8 block stored row by row
+ *
+ * @note O(n^4) with two cos() calls per term. Use only to validate fast paths
+ *
+ * @param in Pixel data centered over zero
+ * @param out DCT Coefficient matrix
+ */
 void dct_2d(float in[64], float out[64]);
 
+/**
+ * @brief Separable DCT of 8x8 block stored row by row
+ *
+ * @details 1D transform of every row followed by 1D transform of every column
+ *          using precomputed cosine table. Output matches dct_2d()
+ *
+ * @param in Pixel data centered over zero
+ * @param out DCT Coefficient matrix
+ */
+void dct_2d_separable(const float in[64], float out[64]);
+
+/**
+ * @brief Fixed-point DCT of 8x8 block stored row by row (libjpeg "islow")
+ *
+ * @details 13 bit constants, 2 extra bits of precision between passes.
+ *          Only integer arithmetic, result doesn't depend on FPU
+ *
+ * @param in Samples centered over zero
+ * @param out DCT Coefficient matrix scaled up by 8
+ */
+void dct_islow(const int16_t in[64], int32_t out[64]);
+
+/**
+ * @brief In place AAN DCT of 8x8 block. Output layout matches tjei_fdct()
+ */
+typedef void (*dct_aan_fn)(float data[64]);
+
+/**
+ * @brief Picks fastest AAN kernel supported by the CPU
+ *
+ * @details checked at runtime via CPUID. Falls back to dct_aan_scalar()
+ *
+ * @return dct_aan_fn
+ */
+dct_aan_fn dct_aan_select();
+
+/**
+ * @brief tjei_fdct() as dct_aan_fn
+ */
+void dct_aan_scalar(float data[64]);
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DCT_HAVE_AVX 1
+
+/**
+ * @brief AAN DCT of whole 8x8 block using 8-wide AVX lanes
+ *
+ * @details every row lives in its own register. Butterflies are applied
+ *          across registers, so one pass transforms 8 columns at once.
+ *          Rows are handled by transposing in registers around the first pass
+ *
+ * @warning CPU must support AVX. Use dct_aan_select()
+ */
+void dct_aan_avx(float data[64]);
+#endif
+
+/**
+ * @brief Separable inverse DCT of 8x8 block stored row by row
+ *
+ * @details transposed dct_2d_separable(), uses same cosine table
+ *
+ * @param in DCT Coefficient matrix
+ * @param out Samples centered over zero
+ */
+void idct_2d_separable(const float in[64], float out[64]);
+
+/**
+ * @brief Quantization table prepared for inverse DCT kernels
+ *
+ * @details 'q' - quantization table in natural order.
+ *          'aan' - same table with AAN output scaling and final division
+ *          by 8 folded in: q * s(u) * s(v) / 8, s(0) = 1, s(k) = sqrt(2) * cos(k * PI / 16)
+ */
+typedef struct idct_table
+{
+    uint16_t q[64];
+    float aan[64];
+} idct_table;
+
+/**
+ * @brief Fills 'aan' multipliers of table from 'q'
+ */
+void idct_table_init(idct_table *t, const uint16_t q[64]);
+
+/**
+ * @brief Dequantization, inverse DCT and level shift of one block
+ *
+ * @details Kernels check which coeffs. are nonzero first: DC-only blocks
+ *          are filled with single value, blocks with nonzero coeffs. only
+ *          in top-left 4x4 skip half of butterflies
+ *
+ * @param coef quantized coeffs. in natural order
+ * @param t quantization table
+ * @param out top-left sample of 8x8 output, clamped to 0..255
+ * @param stride bytes between output rows
+ */
+typedef void (*idct_fn)(const int16_t coef[64], const idct_table *t, uint8_t *out, size_t stride);
+
+/**
+ * @brief Picks fastest kernel supported by the CPU
+ *
+ * @details checked at runtime via CPUID. Falls back to idct_aan_scalar()
+ *
+ * @return idct_fn
+ */
+idct_fn idct_select();
+
+/**
+ * @brief idct_2d_separable() as idct_fn. Slow, validation only
+ */
+void idct_separable(const int16_t coef[64], const idct_table *t, uint8_t *out, size_t stride);
+
+/**
+ * @brief Float AAN inverse DCT (libjpeg "float"), dequantizes with 'aan'
+ */
+void idct_aan_scalar(const int16_t coef[64], const idct_table *t, uint8_t *out, size_t stride);
+
+/**
+ * @brief Fixed-point LLM inverse DCT (libjpeg "islow")
+ *
+ * @details 13 bit constants, 2 extra bits of precision between passes.
+ *          Only integer arithmetic, output doesn't depend on FPU
+ */
+void idct_islow(const int16_t coef[64], const idct_table *t, uint8_t *out, size_t stride);
+
+/**
+ * @brief Reduced size inverse DCT, 4x4 samples of 8x8 block (1/2 scale)
+ *
+ * @details only top-left 4x4 coeffs. are used, transformed with 4 point
+ *          cosines. Same as sampling continuous 8x8 result at centers of
+ *          2x2 pixel groups after dropping frequencies above new Nyquist
+ */
+void idct_4x4(const int16_t coef[64], const idct_table *t, uint8_t *out, size_t stride);
+
+/**
+ * @brief Same as idct_4x4(), 2x2 samples (1/4 scale) from top-left 2x2 coeffs.
+ */
+void idct_2x2(const int16_t coef[64], const idct_table *t, uint8_t *out, size_t stride);
+
+/**
+ * @brief Block average from DC alone, single sample (1/8 scale)
+ */
+void idct_1x1(const int16_t coef[64], const idct_table *t, uint8_t *out, size_t stride);
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IDCT_HAVE_AVX2 1
+
+/**
+ * @brief idct_aan_scalar() of whole block using 8-wide AVX lanes
+ *
+ * @details columns pass runs across row registers, rows pass between
+ *          two transposes. DC-only blocks are shortcut, 4x4 ones take full path
+ *
+ * @warning CPU must support AVX2. Use idct_select()
+ */
+void idct_aan_avx2(const int16_t coef[64], const idct_table *t, uint8_t *out, size_t stride);
+#endif
+
 /**
  * @brief Inverse of Discrete Cosine Transform
  *
+ * @note same as idct_2d_separable() on 2D arrays
+ *
  * @param in DCT Coefficient matrix
  * @param out Almost pixel data. Dont forget to add 128
  */
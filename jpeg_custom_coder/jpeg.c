@@ -1,18 +1,59 @@
 #include "jpeg.h"
 
+static void jpeg_stream_free(struct jpeg_stream *stream);
+
 jpeg_encoder_t jpeg_alloc()
 {
     jpeg_encoder_t enc = (jpeg_encoder_t)malloc(sizeof(struct jpeg_encoder));
 
     for (int k = 0; k < 4; k++){
         memset(enc->ehuffsize[k], 0, 257);
-        memset(enc->ehuffcode[k], 0, 256);
+        memset(enc->ehuffcode[k], 0, sizeof(enc->ehuffcode[k]));
     }
 
     enc->compression_lvl = 1;
-    enc->use_fdct = 0;
+    enc->quality = 0;
+    enc->custom_q = 0;
+    enc->dct = DCT_SEPARABLE;
+    enc->fdct_aan = dct_aan_select();
+    enc->color_row = color_row_select();
+    enc->color_row_fixed = color_row_fixed_select();
+
+    enc->optimize_huffman = 0;
+
+    enc->trellis = 0;
+
+    enc->progressive = 0;
+    enc->scan_script = NULL;
+    enc->num_scans = 0;
+
+    enc->num_components = 3;
+
+    enc->subsampling = JPEG_444;
+    enc->chroma_filter = JPEG_FILTER_BOX;
+
+    enc->num_threads = 1;
+    enc->restart_rows = 0;
+    enc->restart_interval = 0;
 
     enc->result = NULL;
+    enc->output = NULL;
+
+    enc->q_valid = 0;
+    enc->huffman_default = 0;
+
+    enc->bands = NULL;
+    enc->bands_cap = 0;
+    enc->coef = NULL;
+    enc->coef_cap = 0;
+    enc->freq = NULL;
+    enc->freq_cap = 0;
+    enc->raw = NULL;
+    enc->raw_cap = 0;
+    enc->sse = NULL;
+    enc->sse_cap = 0;
+
+    enc->stream = NULL;
 
     return enc;
 }
@@ -21,16 +62,82 @@ void jpeg_free(jpeg_encoder_t enc)
 {
     assert(enc);
 
-    buffer_free(enc->result);
+    if (enc->result != NULL)
+        buffer_free(enc->result);
 
-    if (enc->use_fdct == 1){
-        free(enc->fdct_q_table[0]);
-        free(enc->fdct_q_table[1]);
-    }
+    if (enc->output != NULL)
+        buffer_free(enc->output);
+
+    for (size_t b = 0; b < enc->bands_cap; b++)
+        buffer_free(enc->bands[b]);
+
+    free(enc->bands);
+    free(enc->coef);
+    free(enc->freq);
+    free(enc->raw);
+    free(enc->sse);
+
+    if (enc->stream != NULL)
+        jpeg_stream_free(enc->stream);
 
     free(enc);
 }
 
+void jpeg_reset(jpeg_encoder_t enc)
+{
+    assert(enc);
+
+    if (enc->result != NULL)
+        enc->result->size = 0;
+
+    if (enc->output != NULL)
+        enc->output->size = 0;
+
+    enc->restart_interval = 0;
+}
+
+/**
+ * @brief Grows scratch array to hold 'n' elements, old contents are lost
+ * 
+ * @param ptr array, may be NULL
+ * @param cap[in,out] elements allocated
+ * @param n 
+ * @param elem_size 
+ * @return void* array of at least 'n' elements
+ */
+static void *jpeg_scratch(void *ptr, size_t *cap, size_t n, size_t elem_size)
+{
+    if (n <= *cap)
+        return ptr;
+
+    free(ptr);
+    ptr = malloc(n * elem_size);
+    assert(ptr != NULL);
+
+    *cap = n;
+    return ptr;
+}
+
+/**
+ * @brief Sets up quantization and default Huffman tables unless cached ones fit
+ */
+static void jpeg_prepare_tables(jpeg_encoder_t enc)
+{
+    if (!enc->q_valid || enc->q_key.compression_lvl != enc->compression_lvl ||
+        enc->q_key.quality != enc->quality || enc->q_key.dct != enc->dct)
+    {
+        jpeg_setup_q_tables(enc);
+
+        enc->q_key.compression_lvl = enc->compression_lvl;
+        enc->q_key.quality = enc->quality;
+        enc->q_key.dct = enc->dct;
+        enc->q_valid = 1;
+    }
+
+    if (!enc->huffman_default)
+        jpeg_setup_default_huffman_tables(enc);
+}
+
 void jpeg_setup_default_huffman_tables(jpeg_encoder_t enc)
 {
     // Default JPEG Huffman table codes and sizes
@@ -44,6 +151,18 @@ void jpeg_setup_default_huffman_tables(jpeg_encoder_t enc)
     enc->ht_vals[2] = tjei_default_ht_chroma_dc;
     enc->ht_vals[3] = tjei_default_ht_chroma_ac;
 
+    jpeg_setup_huffman_codes(enc);
+    enc->huffman_default = 1;
+}
+
+void jpeg_setup_huffman_codes(jpeg_encoder_t enc)
+{
+    enc->huffman_default = 0;
+
+    // symbols missing from table must have size 0
+    memset(enc->ehuffsize, 0, sizeof(enc->ehuffsize));
+    memset(enc->ehuffcode, 0, sizeof(enc->ehuffcode));
+
     // How many codes in total for each of LUMA_(DC|AC) and CHROMA_(DC|AC)
     int32_t spec_tables_len[4] = {0};
 
@@ -75,16 +194,164 @@ void jpeg_setup_default_huffman_tables(jpeg_encoder_t enc)
     }
 }
 
+void jpeg_build_huffman_table(const uint32_t freq[257], uint8_t bits[16], uint8_t vals[256])
+{
+    // JPEG spec. K.2, code lengths up to 32 before limiting to 16
+    uint32_t f[257];
+    uint8_t codesize[257];
+    int others[257];
+    uint8_t count[33];
+    int c1, c2, i, j, p;
+
+    memcpy(f, freq, sizeof(f));
+    memset(codesize, 0, sizeof(codesize));
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < 257; i++)
+        others[i] = -1;
+
+    // reserved symbol guarantees no code is all 1s
+    f[256] = 1;
+
+    for (;;)
+    {
+        // two least frequent symbols. c1 - smallest
+        c1 = -1;
+        c2 = -1;
+        for (i = 0; i < 257; i++)
+        {
+            if (f[i] == 0)
+                continue;
+            if (c1 < 0 || f[i] <= f[c1])
+            {
+                c2 = c1;
+                c1 = i;
+            }
+            else if (c2 < 0 || f[i] <= f[c2])
+            {
+                c2 = i;
+            }
+        }
+
+        if (c2 < 0)
+            break;
+
+        // merge c2 into c1, every symbol of both trees gets 1 bit longer
+        f[c1] += f[c2];
+        f[c2] = 0;
+
+        codesize[c1]++;
+        while (others[c1] >= 0)
+        {
+            c1 = others[c1];
+            codesize[c1]++;
+        }
+        others[c1] = c2;
+
+        codesize[c2]++;
+        while (others[c2] >= 0)
+        {
+            c2 = others[c2];
+            codesize[c2]++;
+        }
+    }
+
+    for (i = 0; i < 257; i++)
+    {
+        if (codesize[i])
+        {
+            assert(codesize[i] <= 32);
+            count[codesize[i]]++;
+        }
+    }
+
+    // limit lengths to 16: move pairs of longest codes up the tree
+    for (i = 32; i > 16; i--)
+    {
+        while (count[i] > 0)
+        {
+            j = i - 2;
+            while (count[j] == 0)
+                j--;
+
+            count[i] -= 2;
+            count[i - 1]++;
+            count[j + 1] += 2;
+            count[j]--;
+        }
+    }
+
+    // drop reserved symbol, it has one of the longest codes
+    for (i = 16; count[i] == 0; i--)
+        ;
+    count[i]--;
+
+    memcpy(bits, count + 1, 16);
+
+    // symbols sorted by code length, reserved symbol is excluded
+    p = 0;
+    for (i = 1; i <= 32; i++)
+        for (j = 0; j < 256; j++)
+            if (codesize[j] == i)
+                vals[p++] = (uint8_t)j;
+}
+
 void _jpeg_copy_table(uint8_t* dest, const uint8_t* src)
 {
-    // for (int i = 0; i < 64; i++)
-    //     dest[i] = src[zz_index[i]];
-    memcpy(dest, src, 64);
+    // tables are defined in natural order, DQT segment expects zig-zag order
+    for (int i = 0; i < 64; i++)
+        dest[zz_index[i]] = src[i];
+}
+
+void jpeg_scale_q_table(uint8_t* dest, const uint8_t* src, int quality)
+{
+    int scale, q;
+
+    if (quality <= 0)
+    {
+        _jpeg_copy_table(dest, src);
+        return;
+    }
+
+    if (quality > 100)
+        quality = 100;
+
+    scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+
+    for (int i = 0; i < 64; i++)
+    {
+        q = (src[i] * scale + 50) / 100;
+        q = q < 1 ? 1 : (q > 255 ? 255 : q);
+        dest[zz_index[i]] = (uint8_t)q;
+    }
+}
+
+void jpeg_set_q_tables(jpeg_encoder_t enc, const uint8_t luma[64], const uint8_t chroma[64])
+{
+    assert(enc);
+
+    enc->custom_q = luma != NULL;
+    if (luma != NULL)
+    {
+        memcpy(enc->custom_q_table[0], luma, 64);
+        memcpy(enc->custom_q_table[1], chroma != NULL ? chroma : luma, 64);
+    }
+
+    enc->q_valid = 0;
 }
 
 void jpeg_setup_q_tables(jpeg_encoder_t enc)
 {
-    if (enc->compression_lvl == 3)
+    if (enc->custom_q)
+    {
+        jpeg_scale_q_table(enc->q_table[0], enc->custom_q_table[0], enc->quality);
+        jpeg_scale_q_table(enc->q_table[1], enc->custom_q_table[1], enc->quality);
+    }
+    else if (enc->quality > 0)
+    {
+        jpeg_scale_q_table(enc->q_table[0], q_table_luma, enc->quality);
+        jpeg_scale_q_table(enc->q_table[1], q_table_chroma, enc->quality);
+    }
+    else if (enc->compression_lvl == 3)
     {
         _jpeg_copy_table(enc->q_table[0], q_table_luma);
         _jpeg_copy_table(enc->q_table[1], q_table_chroma);
@@ -100,326 +367,2534 @@ void jpeg_setup_q_tables(jpeg_encoder_t enc)
         _jpeg_copy_table(enc->q_table[1], test_quantize_table);
     }
 
-    if (enc->use_fdct == 1){
-        enc->fdct_q_table[0] = malloc(64 * sizeof(float));
-        enc->fdct_q_table[1] = malloc(64 * sizeof(float));
+    // AAN output is scaled by 8 * aan_scales[u] * aan_scales[v]
+    // fold that into quantization so transform skips descaling
+    for (int k = 0; k < 2; k++)
+    {
+        for (int y = 0; y < 8; y++)
+        {
+            for (int x = 0; x < 8; x++)
+            {
+                int i = y * 8 + x;
+                float q = enc->q_table[k][zz_index[i]];
 
-        for(int y=0; y<8; y++) {
-            for(int x=0; x<8; x++) {
-                int i = y*8 + x;
-                enc->fdct_q_table[0][y*8+x] = 1.0f / (8 * aan_scales[x] * aan_scales[y] * enc->q_table[0][zz_index[i]]);
-                enc->fdct_q_table[1][y*8+x] = 1.0f / (8 * aan_scales[x] * aan_scales[y] * enc->q_table[1][zz_index[i]]);
+                if (enc->dct == DCT_AAN)
+                    enc->fdct_q_table[k][i] = 1.0f / (8 * aan_scales[x] * aan_scales[y] * q);
+                else
+                    enc->fdct_q_table[k][i] = 1.0f / q;
             }
         }
     }
+
+    // islow output is scaled by 8, divisor is 8 * q
+    // recip = ceil(2^shift / divisor) with shift = 14 + ceil(log2(divisor))
+    // gives exact floor(n / divisor) for any n < 2^14 and never overflows 32 bits
+    for (int k = 0; k < 2; k++)
+    {
+        for (int i = 0; i < 64; i++)
+        {
+            uint32_t divisor = 8 * (uint32_t)enc->q_table[k][zz_index[i]];
+            int log2_div = 0;
+
+            while ((1u << log2_div) < divisor)
+                log2_div++;
+
+            enc->islow_shift[k][i] = (uint8_t)(14 + log2_div);
+            enc->islow_recip[k][i] = (uint32_t)(((1ull << enc->islow_shift[k][i]) + divisor - 1) / divisor);
+            enc->islow_bias[k][i] = (uint16_t)(divisor / 2);
+        }
+    }
 }
 
-void jpeg_encode_data(jpeg_encoder_t enc, unsigned width, unsigned height, const uint8_t *data)
+/**
+ * @brief Integer DCT + quantization + zig-zag of single 8x8 block
+ * 
+ * @param enc 
+ * @param block fixed-point component samples centered over zero
+ * @param q_index 0 - Luma; 1 - Chroma
+ * @param out quantized coeffs. in zig-zag order
+ */
+static void jpeg_transform_block_islow(jpeg_encoder_t enc, const int16_t block[64], int q_index, int16_t out[64])
 {
-    assert(enc);
-    assert(data);
-    assert(width > 0);
-    assert(height > 0);
+    int32_t coeffs[64];
+    const uint32_t* recip = enc->islow_recip[q_index];
+    const uint16_t* bias = enc->islow_bias[q_index];
+    const uint8_t* shift = enc->islow_shift[q_index];
+    uint32_t n;
 
-    // width and height affects JPEG headers when writing to file
-    enc->width = width;
-    enc->height = height;
+    dct_islow(block, coeffs);
 
-    jpeg_setup_q_tables(enc);
+    // reciprocal multiply instead of division, rounds half away from zero
+    for (int i = 0; i < 64; i++)
+    {
+        n = (uint32_t)(coeffs[i] < 0 ? -coeffs[i] : coeffs[i]) + bias[i];
+        assert(n < (1u << 14));
 
-    jpeg_setup_default_huffman_tables(enc);
+        n = (n * recip[i]) >> shift[i];
+        out[zz_index[i]] = (int16_t)(coeffs[i] < 0 ? -(int32_t)n : (int32_t)n);
+    }
+}
 
-    // MCU (JPEG spec.) is 8x8 block of single component
-    float mcu[3][64];          // after conversion to YCbCr
-    float mcu_dct[64];         // after cosine transform
-    int16_t mcu_zz[64];        // after zig-zag transform
-    int16_t DC[3] = {0, 0, 0}; // DC coeff. for each component
+/**
+ * @brief Forward DCT + quantization + zig-zag of single 8x8 block
+ * 
+ * @param enc 
+ * @param block component samples centered over zero. Clobbered by DCT_AAN
+ * @param q_index 0 - Luma; 1 - Chroma
+ * @param out quantized coeffs. in zig-zag order
+ */
+static void jpeg_transform_block(jpeg_encoder_t enc, float block[64], int q_index, int16_t out[64])
+{
+    float coeffs[64];
+    const float* src = coeffs;
+    const float* q = enc->fdct_q_table[q_index];
+    float tmp_f;
+
+    switch (enc->dct)
+    {
+    case DCT_AAN:
+        enc->fdct_aan(block); // in place
+        src = block;
+        break;
+    case DCT_REFERENCE:
+        dct_2d(block, coeffs);
+        break;
+    default:
+        dct_2d_separable(block, coeffs);
+        break;
+    }
+
+    // reference method keeps symmetric rounding, half away from zero
+    if (enc->dct == DCT_REFERENCE)
+    {
+        for (int i = 0; i < 64; i++)
+        {
+            tmp_f = src[i] * q[i];
+            out[zz_index[i]] = (int16_t)(tmp_f > 0 ? floorf(tmp_f + 0.5f) : ceilf(tmp_f - 0.5f));
+        }
+        return;
+    }
 
-    // bitstack and bit offset
-    uint32_t bitstack = 0;
-    uint32_t location = 0;
+    for (int i = 0; i < 64; i++)
+    {
+        // round half up without branching, offset keeps floorf() argument positive
+        tmp_f = floorf(src[i] * q[i] + 1024 + 0.5f);
+        out[zz_index[i]] = (int16_t)(tmp_f - 1024);
+    }
+}
 
-    // when bitstack accumulates 8 bits. byte is appended to result
-    enc->result = buffer_alloc(0);
+/**
+ * @brief Huffman code single quantized block
+ * 
+ * @details Huffman code and magnitude bits of every coeff. are pushed
+ *          with single bitwriter_put(), at most 16 + 11 bits
+ * 
+ * @param enc 
+ * @param bw 
+ * @param mcu_zz quantized coeffs. in zig-zag order
+ * @param DC previous DC coeff. of the component. Updated
+ * @param dc_index 
+ * @param ac_index 
+ */
+static void jpeg_encode_block(jpeg_encoder_t enc, bitwriter* bw,
+                              const int16_t mcu_zz[64], int16_t* DC, int dc_index, int ac_index)
+{
+    uint8_t ac_byte; // zero count + AC coeff.
+    uint16_t mag[2]; // pow2 of value and bit representation of value
+    int i, zero_i, zero_count, diff;
 
-    uint8_t ac_byte;            // zero count + AC coeff.
-    uint16_t mag[2];            // pow2 of value and bit representation of value
-    uint8_t dc_index, ac_index; // specifies huffman and Q tables' indexes
+    // 64 coeffs. of 27 bits at most, all of them stuffed
+    bitwriter_reserve(bw, 64 * 27 / 8 * 2 + BITWRITER_WORD_MAX);
 
-    uint16_t W, H; // iterate image width, height
-    int i, j, k;   // iterate anything
-    float ycbcr[3];                       // for conversion RGB -> YCbCr
-    int block_index, src_index, col, row; // iterate over MCU inside picture
+    // DC coeff.
+    diff = mcu_zz[0] - *DC;
+    *DC = mcu_zz[0];
 
-    // tmp vals
-    float tmp_f;
-    int tmp_i, zero_i, zero_count, diff;
-    // float* memory = malloc(enc->width * enc->height * sizeof(float) * 3);
-    // size_t mem_offset = 0;
-    for (H = 0; H < enc->height; H += 8)
+    if (diff != 0)
+    {
+        get_magnitude(diff, mag);
+
+        bitwriter_put(bw,
+                      ((uint32_t)enc->ehuffcode[dc_index][mag[1]] << mag[1]) | mag[0],
+                      enc->ehuffsize[dc_index][mag[1]] + mag[1]);
+    }
+    else
+    {
+        bitwriter_put(bw, enc->ehuffcode[dc_index][0], enc->ehuffsize[dc_index][0]);
+    }
+
+    // AC coeffs.
+    zero_i = 0;
+    for (i = 63; i > 0; i--)
     {
-        for (W = 0; W < enc->width; W += 8)
+        if (mcu_zz[i] != 0)
         {
+            zero_i = i;
+            break;
+        }
+    }
 
-            for (i = 0; i < 8; i++)
+    for (i = 1; i <= zero_i; i++)
+    {
+        zero_count = 0;
+        for (;mcu_zz[i] == 0;)
+        {
+            zero_count++;
+            i++;
+            if (zero_count == 16)
             {
-                for (j = 0; j < 8; j++)
-                {
-                    block_index = (i * 8 + j);
-
-                    src_index = (((H + i) * enc->width) + (W + j)) * 3;
-
-                    col = W + j;
-                    row = H + i;
-
-                    if (row >= enc->height)
-                    {
-                        src_index -= (enc->width * (row - enc->height + 1)) * 3;
-                    }
-                    if (col >= enc->width)
-                    {
-                        src_index -= (col - enc->width + 1) * 3;
-                    }
-                    assert(src_index < enc->width * enc->height * 3);
-
-                    rgb_to_ycbcr(
-                        data[src_index + 0],
-                        data[src_index + 1],
-                        data[src_index + 2],
-                        ycbcr);
-
-                    for (k = 0; k < 3; k++)
-                    {
-                        mcu[k][block_index] = ycbcr[k];
-                    }
-                }
+                bitwriter_put(bw, enc->ehuffcode[ac_index][0xF0], enc->ehuffsize[ac_index][0xF0]);
+                zero_count = 0;
             }
+        }
 
-            // printf("BLOCK: %d\n", block++);
-            for (k = 0; k < 3; k++)
-            {
-                // DCT
-                if (!enc->use_fdct)
-                    dct_2d(mcu[k], mcu_dct);
-                else 
-                    tjei_fdct(mcu[k]);
-
-                // Quantize + Zig-Zag
-                for (i = 0; i < 64; i++)
-                {
-                    if (!enc->use_fdct){
-                        if (k == 0)
-                            tmp_f = mcu_dct[i] / (enc->q_table[0][i]);
-                        else
-                            tmp_f = mcu_dct[i] / (enc->q_table[1][i]);
-
-                        tmp_i = (int)((tmp_f > 0) ? floorf(tmp_f + 0.5f) : ceilf(tmp_f - 0.5f));
-                    } else {
-                        if (k == 0)
-                            tmp_f = mcu[k][i] * enc->fdct_q_table[0][i];
-                        else
-                            tmp_f = mcu[k][i] * enc->fdct_q_table[1][i];
-
-                        tmp_f = floorf(tmp_f + 1024 + 0.5f);
-                        tmp_f -= 1024;
-                        tmp_i = (int)(tmp_f);
-                    }
-
-
-                    mcu_zz[zz_index[i]] = tmp_i;
-                }
+        get_magnitude(mcu_zz[i], mag);
 
-                if (k == 0){ //Luma
-                    dc_index = 0;
-                    ac_index = 1;
-                } else { //Chroma
-                    dc_index = 2;
-                    ac_index = 3;
-                }
+        ac_byte = 0;
+        ((byte_nibble *)&ac_byte)->zeroes = zero_count;
+        ((byte_nibble *)&ac_byte)->category = mag[1];
 
-                // DC coeff.
-                diff = mcu_zz[0] - DC[k];
-                DC[k] = mcu_zz[0];
+        assert(zero_count < 0x10);
+        assert(mag[1] <= 10);
 
-                if (diff != 0)
-                {
-                    get_magnitude(diff, mag);
+        assert(enc->ehuffsize[ac_index][ac_byte] != 0);
 
-                    tjei_write_bits(enc, &bitstack, &location,
-                                    enc->ehuffsize[dc_index][mag[1]], 
-                                    enc->ehuffcode[dc_index][mag[1]]);
+        bitwriter_put(bw,
+                      ((uint32_t)enc->ehuffcode[ac_index][ac_byte] << mag[1]) | mag[0],
+                      enc->ehuffsize[ac_index][ac_byte] + mag[1]);
+    }
 
-                    tjei_write_bits(enc, &bitstack, &location, mag[1], mag[0]);
-                }
-                else
-                {
-                    tjei_write_bits(enc, &bitstack, &location,
-                                    enc->ehuffsize[dc_index][0], 
-                                    enc->ehuffcode[dc_index][0]);
-                }
+    if (zero_i != 63)
+    {
+        bitwriter_put(bw, enc->ehuffcode[ac_index][0], enc->ehuffsize[ac_index][0]);
+    }
+}
 
-                // AC coeffs.
-                zero_i = 0;
-                for (i = 63; i > 0; i--)
-                {
-                    if (mcu_zz[i] != 0)
-                    {
-                        zero_i = i;
-                        break;
-                    }
-                }
+/**
+ * @brief Luma sampling factors for chroma subsampling mode
+ * 
+ * @details Always 1x1 for grayscale
+ * 
+ * @param enc 
+ * @param h[out] horizontal
+ * @param v[out] vertical
+ */
+static void jpeg_sampling_factors(jpeg_encoder_t enc, int *h, int *v)
+{
+    if (enc->num_components == 1)
+    {
+        *h = *v = 1;
+        return;
+    }
 
-                for (i = 1; i <= zero_i; i++)
-                {
-                    zero_count = 0;
-                    for (;mcu_zz[i] == 0;)
-                    {
-                        zero_count++;
-                        i++;
-                        if (zero_count == 16)
-                        {
-                            tjei_write_bits(enc, &bitstack, &location, 
-                            enc->ehuffsize[ac_index][0xF0], 
-                            enc->ehuffcode[ac_index][0xF0]);
-                            zero_count = 0;
-                        }
-                    }
-
-                    get_magnitude(mcu_zz[i], mag);
-
-                    ac_byte = 0;
-                    ((byte_nibble *)&ac_byte)->zeroes = zero_count;
-                    ((byte_nibble *)&ac_byte)->category = mag[1];
-
-                    assert(zero_count < 0x10);
-                    assert(mag[1] <= 10);
-
-                    assert(enc->ehuffsize[ac_index][ac_byte] != 0);
-
-                    tjei_write_bits(enc, &bitstack, &location, 
-                    enc->ehuffsize[ac_index][ac_byte], 
-                    enc->ehuffcode[ac_index][ac_byte]);
-
-                    tjei_write_bits(enc, &bitstack, &location, mag[1], mag[0]);
-                }
+    *h = enc->subsampling == JPEG_444 ? 1 : 2;
+    *v = enc->subsampling == JPEG_420 ? 2 : 1;
+}
 
-                if (zero_i != 63)
-                {
-                    tjei_write_bits(enc, &bitstack, &location, 
-                    enc->ehuffsize[ac_index][0], 
-                    enc->ehuffcode[ac_index][0]);
-                }
-            }
-        }
+/**
+ * @brief YCbCr samples of one MCU row in planes
+ * 
+ * @details Row of samples covers whole MCUs plus 'border' samples on every
+ *          side. Samples outside of image repeat nearest edge pixel.
+ *          Sample (x, y) of image is at (border + y - y0) * stride + border + x
+ *          'plane' - float samples, when not DCT_ISLOW
+ *          'plane_i' - fixed-point samples, when DCT_ISLOW
+ */
+struct jpeg_mcu_row
+{
+    int border;
+    int rows;
+    size_t stride;
+    float *plane[3];
+    int16_t *plane_i[3];
+};
+
+/**
+ * @brief Allocates planes for MCU rows of image
+ */
+static void jpeg_mcu_row_init(jpeg_encoder_t enc, struct jpeg_mcu_row *row,
+                              unsigned mcus_per_row, unsigned mcu_w, unsigned mcu_h)
+{
+    int h, v;
+    jpeg_sampling_factors(enc, &h, &v);
+
+    row->border = (h * v > 1 && enc->chroma_filter == JPEG_FILTER_TRIANGLE) ? 1 : 0;
+    row->rows = (int)mcu_h + 2 * row->border;
+    row->stride = (size_t)mcus_per_row * mcu_w + 2 * row->border;
+
+    size_t plane_size = row->stride * row->rows;
+    int n = enc->num_components;
+
+    row->plane[0] = row->plane[1] = row->plane[2] = NULL;
+    row->plane_i[0] = row->plane_i[1] = row->plane_i[2] = NULL;
+
+    if (enc->dct == DCT_ISLOW)
+    {
+        row->plane_i[0] = (int16_t *)malloc(n * plane_size * sizeof(int16_t));
+        assert(row->plane_i[0] != NULL);
+        for (int k = 1; k < n; k++)
+            row->plane_i[k] = row->plane_i[k - 1] + plane_size;
+    }
+    else
+    {
+        row->plane[0] = (float *)malloc(n * plane_size * sizeof(float));
+        assert(row->plane[0] != NULL);
+        for (int k = 1; k < n; k++)
+            row->plane[k] = row->plane[k - 1] + plane_size;
     }
 }
 
-void jpeg_write_to_file(jpeg_encoder_t enc, const char *filename)
+static void jpeg_mcu_row_free(struct jpeg_mcu_row *row)
 {
-    FILE *out_file = fopen(filename, "wb");
+    free(row->plane[0]);
+    free(row->plane_i[0]);
+}
 
-    TJEJPEGHeader header;
-    char jfif_mark[5] = "JFIF";
-    char comment_str[] = "Created by Tiny JPEG Encoder";
+/**
+ * @brief Bytes per pixel of interleaved format, 1 for planar
+ */
+static int jpeg_pixel_size(jpeg_pixel_format format)
+{
+    static const int sizes[] = {3, 3, 4, 4, 1, 2, 1};
+    return sizes[format];
+}
 
-    // JFIF header.
-    header.SOI = tjei_be_word(0xffd8); // Sequential DCT
-    header.APP0 = tjei_be_word(0xffe0);
-    uint16_t jfif_len = sizeof(TJEJPEGHeader) - 4 /*SOI & APP0 markers*/;
-    header.jfif_len = tjei_be_word(jfif_len);
-    memcpy(header.jfif_id, jfif_mark, 5);
-    header.version = tjei_be_word(0x0102);
-    header.units = 1;
-    header.x_density = tjei_be_word(0x0060);
-    header.y_density = tjei_be_word(0x0060);
-    header.x_thumb = 0;
-    header.y_thumb = 0;
-    fwrite(&header, sizeof(TJEJPEGHeader), 1, out_file);
+/**
+ * @brief Converts single image row of any format into planes at 'off'
+ * 
+ * @details Interleaved formats only differ by channel pointers and pixel
+ *          size passed to enc->color_row. Gray is only centered
+ */
+static void jpeg_convert_row(jpeg_encoder_t enc, const jpeg_input *input, int y,
+                             struct jpeg_mcu_row *row, size_t off)
+{
+    int width = enc->width;
+    int step = jpeg_pixel_size(input->format);
+    size_t stride = input->stride != 0 ? input->stride : (size_t)width * step;
+    const uint8_t *src = input->data + (size_t)y * stride;
+    const uint8_t *r, *g, *b;
 
-    // Comment
-    TJEJPEGComment com;
-    com.com = tjei_be_word(0xfffe);
-    com.com_len = tjei_be_word(2 + sizeof(comment_str) - 1);
-    memcpy(com.com_str, comment_str, sizeof(comment_str) - 1);
-    fwrite(&com, sizeof(TJEJPEGComment), 1, out_file);
-
-    // Write Luma Q Table
-    uint16_t DQT = tjei_be_word(0xffdb);
-    uint8_t q_table[64];
-    fwrite(&DQT, sizeof(uint16_t), 1, out_file);
-    uint16_t len = tjei_be_word(67); // 2(len) + 1(id) + 64(matrix) = 67 = 0x43
-    fwrite(&len, sizeof(uint16_t), 1, out_file);
-    uint8_t precision_and_id = 0; // 0x0000 8 bits | 0x00id
-    fwrite(&precision_and_id, sizeof(uint8_t), 1, out_file);
-    for (int i = 0; i < 64; i++)
-        q_table[i] = enc->q_table[0][i];
-    fwrite(q_table, sizeof(uint8_t), 64 * sizeof(uint8_t), out_file);
-
-    // Write Chroma Q Table
-    fwrite(&DQT, sizeof(uint16_t), 1, out_file);
-    fwrite(&len, sizeof(uint16_t), 1, out_file);
-    precision_and_id = 1; // 0x0000 8 bits | 0x01id
-    fwrite(&precision_and_id, sizeof(uint8_t), 1, out_file);
-    for (int i = 0; i < 64; i++)
-        q_table[i] = enc->q_table[1][i];
-    fwrite(q_table, sizeof(uint8_t), 64 * sizeof(uint8_t), out_file);
+    switch (input->format)
+    {
+    case JPEG_PIXEL_GRAY:
+    case JPEG_PIXEL_GRAY_ALPHA:
+        if (enc->dct == DCT_ISLOW)
+            color_gray_row_fixed(src, step, width, row->plane_i[0] + off);
+        else
+            color_gray_row(src, step, width, row->plane[0] + off);
+        return;
+    case JPEG_PIXEL_BGR:
+    case JPEG_PIXEL_BGRA:
+        r = src + 2;
+        g = src + 1;
+        b = src;
+        break;
+    case JPEG_PIXEL_PLANAR:
+        r = input->planes[0] + (size_t)y * stride;
+        g = input->planes[1] + (size_t)y * stride;
+        b = input->planes[2] + (size_t)y * stride;
+        break;
+    default:
+        r = src;
+        g = src + 1;
+        b = src + 2;
+        break;
+    }
 
-    // WRITE FRAME
-    TJEFrameHeader frame_header;
-    frame_header.SOF = tjei_be_word(0xffc0);
-    frame_header.len = tjei_be_word(17);
-    frame_header.precision = 8;
-    frame_header.width = tjei_be_word((uint16_t)enc->width);
-    frame_header.height = tjei_be_word((uint16_t)enc->height);
-    frame_header.num_components = 3;
-    uint8_t tables[3] = {0, 1, 1};
-    for (int i = 0; i < 3; ++i)
+    if (enc->dct == DCT_ISLOW)
+        enc->color_row_fixed(r, g, b, step, width, row->plane_i[0] + off, row->plane_i[1] + off, row->plane_i[2] + off);
+    else
+        enc->color_row(r, g, b, step, width, row->plane[0] + off, row->plane[1] + off, row->plane[2] + off);
+}
+
+/**
+ * @brief Converts row 'y' of 'input' into row 'i' of planes
+ * 
+ * @details Row is converted by one enc->color_row call,
+ *          then edge samples are repeated into border and padding
+ */
+static void jpeg_mcu_row_put(jpeg_encoder_t enc, struct jpeg_mcu_row *row, const jpeg_input *input, int y, int i)
+{
+    int border = row->border;
+    int width = enc->width;
+    size_t pad = row->stride - border - width; // samples right of image
+    size_t off = (size_t)i * row->stride + border;
+
+    jpeg_convert_row(enc, input, y, row, off);
+
+    for (int k = 0; k < enc->num_components; k++)
     {
-        TJEComponentSpec spec;
-        spec.component_id = (uint8_t)(i + 1); // No particular reason. Just 1, 2, 3.
-        spec.sampling_factors = (uint8_t)17;
-        spec.qt = tables[i];
+        if (enc->dct == DCT_ISLOW)
+        {
+            int16_t *p = row->plane_i[k] + off;
+            for (int j = 1; j <= border; j++)
+                p[-j] = p[0];
+            for (size_t j = 0; j < pad; j++)
+                p[width + j] = p[width - 1];
+        }
+        else
+        {
+            float *p = row->plane[k] + off;
+            for (int j = 1; j <= border; j++)
+                p[-j] = p[0];
+            for (size_t j = 0; j < pad; j++)
+                p[width + j] = p[width - 1];
+        }
+    }
+}
 
-        frame_header.component_spec[i] = spec;
+/**
+ * @brief Copies row 'src' of planes into row 'dst'
+ */
+static void jpeg_mcu_row_copy(jpeg_encoder_t enc, struct jpeg_mcu_row *row, int dst, int src)
+{
+    for (int k = 0; k < enc->num_components; k++)
+    {
+        if (enc->dct == DCT_ISLOW)
+            memcpy(row->plane_i[k] + dst * row->stride, row->plane_i[k] + src * row->stride,
+                   row->stride * sizeof(int16_t));
+        else
+            memcpy(row->plane[k] + dst * row->stride, row->plane[k] + src * row->stride,
+                   row->stride * sizeof(float));
     }
-    fwrite(&frame_header, sizeof(TJEFrameHeader), 1, out_file);
+}
 
-    // WRITE HUFFMAN TABLES
-    write_DHT(out_file, enc->ht_bits[0], enc->ht_vals[0], 0, 0);
-    write_DHT(out_file, enc->ht_bits[1], enc->ht_vals[1], 1, 0);
+/**
+ * @brief Converts image rows of MCU row starting at 'y0' into planes
+ * 
+ * @details Rows above and below image repeat its edge rows
+ * 
+ * @param enc 
+ * @param row 
+ * @param input pixels of whole image
+ * @param y0 top of MCU row
+ */
+static void jpeg_mcu_row_fill(jpeg_encoder_t enc, struct jpeg_mcu_row *row, const jpeg_input *input, unsigned y0)
+{
+    for (int i = 0; i < row->rows; i++)
+    {
+        int y = (int)y0 - row->border + i;
+        y = y < 0 ? 0 : (y >= enc->height ? enc->height - 1 : y);
 
-    write_DHT(out_file, enc->ht_bits[2], enc->ht_vals[2], 0, 1);
-    write_DHT(out_file, enc->ht_bits[3], enc->ht_vals[3], 1, 1);
+        jpeg_mcu_row_put(enc, row, input, y, i);
+    }
+}
 
-    // WRITE SCAN HEADER
-    TJEScanHeader scan_header;
-    scan_header.SOS = tjei_be_word(0xffda);
-    scan_header.len = tjei_be_word((uint16_t)(6 + (sizeof(TJEFrameComponentSpec) * 3)));
-    scan_header.num_components = 3;
+/**
+ * @brief Builds 8x8 chroma block from window, downsampling by 'h' x 'v'
+ * 
+ * @details Box filter averages covered pixels. Triangle filter weights
+ *          1 3 3 1 over covered pixels and their neighbours in every
+ *          subsampled direction. Weights are powers of 2 so fixed-point
+ *          path uses shifts
+ * 
+ * @param enc 
+ * @param src window of single component starting 'border' samples
+ *            before MCU, see jpeg_mcu_row
+ * @param src_i same for DCT_ISLOW
+ * @param stride samples per row of 'src'
+ * @param h horizontal subsampling 1 or 2
+ * @param v vertical subsampling 1 or 2
+ * @param border window border
+ * @param out[out] float block
+ * @param out_i[out] fixed-point block
+ */
+static void jpeg_downsample_block(jpeg_encoder_t enc, const float *src, const int16_t *src_i, size_t stride,
+                                  int h, int v, int border, float out[64], int16_t out_i[64])
+{
+    static const int box[2] = {1, 1};
+    static const int tri[4] = {1, 3, 3, 1};
 
-    tables[0] = 0;
-    tables[1] = 0x11;
-    tables[2] = 0x11;
-    for (int i = 0; i < 3; ++i)
-    {
-        TJEFrameComponentSpec cs;
-        // Must be equal to component_id from frame header above.
-        cs.component_id = (uint8_t)(i + 1);
-        cs.dc_ac = (uint8_t)tables[i];
+    const int *wx = box, *wy = box;
+    int nx = h, ny = v, shift = 0;
+    int i, j, x, y;
 
-        scan_header.component_spec[i] = cs;
+    if (enc->chroma_filter == JPEG_FILTER_TRIANGLE && border)
+    {
+        // taps start one pixel before covered ones
+        if (h == 2)
+        {
+            wx = tri;
+            nx = 4;
+        }
+        if (v == 2)
+        {
+            wy = tri;
+            ny = 4;
+        }
     }
-    scan_header.first = 0;
-    scan_header.last = 63;
-    scan_header.ah_al = 0;
 
-    fwrite(&scan_header, sizeof(TJEScanHeader), 1, out_file);
+    // sum of weights is power of 2
+    int weight = 0;
+    for (y = 0; y < ny; y++)
+        for (x = 0; x < nx; x++)
+            weight += (ny == 1 ? 1 : wy[y]) * (nx == 1 ? 1 : wx[x]);
+    while ((1 << shift) < weight)
+        shift++;
 
-    fwrite(enc->result->data, sizeof(uint8_t), enc->result->size, out_file);
+    int off_x = border - (nx == 4 ? 1 : 0);
+    int off_y = border - (ny == 4 ? 1 : 0);
 
-    uint16_t EOI = tjei_be_word(0xffd9);
-    fwrite(&EOI, sizeof(uint16_t), 1, out_file);
-    fflush(out_file);
-    fclose(out_file);
-    return;
-}
\ No newline at end of file
+    for (i = 0; i < 8; i++)
+    {
+        for (j = 0; j < 8; j++)
+        {
+            size_t base = (off_y + i * v) * stride + off_x + j * h;
+            float sum = 0;
+            int32_t sum_i = 0;
+
+            for (y = 0; y < ny; y++)
+            {
+                for (x = 0; x < nx; x++)
+                {
+                    int wgt = (ny == 1 ? 1 : wy[y]) * (nx == 1 ? 1 : wx[x]);
+
+                    if (enc->dct == DCT_ISLOW)
+                        sum_i += wgt * src_i[base + y * stride + x];
+                    else
+                        sum += wgt * src[base + y * stride + x];
+                }
+            }
+
+            if (enc->dct == DCT_ISLOW)
+                out_i[i * 8 + j] = (int16_t)((sum_i + (1 << shift >> 1)) >> shift);
+            else
+                out[i * 8 + j] = sum / weight;
+        }
+    }
+}
+
+/**
+ * @brief Unquantized DCT of one block, any dct_method
+ * 
+ * @param enc 
+ * @param block float samples. Clobbered by DCT_AAN
+ * @param block_i fixed-point samples for DCT_ISLOW
+ * @param out coeffs. in natural order scaled by 8, same as dct_islow()
+ */
+static void jpeg_dct_block_raw(jpeg_encoder_t enc, float block[64], const int16_t block_i[64], int16_t out[64])
+{
+    int32_t coeffs_i[64];
+    float coeffs[64];
+    int x, y;
+
+    switch (enc->dct)
+    {
+    case DCT_ISLOW:
+        dct_islow(block_i, coeffs_i);
+        for (int i = 0; i < 64; i++)
+            out[i] = (int16_t)coeffs_i[i];
+        break;
+    case DCT_AAN:
+        // AAN output is scaled by 8 * aan_scales[u] * aan_scales[v]
+        enc->fdct_aan(block);
+        for (y = 0; y < 8; y++)
+            for (x = 0; x < 8; x++)
+                out[y * 8 + x] = (int16_t)lrintf(block[y * 8 + x] / (aan_scales[x] * aan_scales[y]));
+        break;
+    case DCT_REFERENCE:
+        dct_2d(block, coeffs);
+        for (int i = 0; i < 64; i++)
+            out[i] = (int16_t)lrintf(coeffs[i] * 8);
+        break;
+    default:
+        dct_2d_separable(block, coeffs);
+        for (int i = 0; i < 64; i++)
+            out[i] = (int16_t)lrintf(coeffs[i] * 8);
+        break;
+    }
+}
+
+/**
+ * @brief Quantization + zig-zag of block from jpeg_dct_block_raw()
+ * 
+ * @details Same reciprocal quantization as DCT_ISLOW for every dct_method
+ * 
+ * @param enc 
+ * @param raw coeffs. scaled by 8
+ * @param q_index 0 - Luma; 1 - Chroma
+ * @param out quantized coeffs. in zig-zag order
+ * @return double squared error, scaled by 64
+ */
+static double jpeg_quantize_raw(jpeg_encoder_t enc, const int16_t raw[64], int q_index, int16_t out[64])
+{
+    const uint32_t* recip = enc->islow_recip[q_index];
+    const uint16_t* bias = enc->islow_bias[q_index];
+    const uint8_t* shift = enc->islow_shift[q_index];
+    const uint8_t* q = enc->q_table[q_index];
+    int32_t value, err, sse = 0;
+    uint32_t n;
+
+    for (int i = 0; i < 64; i++)
+    {
+        n = (uint32_t)(raw[i] < 0 ? -raw[i] : raw[i]) + bias[i];
+        n = (n * recip[i]) >> shift[i];
+        value = raw[i] < 0 ? -(int32_t)n : (int32_t)n;
+
+        out[zz_index[i]] = (int16_t)value;
+
+        // |err| <= 4 * q, fits 32 bits summed over block
+        err = raw[i] - 8 * q[zz_index[i]] * value;
+        sse += err * err;
+    }
+
+    return sse;
+}
+
+/**
+ * @brief Squared error of already quantized block, same scale as jpeg_quantize_raw()
+ * 
+ * @param coef quantized coeffs. in zig-zag order
+ */
+static double jpeg_block_sse(jpeg_encoder_t enc, const int16_t raw[64], int q_index, const int16_t coef[64])
+{
+    const uint8_t* q = enc->q_table[q_index];
+    int32_t err, sse = 0;
+
+    for (int i = 0; i < 64; i++)
+    {
+        err = raw[i] - 8 * q[zz_index[i]] * coef[zz_index[i]];
+        sse += err * err;
+    }
+
+    return sse;
+}
+
+/**
+ * @brief Number of bits of 'value', magnitude category of coeff.
+ */
+static inline int jpeg_nbits(unsigned value)
+{
+    return value == 0 ? 0 : 32 - __builtin_clz(value);
+}
+
+// lambda = SCALE1 / (SCALE2 + mean AC energy), 2^14.75 and 2^16.5 of mozjpeg
+#define JPEG_TRELLIS_SCALE1 27554.5f
+#define JPEG_TRELLIS_SCALE2 92681.9f
+
+/**
+ * @brief Code length of Huffman symbol for trellis costs
+ * 
+ * @details Symbols missing from optimized tables get long code,
+ *          tables are rebuilt from trellis output anyway
+ */
+static inline int jpeg_trellis_bits(jpeg_encoder_t enc, int table, int symbol)
+{
+    int size = enc->ehuffsize[table][symbol];
+    return size != 0 ? size : 16;
+}
+
+/**
+ * @brief Rate-distortion optimized quantization of block, JPEG "trellis"
+ * 
+ * @details DC is rounded. AC coeffs. are picked by dynamic programming
+ *          over zig-zag positions minimizing bits + lambda * error^2
+ *          under current Huffman tables, same model as mozjpeg.
+ *          Every nonzero coeff. tries largest value of every smaller
+ *          magnitude category and the rounded one. Zeros and EOB are
+ *          covered by choosing previous nonzero coeff. and last one
+ * 
+ * @param enc 
+ * @param raw coeffs. scaled by 8, see jpeg_dct_block_raw()
+ * @param q_index 0 - Luma; 1 - Chroma
+ * @param ac_table Huffman table of AC coeffs.
+ * @param out quantized coeffs. in zig-zag order
+ */
+static void jpeg_trellis_block(jpeg_encoder_t enc, const int16_t raw[64], int q_index, int ac_table, int16_t out[64])
+{
+    const uint8_t *q = enc->q_table[q_index];
+    int16_t zz[64];     // raw in zig-zag order
+    int x[64];          // |raw| in zig-zag order
+    float w[64];        // lambda / q^2, error weight of coeff.
+    float zero[64];     // cost of zeros up to position, prefix sums
+    float cost[64];     // best cost of block ending with nonzero coeff.
+    int prev[64];       // previous nonzero coeff. of that path
+    int16_t value[64];  // coeff. of that path
+    float norm = 0;
+
+    // rounded coeffs. give DC and candidates
+    jpeg_quantize_raw(enc, raw, q_index, out);
+
+    for (int i = 0; i < 64; i++)
+        zz[zz_index[i]] = raw[i];
+    for (int k = 0; k < 64; k++)
+        x[k] = zz[k] < 0 ? -zz[k] : zz[k];
+
+    for (int k = 1; k < 64; k++)
+        norm += (float)x[k] * x[k];
+    norm /= 63;
+
+    // smooth blocks get larger lambda, errors there are more visible
+    // than in textured ones. constants of mozjpeg
+    float lambda = JPEG_TRELLIS_SCALE1 / (JPEG_TRELLIS_SCALE2 + norm);
+
+    int zrl = jpeg_trellis_bits(enc, ac_table, 0xF0);
+
+    zero[0] = 0;
+    cost[0] = 0;
+    for (int k = 1; k < 64; k++)
+    {
+        w[k] = lambda / ((float)q[k] * q[k]);
+        zero[k] = zero[k - 1] + w[k] * (float)x[k] * x[k];
+    }
+
+    for (int k = 1; k < 64; k++)
+    {
+        int qval = out[k] < 0 ? -out[k] : out[k];
+        int step = 8 * q[k];
+
+        cost[k] = FLT_MAX;
+        if (qval == 0)
+            continue;
+
+        int n_cand = jpeg_nbits((unsigned)qval);
+
+        for (int c = 0; c < n_cand; c++)
+        {
+            int cand = c < n_cand - 1 ? (2 << c) - 1 : qval;
+            int size = c + 1;
+            float delta = (float)(cand * step - x[k]);
+            float dist = w[k] * delta * delta;
+
+            // previous nonzero coeff. at j, zeros in between
+            for (int j = k - 1; j >= 0; j--)
+            {
+                if (cost[j] == FLT_MAX)
+                    continue;
+
+                int run = k - j - 1;
+                float total = cost[j] + zero[k - 1] - zero[j] + dist +
+                              (float)((run >> 4) * zrl +
+                                      jpeg_trellis_bits(enc, ac_table, ((run & 15) << 4) | size) + size);
+
+                if (total < cost[k])
+                {
+                    cost[k] = total;
+                    prev[k] = j;
+                    value[k] = (int16_t)cand;
+                }
+            }
+        }
+    }
+
+    // last nonzero coeff., 0 - all AC zero
+    int eob = jpeg_trellis_bits(enc, ac_table, 0x00);
+    int last = 0;
+    float best = zero[63] + eob;
+
+    for (int k = 1; k < 64; k++)
+    {
+        if (cost[k] == FLT_MAX)
+            continue;
+
+        float total = cost[k] + zero[63] - zero[k] + (k < 63 ? eob : 0);
+        if (total < best)
+        {
+            best = total;
+            last = k;
+        }
+    }
+
+    for (int k = 1; k < 64; k++)
+        out[k] = 0;
+
+    for (int k = last; k > 0; k = prev[k])
+        out[k] = zz[k] < 0 ? -value[k] : value[k];
+}
+
+/**
+ * @brief DCT and quantization of one block from MCU
+ * 
+ * @details With 'raw' set coeffs. are left unquantized, see jpeg_dct_block_raw()
+ */
+static void jpeg_quantize_block(jpeg_encoder_t enc, float block[64], const int16_t block_i[64],
+                                int comp, int raw, int16_t out[64])
+{
+    if (raw)
+        jpeg_dct_block_raw(enc, block, block_i, out);
+    // comp == 0 Luma; else Chroma
+    else if (enc->dct == DCT_ISLOW)
+        jpeg_transform_block_islow(enc, block_i, comp == 0 ? 0 : 1, out);
+    else
+        jpeg_transform_block(enc, block, comp == 0 ? 0 : 1, out);
+}
+
+/**
+ * @brief Transforms and quantizes single MCU at 'x0' of converted MCU row
+ * 
+ * @details MCU is 8x8 for 4:4:4, 16x8 for 4:2:2 and 16x16 for 4:2:0:
+ *          all luma blocks left to right, top to bottom, then Cb and Cr
+ * 
+ * @param enc 
+ * @param row see jpeg_mcu_row_fill()
+ * @param x0 
+ * @param raw 1 - unquantized coeffs., see jpeg_dct_block_raw()
+ * @param blocks[out] quantized blocks in zig-zag order, see jpeg_blocks_per_mcu()
+ */
+static void jpeg_transform_mcu(jpeg_encoder_t enc, const struct jpeg_mcu_row *row,
+                               unsigned x0, int raw, int16_t (*blocks)[64])
+{
+    float block[64];
+    int16_t block_i[64];
+    int i, bx, by, n = 0;
+    int border = row->border;
+    size_t stride = row->stride;
+
+    int h, v; // luma sampling factors
+    jpeg_sampling_factors(enc, &h, &v);
+
+    for (by = 0; by < v; by++)
+    {
+        for (bx = 0; bx < h; bx++)
+        {
+            size_t base = (border + by * 8) * stride + border + x0 + bx * 8;
+
+            for (i = 0; i < 8; i++)
+            {
+                if (enc->dct == DCT_ISLOW)
+                    memcpy(block_i + i * 8, row->plane_i[0] + base + i * stride, 8 * sizeof(int16_t));
+                else
+                    memcpy(block + i * 8, row->plane[0] + base + i * stride, 8 * sizeof(float));
+            }
+
+            jpeg_quantize_block(enc, block, block_i, 0, raw, blocks[n++]);
+        }
+    }
+
+    // window of MCU starts 'border' samples before it, that is x0 in planes
+    for (int k = 1; k < enc->num_components; k++)
+    {
+        if (enc->dct == DCT_ISLOW)
+            jpeg_downsample_block(enc, NULL, row->plane_i[k] + x0, stride, h, v, border, block, block_i);
+        else
+            jpeg_downsample_block(enc, row->plane[k] + x0, NULL, stride, h, v, border, block, block_i);
+
+        jpeg_quantize_block(enc, block, block_i, k, raw, blocks[n++]);
+    }
+}
+
+/**
+ * @brief Number of 8x8 blocks in single MCU
+ */
+static int jpeg_blocks_per_mcu(jpeg_encoder_t enc)
+{
+    int h, v;
+    jpeg_sampling_factors(enc, &h, &v);
+    return h * v + enc->num_components - 1;
+}
+
+/**
+ * @brief Number of luma blocks in MCU of 'blocks_per_mcu' blocks
+ */
+static inline int jpeg_luma_blocks(int blocks_per_mcu)
+{
+    // grayscale MCU is single block, color MCU ends with Cb and Cr
+    return blocks_per_mcu == 1 ? 1 : blocks_per_mcu - 2;
+}
+
+/**
+ * @brief Component of n-th block in MCU. 0 - Y; 1 - Cb; 2 - Cr
+ */
+static inline int jpeg_block_component(int n, int blocks_per_mcu)
+{
+    int luma = jpeg_luma_blocks(blocks_per_mcu);
+    return n < luma ? 0 : n - luma + 1;
+}
+
+/**
+ * @brief Adds Huffman symbols of single block to statistics
+ * 
+ * @param mcu_zz quantized coeffs. in zig-zag order
+ * @param DC previous DC coeff. of the component. Updated
+ * @param freq_dc DC symbol counts
+ * @param freq_ac AC symbol counts
+ */
+static void jpeg_count_block(const int16_t mcu_zz[64], int16_t *DC, uint32_t freq_dc[257], uint32_t freq_ac[257])
+{
+    uint16_t mag[2];
+    int i, zero_i, zero_count;
+
+    if (mcu_zz[0] - *DC != 0)
+    {
+        get_magnitude(mcu_zz[0] - *DC, mag);
+        freq_dc[mag[1]]++;
+    }
+    else
+    {
+        freq_dc[0]++;
+    }
+    *DC = mcu_zz[0];
+
+    zero_i = 0;
+    for (i = 63; i > 0; i--)
+    {
+        if (mcu_zz[i] != 0)
+        {
+            zero_i = i;
+            break;
+        }
+    }
+
+    zero_count = 0;
+    for (i = 1; i <= zero_i; i++)
+    {
+        if (mcu_zz[i] == 0)
+        {
+            zero_count++;
+            continue;
+        }
+
+        for (; zero_count >= 16; zero_count -= 16)
+            freq_ac[0xF0]++;
+
+        get_magnitude(mcu_zz[i], mag);
+        freq_ac[(zero_count << 4) | mag[1]]++;
+        zero_count = 0;
+    }
+
+    if (zero_i != 63)
+        freq_ac[0]++;
+}
+
+/**
+ * @brief State shared by all bands of single jpeg_encode_data() call
+ * 
+ * @details Bands are restart intervals (or whole image) made of MCU rows
+ *          'coef' - quantized blocks of whole image in MCU order.
+ *          NULL when blocks are Huffman coded right after quantization
+ *          'freq' - Huffman symbol counts per band, when optimizing tables
+ *          'bands' - encoded data per band
+ *          'raw' - unquantized coeffs. of whole image for rate control,
+ *          natural order scaled by 8. 'sse' - luma squared error per band
+ */
+struct jpeg_scan
+{
+    jpeg_encoder_t enc;
+    const jpeg_input *input;
+    unsigned mcu_w;
+    unsigned mcu_h;
+    unsigned mcus_per_row;
+    unsigned mcu_rows;
+    unsigned rows_per_band;
+    unsigned n_bands;
+    int blocks_per_mcu;
+
+    int16_t (*coef)[64];
+    uint32_t (*freq)[4][257];
+    buffer_t *bands;
+
+    int16_t (*raw)[64];
+    double *sse;
+};
+
+typedef void (*jpeg_band_fn)(struct jpeg_scan *scan, unsigned band);
+
+/**
+ * @brief First and last + 1 MCU of band
+ */
+static void jpeg_band_range(struct jpeg_scan *scan, unsigned band, size_t *begin, size_t *end)
+{
+    unsigned row_end = (band + 1) * scan->rows_per_band;
+
+    if (row_end > scan->mcu_rows)
+        row_end = scan->mcu_rows;
+
+    *begin = (size_t)band * scan->rows_per_band * scan->mcus_per_row;
+    *end = (size_t)row_end * scan->mcus_per_row;
+}
+
+/**
+ * @brief Quantized blocks of band into scan->coef
+ */
+static void jpeg_band_transform(struct jpeg_scan *scan, unsigned band)
+{
+    size_t begin, end;
+    struct jpeg_mcu_row row;
+
+    jpeg_band_range(scan, band, &begin, &end);
+    jpeg_mcu_row_init(scan->enc, &row, scan->mcus_per_row, scan->mcu_w, scan->mcu_h);
+
+    for (size_t m = begin; m < end; m++)
+    {
+        // bands are made of whole MCU rows
+        if (m % scan->mcus_per_row == 0)
+            jpeg_mcu_row_fill(scan->enc, &row, scan->input, (unsigned)(m / scan->mcus_per_row) * scan->mcu_h);
+
+        jpeg_transform_mcu(scan->enc, &row, (unsigned)(m % scan->mcus_per_row) * scan->mcu_w,
+                           0, scan->coef + m * scan->blocks_per_mcu);
+    }
+
+    jpeg_mcu_row_free(&row);
+}
+
+/**
+ * @brief Unquantized blocks of band into scan->raw
+ */
+static void jpeg_band_dct(struct jpeg_scan *scan, unsigned band)
+{
+    size_t begin, end;
+    struct jpeg_mcu_row row;
+
+    jpeg_band_range(scan, band, &begin, &end);
+    jpeg_mcu_row_init(scan->enc, &row, scan->mcus_per_row, scan->mcu_w, scan->mcu_h);
+
+    for (size_t m = begin; m < end; m++)
+    {
+        // bands are made of whole MCU rows
+        if (m % scan->mcus_per_row == 0)
+            jpeg_mcu_row_fill(scan->enc, &row, scan->input, (unsigned)(m / scan->mcus_per_row) * scan->mcu_h);
+
+        jpeg_transform_mcu(scan->enc, &row, (unsigned)(m % scan->mcus_per_row) * scan->mcu_w,
+                           1, scan->raw + m * scan->blocks_per_mcu);
+    }
+
+    jpeg_mcu_row_free(&row);
+}
+
+/**
+ * @brief Quantizes scan->raw of band into scan->coef, luma error into scan->sse
+ */
+static void jpeg_band_quantize(struct jpeg_scan *scan, unsigned band)
+{
+    size_t begin, end;
+    double sse = 0;
+
+    jpeg_band_range(scan, band, &begin, &end);
+
+    for (size_t i = begin * scan->blocks_per_mcu; i < end * scan->blocks_per_mcu; i++)
+    {
+        int k = jpeg_block_component((int)(i % scan->blocks_per_mcu), scan->blocks_per_mcu);
+
+        if (k == 0)
+            sse += jpeg_quantize_raw(scan->enc, scan->raw[i], 0, scan->coef[i]);
+        else
+            jpeg_quantize_raw(scan->enc, scan->raw[i], 1, scan->coef[i]);
+    }
+
+    scan->sse[band] = sse;
+}
+
+/**
+ * @brief Trellis quantization of scan->raw of band into scan->coef, luma error into scan->sse
+ */
+static void jpeg_band_trellis(struct jpeg_scan *scan, unsigned band)
+{
+    size_t begin, end;
+    double sse = 0;
+
+    jpeg_band_range(scan, band, &begin, &end);
+
+    for (size_t i = begin * scan->blocks_per_mcu; i < end * scan->blocks_per_mcu; i++)
+    {
+        int k = jpeg_block_component((int)(i % scan->blocks_per_mcu), scan->blocks_per_mcu);
+
+        jpeg_trellis_block(scan->enc, scan->raw[i], k == 0 ? 0 : 1, k == 0 ? 1 : 3, scan->coef[i]);
+        if (k == 0)
+            sse += jpeg_block_sse(scan->enc, scan->raw[i], 0, scan->coef[i]);
+    }
+
+    scan->sse[band] = sse;
+}
+
+/**
+ * @brief Huffman symbol statistics of band from scan->coef
+ */
+static void jpeg_band_count(struct jpeg_scan *scan, unsigned band)
+{
+    size_t begin, end;
+    int16_t DC[3] = {0, 0, 0};
+    uint32_t(*freq)[257] = scan->freq[band];
+
+    jpeg_band_range(scan, band, &begin, &end);
+    memset(freq, 0, sizeof(scan->freq[band]));
+
+    for (size_t m = begin; m < end; m++)
+    {
+        for (int n = 0; n < scan->blocks_per_mcu; n++)
+        {
+            int k = jpeg_block_component(n, scan->blocks_per_mcu);
+
+            // tables: 0 Luma DC; 1 Luma AC; 2 Chroma DC; 3 Chroma AC
+            jpeg_count_block(scan->coef[m * scan->blocks_per_mcu + n], &DC[k],
+                             freq[k == 0 ? 0 : 2], freq[k == 0 ? 1 : 3]);
+        }
+    }
+}
+
+/**
+ * @brief Huffman codes band into scan->bands[band]
+ * 
+ * @details DC predictors start from 0 and output is padded to byte boundary
+ *          so every band is self contained restart interval.
+ *          Blocks come from scan->coef or are produced on the go
+ */
+static void jpeg_band_encode(struct jpeg_scan *scan, unsigned band)
+{
+    jpeg_encoder_t enc = scan->enc;
+    int16_t mcu[6][64]; // MCU blocks when not stored
+    int16_t (*blocks)[64];
+    int16_t DC[3] = {0, 0, 0}; // DC coeff. for each component
+    size_t begin, end;
+    struct jpeg_mcu_row row;
+    bitwriter bw;
+
+    bitwriter_init(&bw, scan->bands[band]);
+
+    jpeg_band_range(scan, band, &begin, &end);
+
+    if (scan->coef == NULL)
+        jpeg_mcu_row_init(enc, &row, scan->mcus_per_row, scan->mcu_w, scan->mcu_h);
+
+    for (size_t m = begin; m < end; m++)
+    {
+        if (scan->coef != NULL)
+        {
+            blocks = scan->coef + m * scan->blocks_per_mcu;
+        }
+        else
+        {
+            if (m % scan->mcus_per_row == 0)
+                jpeg_mcu_row_fill(enc, &row, scan->input, (unsigned)(m / scan->mcus_per_row) * scan->mcu_h);
+
+            blocks = mcu;
+            jpeg_transform_mcu(enc, &row, (unsigned)(m % scan->mcus_per_row) * scan->mcu_w, 0, blocks);
+        }
+
+        for (int n = 0; n < scan->blocks_per_mcu; n++)
+        {
+            int k = jpeg_block_component(n, scan->blocks_per_mcu);
+
+            jpeg_encode_block(enc, &bw, blocks[n], &DC[k],
+                              k == 0 ? 0 : 2, k == 0 ? 1 : 3);
+        }
+    }
+
+    // flush remaining bits. padding is filled with 1s (JPEG spec. F.1.2.3)
+    bitwriter_flush(&bw);
+
+    if (scan->coef == NULL)
+        jpeg_mcu_row_free(&row);
+}
+
+/**
+ * @brief Work of single thread: every 'step'-th band starting from 'first'
+ */
+struct jpeg_band_job
+{
+    struct jpeg_scan *scan;
+    jpeg_band_fn fn;
+    unsigned first;
+    unsigned step;
+    int joined; // ran on calling thread, nothing to join
+};
+
+static void *jpeg_band_worker(void *arg)
+{
+    struct jpeg_band_job *job = (struct jpeg_band_job *)arg;
+
+    for (unsigned b = job->first; b < job->scan->n_bands; b += job->step)
+        job->fn(job->scan, b);
+
+    return NULL;
+}
+
+/**
+ * @brief Runs 'fn' for every band using up to enc->num_threads threads
+ */
+static void jpeg_run_bands(struct jpeg_scan *scan, jpeg_band_fn fn)
+{
+    unsigned n_threads = (unsigned)scan->enc->num_threads;
+
+    if (n_threads > scan->n_bands)
+        n_threads = scan->n_bands;
+
+    if (n_threads <= 1)
+    {
+        for (unsigned b = 0; b < scan->n_bands; b++)
+            fn(scan, b);
+        return;
+    }
+
+    struct jpeg_band_job *jobs = (struct jpeg_band_job *)malloc(n_threads * sizeof(struct jpeg_band_job));
+    pthread_t *threads = (pthread_t *)malloc(n_threads * sizeof(pthread_t));
+
+    for (unsigned t = 0; t < n_threads; t++)
+    {
+        jobs[t].scan = scan;
+        jobs[t].fn = fn;
+        jobs[t].first = t;
+        jobs[t].step = n_threads;
+        jobs[t].joined = 0;
+    }
+
+    // calling thread takes first job
+    for (unsigned t = 1; t < n_threads; t++)
+    {
+        if (pthread_create(&threads[t], NULL, jpeg_band_worker, &jobs[t]) != 0)
+        {
+            // no more threads, this one does the job
+            jpeg_band_worker(&jobs[t]);
+            jobs[t].joined = 1;
+        }
+    }
+
+    jpeg_band_worker(&jobs[0]);
+
+    for (unsigned t = 1; t < n_threads; t++)
+    {
+        if (!jobs[t].joined)
+            pthread_join(threads[t], NULL);
+    }
+
+    free(threads);
+    free(jobs);
+}
+
+/**
+ * @brief 1 if any symbol of table has nonzero count
+ */
+static int jpeg_freq_used(const uint32_t freq[257])
+{
+    for (int i = 0; i < 256; i++)
+        if (freq[i] != 0)
+            return 1;
+    return 0;
+}
+
+/**
+ * @brief Builds tables from symbol counts, default tables for unused ones
+ */
+static void jpeg_setup_tables_from_freq(jpeg_encoder_t enc, uint32_t freq[4][257])
+{
+    jpeg_setup_default_huffman_tables(enc);
+
+    for (int t = 0; t < 4; t++)
+    {
+        // nothing to code, default table is as good as any
+        if (!jpeg_freq_used(freq[t]))
+            continue;
+
+        jpeg_build_huffman_table(freq[t], enc->opt_bits[t], enc->opt_vals[t]);
+        enc->ht_bits[t] = enc->opt_bits[t];
+        enc->ht_vals[t] = enc->opt_vals[t];
+    }
+
+    jpeg_setup_huffman_codes(enc);
+}
+
+/**
+ * @brief Builds per image Huffman tables from statistics of all bands
+ */
+static void jpeg_setup_optimal_huffman_tables(jpeg_encoder_t enc, struct jpeg_scan *scan)
+{
+    uint32_t freq[4][257];
+
+    memset(freq, 0, sizeof(freq));
+    for (unsigned b = 0; b < scan->n_bands; b++)
+        for (int t = 0; t < 4; t++)
+            for (int i = 0; i < 257; i++)
+                freq[t][i] += scan->freq[b][t][i];
+
+    jpeg_setup_tables_from_freq(enc, freq);
+}
+
+size_t jpeg_estimate_size(jpeg_encoder_t enc, unsigned width, unsigned height)
+{
+    // rough fit on test images: bits per pixel ~ 16 / sqrt(avg. luma q)
+    // errs on the large side, it's only reserved memory
+    float avg_q = 0;
+    for (int i = 0; i < 64; i++)
+        avg_q += enc->q_table[0][i];
+    avg_q /= 64;
+
+    float bpp = 16.0f / sqrtf(avg_q);
+
+    // subsampled chroma has 1/2 (4:2:2) or 1/4 (4:2:0) of blocks, gray has none
+    int h, v;
+    jpeg_sampling_factors(enc, &h, &v);
+    bpp *= (h * v + enc->num_components - 1.0f) / (3.0f * h * v);
+
+    return 1024 + (size_t)((double)width * height * bpp / 8);
+}
+
+/**
+ * @brief Picks MCU rows per restart interval, sets enc->restart_interval
+ * 
+ * @param enc 
+ * @param mcus_per_row 
+ * @param mcu_rows 
+ * @param num_threads threads encoding intervals in parallel
+ * @return unsigned MCU rows per interval, 'mcu_rows' without restart markers
+ */
+static unsigned jpeg_restart_rows(jpeg_encoder_t enc, unsigned mcus_per_row, unsigned mcu_rows, int num_threads)
+{
+    unsigned rows_per_band = enc->restart_rows;
+
+    // threads need independent intervals. ~4 bands per thread to balance load
+    if (rows_per_band == 0 && num_threads > 1)
+        rows_per_band = (mcu_rows + num_threads * 4 - 1) / (num_threads * 4);
+
+    // DRI holds 16 bit count of MCUs
+    if (rows_per_band > 0 && rows_per_band * mcus_per_row > 0xFFFF)
+        rows_per_band = 0xFFFF / mcus_per_row;
+
+    if (rows_per_band == 0 || rows_per_band >= mcu_rows)
+    {
+        enc->restart_interval = 0;
+        return mcu_rows;
+    }
+
+    enc->restart_interval = (uint16_t)(rows_per_band * mcus_per_row);
+    return rows_per_band;
+}
+
+/**
+ * @brief Sets up MCU grid, bands and band buffers of whole image scan
+ * 
+ * @details Picks restart interval. Tables must be set up,
+ *          they are used to estimate size of band buffers
+ */
+static void jpeg_scan_init(jpeg_encoder_t enc, struct jpeg_scan *scan,
+                           unsigned width, unsigned height, const jpeg_input *input)
+{
+    int h, v;
+    jpeg_sampling_factors(enc, &h, &v);
+
+    scan->enc = enc;
+    scan->input = input;
+    scan->mcu_w = 8 * h;
+    scan->mcu_h = 8 * v;
+    scan->mcus_per_row = (width + scan->mcu_w - 1) / scan->mcu_w;
+    scan->mcu_rows = (height + scan->mcu_h - 1) / scan->mcu_h;
+    scan->blocks_per_mcu = jpeg_blocks_per_mcu(enc);
+    scan->coef = NULL;
+    scan->freq = NULL;
+    scan->raw = NULL;
+    scan->sse = NULL;
+
+    scan->rows_per_band = jpeg_restart_rows(enc, scan->mcus_per_row, scan->mcu_rows, enc->num_threads);
+    scan->n_bands = (scan->mcu_rows + scan->rows_per_band - 1) / scan->rows_per_band;
+
+    // band buffers live in encoder, only new ones are allocated
+    if (scan->n_bands > enc->bands_cap)
+    {
+        enc->bands = (buffer_t *)realloc(enc->bands, scan->n_bands * sizeof(buffer_t));
+        assert(enc->bands != NULL);
+
+        for (size_t b = enc->bands_cap; b < scan->n_bands; b++)
+            enc->bands[b] = buffer_alloc(0);
+        enc->bands_cap = scan->n_bands;
+    }
+    scan->bands = enc->bands;
+
+    size_t estimate = jpeg_estimate_size(enc, width, height);
+
+    for (unsigned b = 0; b < scan->n_bands; b++)
+    {
+        scan->bands[b]->size = 0;
+        buffer_reserve(scan->bands[b], estimate / scan->n_bands);
+    }
+}
+
+/**
+ * @brief Points scan->coef and scan->freq to encoder scratch of whole image
+ */
+static void jpeg_scan_keep_coef(jpeg_encoder_t enc, struct jpeg_scan *scan)
+{
+    enc->coef = (int16_t(*)[64])jpeg_scratch(enc->coef, &enc->coef_cap,
+                                             (size_t)scan->mcus_per_row * scan->mcu_rows * scan->blocks_per_mcu,
+                                             sizeof(*enc->coef));
+    enc->freq = (uint32_t(*)[4][257])jpeg_scratch(enc->freq, &enc->freq_cap,
+                                                  scan->n_bands, sizeof(*enc->freq));
+    scan->coef = enc->coef;
+    scan->freq = enc->freq;
+}
+
+/**
+ * @brief Points scan->raw and scan->sse to encoder scratch of whole image
+ */
+static void jpeg_scan_keep_raw(jpeg_encoder_t enc, struct jpeg_scan *scan)
+{
+    enc->raw = (int16_t(*)[64])jpeg_scratch(enc->raw, &enc->raw_cap,
+                                            (size_t)scan->mcus_per_row * scan->mcu_rows * scan->blocks_per_mcu,
+                                            sizeof(*enc->raw));
+    enc->sse = (double *)jpeg_scratch(enc->sse, &enc->sse_cap, scan->n_bands, sizeof(*enc->sse));
+    scan->raw = enc->raw;
+    scan->sse = enc->sse;
+}
+
+/**
+ * @brief Joins encoded bands into enc->result
+ */
+static void jpeg_scan_splice(jpeg_encoder_t enc, struct jpeg_scan *scan)
+{
+    // splice intervals, RSTn markers cycle 0..7 between them
+    size_t total = 0;
+    for (unsigned b = 0; b < scan->n_bands; b++)
+        total += scan->bands[b]->size + 2;
+
+    enc->result->size = 0;
+    buffer_reserve(enc->result, total);
+
+    for (unsigned b = 0; b < scan->n_bands; b++)
+    {
+        if (b > 0)
+            buffer_append_u16be(enc->result, (uint16_t)(0xFFD0 + ((b - 1) & 7)));
+
+        if (scan->bands[b]->size != 0)
+            buffer_append(enc->result, scan->bands[b]->data, scan->bands[b]->size);
+    }
+}
+
+/**
+ * @brief Default scan script for YCbCr, same as libjpeg jpeg_simple_progression()
+ * 
+ * @details DC of all components with 1 bit less, then low luma AC,
+ *          chroma AC, high luma AC and refinement of skipped bits
+ */
+static const jpeg_scan_info jpeg_script_color[] = {
+    {3, {0, 1, 2}, 0, 0, 0, 1},
+    {1, {0}, 1, 5, 0, 2},
+    {1, {2}, 1, 63, 0, 1},
+    {1, {1}, 1, 63, 0, 1},
+    {1, {0}, 6, 63, 0, 2},
+    {1, {0}, 1, 63, 2, 1},
+    {3, {0, 1, 2}, 0, 0, 1, 0},
+    {1, {2}, 1, 63, 1, 0},
+    {1, {1}, 1, 63, 1, 0},
+    {1, {0}, 1, 63, 1, 0},
+};
+
+// same for grayscale
+static const jpeg_scan_info jpeg_script_gray[] = {
+    {1, {0}, 0, 0, 0, 1},
+    {1, {0}, 1, 5, 0, 2},
+    {1, {0}, 6, 63, 0, 2},
+    {1, {0}, 1, 63, 2, 1},
+    {1, {0}, 0, 0, 1, 0},
+    {1, {0}, 1, 63, 1, 0},
+};
+
+// correction bits buffered by AC refinement scans before EOB run is flushed
+#define JPEG_MAX_CORR_BITS 1000
+// longest EOB run, JPEG spec. G.1.2.2
+#define JPEG_MAX_EOBRUN 0x7FFF
+
+/**
+ * @brief Entropy coder state of single progressive scan
+ * 
+ * @details Every scan is coded twice: 'gather' pass counts symbols into
+ *          'freq' for per scan Huffman tables, second one writes bits.
+ *          'eobrun' - blocks in pending EOB run
+ *          'corr', 'n_corr' - correction bits of refinement scan
+ *          waiting for EOB run, JPEG spec. G.1.2.3
+ */
+struct jpeg_prog
+{
+    jpeg_encoder_t enc;
+    const jpeg_scan_info *info;
+    int gather;
+    uint32_t freq[4][257];
+    bitwriter bw;
+
+    int16_t DC[3];
+    unsigned eobrun;
+    unsigned n_corr;
+    uint8_t corr[JPEG_MAX_CORR_BITS];
+};
+
+static inline void jpeg_prog_symbol(struct jpeg_prog *p, int table, int symbol)
+{
+    if (p->gather)
+    {
+        p->freq[table][symbol]++;
+        return;
+    }
+
+    assert(p->enc->ehuffsize[table][symbol] != 0);
+    bitwriter_put(&p->bw, p->enc->ehuffcode[table][symbol], p->enc->ehuffsize[table][symbol]);
+}
+
+static inline void jpeg_prog_bits(struct jpeg_prog *p, unsigned value, int n)
+{
+    if (!p->gather && n != 0)
+        bitwriter_put(&p->bw, value & ((1u << n) - 1), n);
+}
+
+static void jpeg_prog_corr_bits(struct jpeg_prog *p, const uint8_t *bits, unsigned n)
+{
+    if (p->gather)
+        return;
+
+    bitwriter_reserve(&p->bw, n / 4 + BITWRITER_WORD_MAX);
+    for (unsigned i = 0; i < n; i++)
+        bitwriter_put(&p->bw, bits[i], 1);
+}
+
+/**
+ * @brief Writes pending EOB run and correction bits buffered along with it
+ */
+static void jpeg_prog_eobrun(struct jpeg_prog *p, int table)
+{
+    if (p->eobrun == 0)
+        return;
+
+    // EOBn symbol, then n low bits of run length
+    int n = jpeg_nbits(p->eobrun) - 1;
+
+    jpeg_prog_symbol(p, table, n << 4);
+    jpeg_prog_bits(p, p->eobrun, n);
+    p->eobrun = 0;
+
+    jpeg_prog_corr_bits(p, p->corr, p->n_corr);
+    p->n_corr = 0;
+}
+
+/**
+ * @brief DC of block in first DC scan, JPEG spec. G.1.2.1
+ */
+static void jpeg_prog_dc_first(struct jpeg_prog *p, const int16_t block[64], int k)
+{
+    // arithmetic shift, point transform of DC keeps sign
+    int dc = block[0] >> p->info->Al;
+    int diff = dc - p->DC[k];
+    p->DC[k] = (int16_t)dc;
+
+    int n = jpeg_nbits((unsigned)(diff < 0 ? -diff : diff));
+
+    jpeg_prog_symbol(p, k == 0 ? 0 : 2, n);
+    jpeg_prog_bits(p, (unsigned)(diff < 0 ? diff - 1 : diff), n);
+}
+
+/**
+ * @brief Next bit of DC in DC refinement scan, no Huffman coding
+ */
+static void jpeg_prog_dc_refine(struct jpeg_prog *p, const int16_t block[64])
+{
+    jpeg_prog_bits(p, (unsigned)(block[0] >> p->info->Al), 1);
+}
+
+/**
+ * @brief Band Ss..Se of block in first AC scan, JPEG spec. G.1.2.2
+ */
+static void jpeg_prog_ac_first(struct jpeg_prog *p, const int16_t block[64], int table)
+{
+    int Al = p->info->Al;
+    int r = 0;
+
+    for (int i = p->info->Ss; i <= p->info->Se; i++)
+    {
+        int coef = block[i];
+        unsigned mag = (unsigned)(coef < 0 ? -coef : coef) >> Al;
+
+        if (mag == 0)
+        {
+            r++;
+            continue;
+        }
+
+        jpeg_prog_eobrun(p, table);
+
+        while (r > 15)
+        {
+            jpeg_prog_symbol(p, table, 0xF0);
+            r -= 16;
+        }
+
+        int n = jpeg_nbits(mag);
+        jpeg_prog_symbol(p, table, (r << 4) + n);
+        // negative values are sent as one's complement
+        jpeg_prog_bits(p, coef < 0 ? ~mag : mag, n);
+        r = 0;
+    }
+
+    // trailing zeros join EOB run
+    if (r > 0 && ++p->eobrun == JPEG_MAX_EOBRUN)
+        jpeg_prog_eobrun(p, table);
+}
+
+/**
+ * @brief Band Ss..Se of block in AC refinement scan, JPEG spec. G.1.2.3
+ * 
+ * @details Coeffs. that became nonzero in this scan are coded like in
+ *          first scan, with single sign bit. Every already nonzero coeff.
+ *          gets correction bit, those are sent after next symbol
+ */
+static void jpeg_prog_ac_refine(struct jpeg_prog *p, const int16_t block[64], int table)
+{
+    int Ss = p->info->Ss, Se = p->info->Se, Al = p->info->Al;
+    unsigned mag[64];
+    int eob = 0; // last coeff. that becomes nonzero in this scan
+    int r = 0;
+
+    for (int i = Ss; i <= Se; i++)
+    {
+        int coef = block[i];
+        mag[i] = (unsigned)(coef < 0 ? -coef : coef) >> Al;
+        if (mag[i] == 1)
+            eob = i;
+    }
+
+    // correction bits of this block go after those of pending EOB run
+    uint8_t *br = p->corr + p->n_corr;
+    unsigned n_br = 0;
+
+    for (int i = Ss; i <= Se; i++)
+    {
+        if (mag[i] == 0)
+        {
+            r++;
+            continue;
+        }
+
+        // ZRL can't be sent after last new coeff., EOB covers those zeros
+        while (r > 15 && i <= eob)
+        {
+            jpeg_prog_eobrun(p, table);
+            jpeg_prog_symbol(p, table, 0xF0);
+            r -= 16;
+            jpeg_prog_corr_bits(p, br, n_br);
+            br = p->corr;
+            n_br = 0;
+        }
+
+        // already nonzero, only correction bit
+        if (mag[i] > 1)
+        {
+            br[n_br++] = (uint8_t)(mag[i] & 1);
+            continue;
+        }
+
+        jpeg_prog_eobrun(p, table);
+        jpeg_prog_symbol(p, table, (r << 4) + 1);
+        jpeg_prog_bits(p, block[i] < 0 ? 0 : 1, 1);
+        jpeg_prog_corr_bits(p, br, n_br);
+        br = p->corr;
+        n_br = 0;
+        r = 0;
+    }
+
+    if (r > 0 || n_br > 0)
+    {
+        p->eobrun++;
+        p->n_corr += n_br;
+
+        if (p->eobrun == JPEG_MAX_EOBRUN || p->n_corr > JPEG_MAX_CORR_BITS - 64 + 1)
+            jpeg_prog_eobrun(p, table);
+    }
+}
+
+/**
+ * @brief Codes single block of component 'k' in current scan
+ */
+static void jpeg_prog_block(struct jpeg_prog *p, const int16_t block[64], int k)
+{
+    const jpeg_scan_info *info = p->info;
+    int ac_table = k == 0 ? 1 : 3;
+
+    // worst case of any scan: full block, EOB run and its correction bits
+    if (!p->gather)
+        bitwriter_reserve(&p->bw, 64 * 27 / 8 * 2 + BITWRITER_WORD_MAX);
+
+    if (info->Ss == 0)
+    {
+        if (info->Ah == 0)
+            jpeg_prog_dc_first(p, block, k);
+        else
+            jpeg_prog_dc_refine(p, block);
+    }
+    else
+    {
+        if (info->Ah == 0)
+            jpeg_prog_ac_first(p, block, ac_table);
+        else
+            jpeg_prog_ac_refine(p, block, ac_table);
+    }
+}
+
+/**
+ * @brief Runs one pass of current scan over stored blocks
+ * 
+ * @details Scan of several components is interleaved, blocks follow
+ *          MCU order like baseline scan. Single component scan visits
+ *          blocks of that component in raster order and covers only
+ *          blocks inside the image, not MCU padding (JPEG spec. A.2.2)
+ */
+static void jpeg_prog_pass(struct jpeg_prog *p, struct jpeg_scan *scan)
+{
+    const jpeg_scan_info *info = p->info;
+    jpeg_encoder_t enc = p->enc;
+    int bpm = scan->blocks_per_mcu;
+    int luma = jpeg_luma_blocks(bpm);
+    unsigned h = scan->mcu_w / 8, v = scan->mcu_h / 8;
+
+    p->DC[0] = p->DC[1] = p->DC[2] = 0;
+    p->eobrun = 0;
+    p->n_corr = 0;
+
+    if (info->n_comps > 1)
+    {
+        size_t n_mcus = (size_t)scan->mcus_per_row * scan->mcu_rows;
+
+        for (size_t m = 0; m < n_mcus; m++)
+        {
+            int16_t(*mcu)[64] = scan->coef + m * bpm;
+
+            for (int c = 0; c < info->n_comps; c++)
+            {
+                int k = info->comps[c];
+
+                if (k == 0)
+                    for (int n = 0; n < luma; n++)
+                        jpeg_prog_block(p, mcu[n], 0);
+                else
+                    jpeg_prog_block(p, mcu[luma + k - 1], k);
+            }
+        }
+    }
+    else
+    {
+        int k = info->comps[0];
+        // component size in samples, then in blocks
+        unsigned cw = k == 0 ? enc->width : (enc->width + h - 1) / h;
+        unsigned ch = k == 0 ? enc->height : (enc->height + v - 1) / v;
+        unsigned bw = (cw + 7) / 8, bh = (ch + 7) / 8;
+
+        for (unsigned by = 0; by < bh; by++)
+        {
+            for (unsigned bx = 0; bx < bw; bx++)
+            {
+                size_t m;
+                int n;
+
+                if (k == 0)
+                {
+                    m = (size_t)(by / v) * scan->mcus_per_row + bx / h;
+                    n = (int)((by % v) * h + bx % h);
+                }
+                else
+                {
+                    m = (size_t)by * scan->mcus_per_row + bx;
+                    n = luma + k - 1;
+                }
+
+                jpeg_prog_block(p, scan->coef[m * bpm + n], k);
+            }
+        }
+    }
+
+    jpeg_prog_eobrun(p, info->Ss == 0 ? 0 : (info->comps[0] == 0 ? 1 : 3));
+}
+
+/**
+ * @brief Writes DHT for tables used by scan and SOS segment
+ */
+static void jpeg_prog_scan_header(struct jpeg_prog *p, buffer_t out)
+{
+    jpeg_encoder_t enc = p->enc;
+    const jpeg_scan_info *info = p->info;
+
+    // tables: 0 Luma DC; 1 Luma AC; 2 Chroma DC; 3 Chroma AC
+    for (int t = 0; t < 4; t++)
+        if (jpeg_freq_used(p->freq[t]))
+            write_DHT(out, enc->ht_bits[t], enc->ht_vals[t], t & 1, (uint8_t)(t >> 1));
+
+    buffer_append_u16be(out, 0xffda); // SOS
+    buffer_append_u16be(out, (uint16_t)(6 + 2 * info->n_comps));
+    buffer_append_u8(out, (uint8_t)info->n_comps);
+    for (int c = 0; c < info->n_comps; c++)
+    {
+        int k = info->comps[c];
+        buffer_append_u8(out, (uint8_t)(k + 1));
+        buffer_append_u8(out, (uint8_t)(k == 0 ? 0x00 : 0x11)); // DC | AC table
+    }
+    buffer_append_u8(out, (uint8_t)info->Ss);
+    buffer_append_u8(out, (uint8_t)info->Se);
+    buffer_append_u8(out, (uint8_t)((info->Ah << 4) | info->Al));
+}
+
+/**
+ * @brief Scan script of encoder, default one when not set
+ */
+static const jpeg_scan_info *jpeg_prog_script(jpeg_encoder_t enc, int *n_scans)
+{
+    if (enc->scan_script != NULL)
+    {
+        *n_scans = enc->num_scans;
+        return enc->scan_script;
+    }
+
+    if (enc->num_components == 1)
+    {
+        *n_scans = sizeof(jpeg_script_gray) / sizeof(jpeg_script_gray[0]);
+        return jpeg_script_gray;
+    }
+
+    *n_scans = sizeof(jpeg_script_color) / sizeof(jpeg_script_color[0]);
+    return jpeg_script_color;
+}
+
+/**
+ * @brief Codes stored blocks of scan as progressive scans into enc->result
+ * 
+ * @details Every scan goes with its own optimal Huffman tables,
+ *          DHT and SOS segments are part of enc->result.
+ *          Scans are not split into restart intervals
+ */
+static void jpeg_progressive_encode(jpeg_encoder_t enc, struct jpeg_scan *scan)
+{
+    int n_scans;
+    const jpeg_scan_info *script = jpeg_prog_script(enc, &n_scans);
+    struct jpeg_prog *p = (struct jpeg_prog *)malloc(sizeof(struct jpeg_prog));
+
+    assert(p != NULL);
+    assert(n_scans > 0);
+
+    p->enc = enc;
+    enc->restart_interval = 0;
+
+    enc->result->size = 0;
+    buffer_reserve(enc->result, jpeg_estimate_size(enc, enc->width, enc->height));
+
+    for (int s = 0; s < n_scans; s++)
+    {
+        const jpeg_scan_info *info = &script[s];
+
+        assert(info->n_comps >= 1 && info->n_comps <= enc->num_components);
+        assert(info->Ss == 0 ? info->Se == 0 : (info->n_comps == 1 && info->Se >= info->Ss && info->Se <= 63));
+        assert(info->Ah == 0 || info->Ah == info->Al + 1);
+        for (int c = 0; c < info->n_comps; c++)
+            assert(info->comps[c] < enc->num_components && (c == 0 || info->comps[c] > info->comps[c - 1]));
+
+        p->info = info;
+
+        p->gather = 1;
+        memset(p->freq, 0, sizeof(p->freq));
+        jpeg_prog_pass(p, scan);
+        jpeg_setup_tables_from_freq(enc, p->freq);
+
+        jpeg_prog_scan_header(p, enc->result);
+
+        p->gather = 0;
+        bitwriter_init(&p->bw, enc->result);
+        jpeg_prog_pass(p, scan);
+        // padding is filled with 1s (JPEG spec. F.1.2.3)
+        bitwriter_flush(&p->bw);
+    }
+
+    free(p);
+}
+
+/**
+ * @brief Common start of every encode: image size, buffers, tables
+ */
+static void jpeg_begin_image(jpeg_encoder_t enc, unsigned width, unsigned height, jpeg_pixel_format format)
+{
+    assert(enc);
+    assert(width > 0);
+    assert(height > 0);
+    assert(enc->num_threads > 0);
+    // progressive scans have no restart markers
+    assert(!(enc->progressive && enc->restart_rows));
+
+    // width and height affects JPEG headers when writing to file
+    enc->width = width;
+    enc->height = height;
+
+    enc->num_components =
+        (format == JPEG_PIXEL_GRAY || format == JPEG_PIXEL_GRAY_ALPHA) ? 1 : 3;
+
+    jpeg_reset(enc);
+
+    jpeg_prepare_tables(enc);
+
+    if (enc->result == NULL)
+        enc->result = buffer_alloc(0);
+}
+
+jpeg_input jpeg_input_packed(const uint8_t *data, jpeg_pixel_format format)
+{
+    jpeg_input input;
+
+    assert(format != JPEG_PIXEL_PLANAR);
+
+    input.format = format;
+    input.data = data;
+    input.stride = 0;
+    input.planes[0] = input.planes[1] = input.planes[2] = NULL;
+
+    return input;
+}
+
+jpeg_pixel_format jpeg_format_from_channels(int channels)
+{
+    switch (channels)
+    {
+    case 1:
+        return JPEG_PIXEL_GRAY;
+    case 2:
+        return JPEG_PIXEL_GRAY_ALPHA;
+    case 4:
+        return JPEG_PIXEL_RGBA;
+    default:
+        assert(channels == 3);
+        return JPEG_PIXEL_RGB;
+    }
+}
+
+void jpeg_encode_data(jpeg_encoder_t enc, unsigned width, unsigned height, const uint8_t *data)
+{
+    jpeg_input input = jpeg_input_packed(data, JPEG_PIXEL_RGB);
+
+    jpeg_encode_input(enc, width, height, &input);
+}
+
+void jpeg_encode_input(jpeg_encoder_t enc, unsigned width, unsigned height, const jpeg_input *input)
+{
+    struct jpeg_scan scan;
+
+    assert(input);
+    assert(input->format == JPEG_PIXEL_PLANAR ? input->planes[0] && input->planes[1] && input->planes[2]
+                                              : input->data != NULL);
+
+    jpeg_begin_image(enc, width, height, input->format);
+    jpeg_scan_init(enc, &scan, width, height, input);
+
+    if (enc->trellis)
+    {
+        // DCT once, unquantized blocks go through trellis
+        jpeg_scan_keep_coef(enc, &scan);
+        jpeg_scan_keep_raw(enc, &scan);
+        jpeg_run_bands(&scan, jpeg_band_dct);
+
+        // trellis costs follow tables of coding, optimal ones come from
+        // plain quantization first
+        if (enc->optimize_huffman)
+        {
+            jpeg_run_bands(&scan, jpeg_band_quantize);
+            jpeg_run_bands(&scan, jpeg_band_count);
+            jpeg_setup_optimal_huffman_tables(enc, &scan);
+        }
+
+        jpeg_run_bands(&scan, jpeg_band_trellis);
+    }
+    else if (enc->progressive || enc->optimize_huffman)
+    {
+        // single DCT pass, keep quantized blocks
+        jpeg_scan_keep_coef(enc, &scan);
+        jpeg_run_bands(&scan, jpeg_band_transform);
+    }
+
+    // every progressive scan reads stored blocks
+    if (enc->progressive)
+    {
+        jpeg_progressive_encode(enc, &scan);
+        return;
+    }
+
+    if (enc->optimize_huffman)
+    {
+        // pass 1: gather statistics of stored blocks
+        jpeg_run_bands(&scan, jpeg_band_count);
+
+        jpeg_setup_optimal_huffman_tables(enc, &scan);
+    }
+
+    // pass 2 (or the only pass): Huffman coding
+    jpeg_run_bands(&scan, jpeg_band_encode);
+
+    jpeg_scan_splice(enc, &scan);
+}
+
+/**
+ * @brief Quantizes stored coefficients with current tables and counts symbols
+ * 
+ * @details With 'trellis' set blocks go through the same trellis passes
+ *          as in jpeg_encode_input(), so chosen quality and written
+ *          stream match a trellis encode.
+ *          Output of every band is padded to byte boundary and bands are
+ *          separated by RSTn, 0xFF bytes in entropy coded data are expected
+ *          once per 256 bytes, each one gets stuffed 0x00.
+ *          Progressive scans are coded into enc->result, size is exact
+ * 
+ * @param enc 
+ * @param scan 
+ * @param headers scratch buffer for JFIF headers
+ * @param psnr[out] luma PSNR, may be NULL
+ * @return size_t estimated size of complete JFIF stream
+ */
+static size_t jpeg_rate_measure(jpeg_encoder_t enc, struct jpeg_scan *scan, buffer_t headers, double *psnr)
+{
+    size_t bytes = 0;
+    double sse = 0;
+
+    if (enc->trellis)
+    {
+        // trellis costs follow tables of coding, see jpeg_encode_input()
+        if (enc->optimize_huffman)
+        {
+            jpeg_run_bands(scan, jpeg_band_quantize);
+            jpeg_run_bands(scan, jpeg_band_count);
+            jpeg_setup_optimal_huffman_tables(enc, scan);
+        }
+
+        jpeg_run_bands(scan, jpeg_band_trellis);
+    }
+    else
+    {
+        jpeg_run_bands(scan, jpeg_band_quantize);
+    }
+
+    for (unsigned b = 0; b < scan->n_bands; b++)
+        sse += scan->sse[b];
+
+    if (enc->progressive)
+    {
+        // scans get own tables and EOB runs, baseline bits are far off.
+        // code them for real, jpeg_rate_encode() keeps the result
+        jpeg_progressive_encode(enc, scan);
+        bytes = enc->result->size;
+    }
+    else
+    {
+        jpeg_run_bands(scan, jpeg_band_count);
+
+        if (enc->optimize_huffman)
+            jpeg_setup_optimal_huffman_tables(enc, scan);
+
+        for (unsigned b = 0; b < scan->n_bands; b++)
+        {
+            uint64_t bits = 0;
+
+            for (int t = 0; t < 4; t++)
+            {
+                // AC symbol: low nibble is size of magnitude. DC symbol is the size
+                for (int i = 0; i < 256; i++)
+                    bits += (uint64_t)scan->freq[b][t][i] * (enc->ehuffsize[t][i] + (i & 15));
+            }
+
+            bytes += (size_t)((bits + 7) / 8);
+        }
+
+        bytes += bytes / 256 + 2 * (scan->n_bands - 1);
+    }
+
+    headers->size = 0;
+    jpeg_write_headers(enc, headers);
+    bytes += headers->size + 2; // EOI
+
+    if (psnr != NULL)
+    {
+        // stored coeffs. are scaled by 8, orthonormal DCT keeps error energy
+        size_t luma_blocks = (size_t)scan->mcus_per_row * scan->mcu_rows * jpeg_luma_blocks(scan->blocks_per_mcu);
+        double mse = sse / 64.0 / (64.0 * luma_blocks);
+
+        *psnr = mse > 0 ? 10.0 * log10(255.0 * 255.0 / mse) : JPEG_PSNR_MAX;
+    }
+
+    return bytes;
+}
+
+/**
+ * @brief Sets 'quality' and rebuilds tables, scan keeps stored coefficients
+ */
+static void jpeg_rate_set_quality(jpeg_encoder_t enc, int quality)
+{
+    enc->quality = quality;
+    jpeg_prepare_tables(enc);
+}
+
+/**
+ * @brief Huffman codes blocks quantized by last jpeg_rate_measure()
+ */
+static void jpeg_rate_encode(jpeg_encoder_t enc, struct jpeg_scan *scan)
+{
+    if (enc->progressive)
+    {
+        jpeg_progressive_encode(enc, scan);
+        return;
+    }
+
+    for (unsigned b = 0; b < scan->n_bands; b++)
+        scan->bands[b]->size = 0;
+
+    jpeg_run_bands(scan, jpeg_band_encode);
+    jpeg_scan_splice(enc, scan);
+}
+
+/**
+ * @brief DCT of whole image into stored coefficients for rate control
+ */
+static void jpeg_rate_begin(jpeg_encoder_t enc, struct jpeg_scan *scan,
+                            unsigned width, unsigned height, const jpeg_input *input)
+{
+    assert(input);
+    assert(input->format == JPEG_PIXEL_PLANAR ? input->planes[0] && input->planes[1] && input->planes[2]
+                                              : input->data != NULL);
+
+    // any quality, bands are resized as needed
+    jpeg_begin_image(enc, width, height, input->format);
+    jpeg_scan_init(enc, scan, width, height, input);
+    jpeg_scan_keep_coef(enc, scan);
+    jpeg_scan_keep_raw(enc, scan);
+
+    jpeg_run_bands(scan, jpeg_band_dct);
+}
+
+int jpeg_encode_target_size(jpeg_encoder_t enc, unsigned width, unsigned height, const jpeg_input *input,
+                            size_t max_bytes)
+{
+    struct jpeg_scan scan;
+    buffer_t headers = buffer_alloc(0);
+    int lo = 1, hi = 100, best = 1, mid;
+
+    jpeg_rate_begin(enc, &scan, width, height, input);
+
+    // highest quality that fits, size grows with quality
+    while (lo <= hi)
+    {
+        mid = (lo + hi) / 2;
+        jpeg_rate_set_quality(enc, mid);
+
+        if (jpeg_rate_measure(enc, &scan, headers, NULL) <= max_bytes)
+        {
+            best = mid;
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+
+    // estimate misses exact stuffing, step down until real stream fits
+    for (;;)
+    {
+        jpeg_rate_set_quality(enc, best);
+        jpeg_rate_measure(enc, &scan, headers, NULL);
+        jpeg_rate_encode(enc, &scan);
+
+        headers->size = 0;
+        jpeg_write_headers(enc, headers);
+
+        if (best == 1 || headers->size + enc->result->size + 2 <= max_bytes)
+            break;
+        best--;
+    }
+
+    buffer_free(headers);
+    return best;
+}
+
+int jpeg_encode_target_psnr(jpeg_encoder_t enc, unsigned width, unsigned height, const jpeg_input *input,
+                            double min_psnr)
+{
+    struct jpeg_scan scan;
+    buffer_t headers = buffer_alloc(0);
+    int lo = 1, hi = 100, best = 100, mid;
+    double psnr;
+
+    jpeg_rate_begin(enc, &scan, width, height, input);
+
+    // lowest quality that reaches 'min_psnr', PSNR grows with quality
+    while (lo <= hi)
+    {
+        mid = (lo + hi) / 2;
+        jpeg_rate_set_quality(enc, mid);
+        jpeg_rate_measure(enc, &scan, headers, &psnr);
+
+        if (psnr >= min_psnr)
+        {
+            best = mid;
+            hi = mid - 1;
+        }
+        else
+        {
+            lo = mid + 1;
+        }
+    }
+
+    jpeg_rate_set_quality(enc, best);
+    jpeg_rate_measure(enc, &scan, headers, NULL);
+    jpeg_rate_encode(enc, &scan);
+
+    buffer_free(headers);
+    return best;
+}
+
+void jpeg_write_headers(jpeg_encoder_t enc, buffer_t out)
+{
+    TJEJPEGHeader header;
+    char jfif_mark[5] = "JFIF";
+    char comment_str[] = "Created by Tiny JPEG Encoder";
+
+    // JFIF header.
+    header.SOI = tjei_be_word(0xffd8); // Sequential DCT
+    header.APP0 = tjei_be_word(0xffe0);
+    uint16_t jfif_len = sizeof(TJEJPEGHeader) - 4 /*SOI & APP0 markers*/;
+    header.jfif_len = tjei_be_word(jfif_len);
+    memcpy(header.jfif_id, jfif_mark, 5);
+    header.version = tjei_be_word(0x0102);
+    header.units = 1;
+    header.x_density = tjei_be_word(0x0060);
+    header.y_density = tjei_be_word(0x0060);
+    header.x_thumb = 0;
+    header.y_thumb = 0;
+    buffer_append(out, (uint8_t *)&header, sizeof(TJEJPEGHeader));
+
+    // Comment
+    TJEJPEGComment com;
+    com.com = tjei_be_word(0xfffe);
+    com.com_len = tjei_be_word(2 + sizeof(comment_str) - 1);
+    memcpy(com.com_str, comment_str, sizeof(comment_str) - 1);
+    buffer_append(out, (uint8_t *)&com, sizeof(TJEJPEGComment));
+
+    int n = enc->num_components;
+
+    // Write Q Tables, grayscale only needs luma
+    for (int t = 0; t < (n == 1 ? 1 : 2); t++)
+    {
+        buffer_append_u16be(out, 0xffdb);   // DQT
+        buffer_append_u16be(out, 67);       // 2(len) + 1(id) + 64(matrix) = 67 = 0x43
+        buffer_append_u8(out, (uint8_t)t); // 0x0000 8 bits | 0x00id
+        buffer_append(out, enc->q_table[t], 64);
+    }
+
+    // WRITE FRAME
+    int h, v;
+    jpeg_sampling_factors(enc, &h, &v);
+    buffer_append_u16be(out, enc->progressive ? 0xffc2 : 0xffc0); // SOF2 or SOF0
+    buffer_append_u16be(out, (uint16_t)(8 + 3 * n));
+    buffer_append_u8(out, 8); // precision
+    buffer_append_u16be(out, (uint16_t)enc->height);
+    buffer_append_u16be(out, (uint16_t)enc->width);
+    buffer_append_u8(out, (uint8_t)n);
+    for (int i = 0; i < n; ++i)
+    {
+        buffer_append_u8(out, (uint8_t)(i + 1)); // No particular reason. Just 1, 2, 3.
+        // luma carries MCU size, chroma is always 1x1
+        buffer_append_u8(out, (uint8_t)(i == 0 ? (h << 4) | v : 0x11));
+        buffer_append_u8(out, (uint8_t)(i == 0 ? 0 : 1)); // Q table
+    }
+
+    // WRITE RESTART INTERVAL
+    if (enc->restart_interval != 0)
+    {
+        buffer_append_u16be(out, 0xffdd);
+        buffer_append_u16be(out, 4);
+        buffer_append_u16be(out, enc->restart_interval);
+    }
+
+    // progressive scans carry their own tables, see jpeg_progressive_encode()
+    if (enc->progressive)
+        return;
+
+    // WRITE HUFFMAN TABLES
+    write_DHT(out, enc->ht_bits[0], enc->ht_vals[0], 0, 0);
+    write_DHT(out, enc->ht_bits[1], enc->ht_vals[1], 1, 0);
+
+    if (n > 1)
+    {
+        write_DHT(out, enc->ht_bits[2], enc->ht_vals[2], 0, 1);
+        write_DHT(out, enc->ht_bits[3], enc->ht_vals[3], 1, 1);
+    }
+
+    // WRITE SCAN HEADER
+    buffer_append_u16be(out, 0xffda); // SOS
+    buffer_append_u16be(out, (uint16_t)(6 + 2 * n));
+    buffer_append_u8(out, (uint8_t)n);
+    for (int i = 0; i < n; ++i)
+    {
+        // Must be equal to component_id from frame header above.
+        buffer_append_u8(out, (uint8_t)(i + 1));
+        buffer_append_u8(out, (uint8_t)(i == 0 ? 0x00 : 0x11)); // DC | AC table
+    }
+    buffer_append_u8(out, 0);  // first
+    buffer_append_u8(out, 63); // last
+    buffer_append_u8(out, 0);  // ah_al
+}
+
+void jpeg_write_to_buffer(jpeg_encoder_t enc, buffer_t out)
+{
+    assert(enc);
+    assert(enc->result);
+
+    // headers are ~600 bytes
+    buffer_reserve(out, out->size + 1024 + enc->result->size);
+
+    jpeg_write_headers(enc, out);
+
+    if (enc->result->size != 0)
+        buffer_append(out, enc->result->data, enc->result->size);
+
+    buffer_append_u16be(out, 0xffd9); // EOI
+}
+
+buffer_t jpeg_encode_to_memory(jpeg_encoder_t enc, unsigned width, unsigned height, const uint8_t *data)
+{
+    jpeg_encode_data(enc, width, height, data);
+
+    if (enc->output == NULL)
+        enc->output = buffer_alloc(0);
+
+    enc->output->size = 0;
+    jpeg_write_to_buffer(enc, enc->output);
+
+    return enc->output;
+}
+
+void jpeg_write_to_func(jpeg_encoder_t enc, jpeg_write_func *func, void *context)
+{
+    assert(enc);
+    assert(enc->result);
+    assert(func);
+
+    buffer_t headers = buffer_alloc(0);
+    uint8_t eoi[2] = {0xff, 0xd9};
+
+    jpeg_write_headers(enc, headers);
+
+    func(context, headers->data, (int)headers->size);
+    if (enc->result->size != 0)
+        func(context, enc->result->data, (int)enc->result->size);
+    func(context, eoi, 2);
+
+    buffer_free(headers);
+}
+
+// jpeg_write_func over FILE*
+static void jpeg_fwrite_func(void *context, void *data, int size)
+{
+    fwrite(data, 1, (size_t)size, (FILE *)context);
+}
+
+void jpeg_write_to_file(jpeg_encoder_t enc, const char *filename)
+{
+    FILE *out_file = fopen(filename, "wb");
+
+    if (out_file == NULL)
+    {
+        printf("failed to open file\n");
+        return;
+    }
+
+    jpeg_write_to_func(enc, jpeg_fwrite_func, out_file);
+
+    fflush(out_file);
+    fclose(out_file);
+}
+
+/**
+ * @brief State of streaming encode
+ * 
+ * @details 'row' holds current MCU row. Its plane row 'i' is image row
+ *          y0 - border + i, rows below MCU row are carried over to the
+ *          top of the next one.
+ *          'received' - image rows pushed so far
+ *          'mcu_y' - MCU rows encoded so far
+ *          'out' - entropy coded bytes not yet passed to 'func'
+ */
+struct jpeg_stream
+{
+    jpeg_pixel_format format;
+    jpeg_write_func *func;
+    void *context;
+
+    unsigned mcu_w;
+    unsigned mcu_h;
+    unsigned mcus_per_row;
+    unsigned mcu_rows;
+    unsigned rows_per_band;
+    int blocks_per_mcu;
+
+    struct jpeg_mcu_row row;
+    int active; // 'row' is allocated
+    unsigned y0;
+    unsigned received;
+    unsigned mcu_y;
+
+    int16_t DC[3];
+    bitwriter bw;
+    buffer_t out;
+};
+
+static void jpeg_stream_free(struct jpeg_stream *stream)
+{
+    if (stream->active)
+        jpeg_mcu_row_free(&stream->row);
+
+    buffer_free(stream->out);
+    free(stream);
+}
+
+void jpeg_stream_begin(jpeg_encoder_t enc, unsigned width, unsigned height, jpeg_pixel_format format,
+                       jpeg_write_func *func, void *context)
+{
+    assert(func);
+    assert(format != JPEG_PIXEL_PLANAR);
+    assert(!enc->progressive);
+
+    jpeg_begin_image(enc, width, height, format);
+
+    if (enc->stream == NULL)
+    {
+        enc->stream = (struct jpeg_stream *)malloc(sizeof(struct jpeg_stream));
+        assert(enc->stream != NULL);
+        enc->stream->active = 0;
+        enc->stream->out = buffer_alloc(0);
+    }
+
+    struct jpeg_stream *st = enc->stream;
+    int h, v;
+
+    if (st->active)
+        jpeg_mcu_row_free(&st->row);
+
+    jpeg_sampling_factors(enc, &h, &v);
+
+    st->format = format;
+    st->func = func;
+    st->context = context;
+    st->mcu_w = 8 * h;
+    st->mcu_h = 8 * v;
+    st->mcus_per_row = (width + st->mcu_w - 1) / st->mcu_w;
+    st->mcu_rows = (height + st->mcu_h - 1) / st->mcu_h;
+    st->blocks_per_mcu = jpeg_blocks_per_mcu(enc);
+
+    // intervals are encoded one after another
+    st->rows_per_band = jpeg_restart_rows(enc, st->mcus_per_row, st->mcu_rows, 1);
+
+    jpeg_mcu_row_init(enc, &st->row, st->mcus_per_row, st->mcu_w, st->mcu_h);
+    st->active = 1;
+    st->y0 = 0;
+    st->received = 0;
+    st->mcu_y = 0;
+    st->DC[0] = st->DC[1] = st->DC[2] = 0;
+
+    // headers need restart interval, so they go after it is picked
+    st->out->size = 0;
+    jpeg_write_headers(enc, st->out);
+    func(context, st->out->data, (int)st->out->size);
+
+    st->out->size = 0;
+    bitwriter_init(&st->bw, st->out);
+}
+
+/**
+ * @brief Encodes complete MCU row and passes its bytes to sink
+ */
+static void jpeg_stream_encode_row(jpeg_encoder_t enc, struct jpeg_stream *st)
+{
+    int16_t mcu[6][64];
+    int16_t trellis[64];
+
+    for (unsigned x = 0; x < st->mcus_per_row; x++)
+    {
+        // trellis needs unquantized coeffs., costs follow default tables
+        jpeg_transform_mcu(enc, &st->row, x * st->mcu_w, enc->trellis, mcu);
+
+        for (int n = 0; n < st->blocks_per_mcu; n++)
+        {
+            int k = jpeg_block_component(n, st->blocks_per_mcu);
+
+            if (enc->trellis)
+            {
+                jpeg_trellis_block(enc, mcu[n], k == 0 ? 0 : 1, k == 0 ? 1 : 3, trellis);
+                memcpy(mcu[n], trellis, sizeof(trellis));
+            }
+
+            jpeg_encode_block(enc, &st->bw, mcu[n], &st->DC[k],
+                              k == 0 ? 0 : 2, k == 0 ? 1 : 3);
+        }
+    }
+
+    st->mcu_y++;
+    st->y0 += st->mcu_h;
+
+    // end of restart interval, same layout as jpeg_scan_splice()
+    if (st->mcu_y % st->rows_per_band == 0 && st->mcu_y < st->mcu_rows)
+    {
+        bitwriter_flush(&st->bw);
+        buffer_append_u16be(st->out, (uint16_t)(0xFFD0 + ((st->mcu_y / st->rows_per_band - 1) & 7)));
+        bitwriter_init(&st->bw, st->out);
+        st->DC[0] = st->DC[1] = st->DC[2] = 0;
+    }
+
+    size_t n = bitwriter_take(&st->bw);
+    if (n != 0)
+        st->func(st->context, st->out->data, (int)n);
+}
+
+void jpeg_stream_write_rows(jpeg_encoder_t enc, const uint8_t *rows, unsigned n_rows, size_t stride)
+{
+    assert(enc);
+    assert(enc->stream && enc->stream->active);
+    assert(rows);
+
+    struct jpeg_stream *st = enc->stream;
+    struct jpeg_mcu_row *row = &st->row;
+    int border = row->border;
+    jpeg_input input = jpeg_input_packed(rows, st->format);
+
+    input.stride = stride;
+
+    assert(st->received + n_rows <= enc->height);
+
+    for (unsigned r = 0; r < n_rows; r++)
+    {
+        unsigned y = st->received++;
+        int i = (int)(y - st->y0) + border;
+
+        jpeg_mcu_row_put(enc, row, &input, (int)r, i);
+
+        // top edge repeats first row
+        if (y == 0)
+            for (int j = 0; j < i; j++)
+                jpeg_mcu_row_copy(enc, row, j, i);
+
+        // bottom edge repeats last row
+        if (y + 1 == enc->height)
+        {
+            for (int j = i + 1; j < row->rows; j++)
+                jpeg_mcu_row_copy(enc, row, j, i);
+            i = row->rows - 1;
+        }
+
+        while (i == row->rows - 1 && st->mcu_y < st->mcu_rows)
+        {
+            jpeg_stream_encode_row(enc, st);
+
+            // rows below MCU row are border above the next one
+            for (int j = 0; j < 2 * border; j++)
+                jpeg_mcu_row_copy(enc, row, j, (int)st->mcu_h + j);
+            i = 2 * border - 1;
+
+            // last row was already in the border, next MCU row is complete too
+            if (y + 1 == enc->height && st->mcu_y < st->mcu_rows)
+            {
+                for (int j = i + 1; j < row->rows; j++)
+                    jpeg_mcu_row_copy(enc, row, j, i);
+                i = row->rows - 1;
+            }
+        }
+    }
+}
+
+void jpeg_stream_finish(jpeg_encoder_t enc)
+{
+    assert(enc);
+    assert(enc->stream && enc->stream->active);
+
+    struct jpeg_stream *st = enc->stream;
+
+    assert(st->mcu_y == st->mcu_rows);
+
+    // flush remaining bits. padding is filled with 1s (JPEG spec. F.1.2.3)
+    bitwriter_flush(&st->bw);
+    buffer_append_u16be(st->out, 0xffd9); // EOI
+    st->func(st->context, st->out->data, (int)st->out->size);
+    st->out->size = 0;
+
+    jpeg_mcu_row_free(&st->row);
+    st->active = 0;
+}
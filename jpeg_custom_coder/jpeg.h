@@ -8,15 +8,95 @@ extern "C" {
 #include <stdint.h>
 #include <stddef.h>
 #include <math.h>
+#include <float.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "ppmm.h"
 #include "jpeg_util.h"
 #include "jpeg_tables.h"
 #include "buffer.h"
+#include "bitwriter.h"
 #include "dct.h"
+#include "color.h"
+
+/**
+ * @brief Chroma subsampling, luma sampling factors and MCU size in brackets
+ */
+typedef enum jpeg_subsampling
+{
+    JPEG_444 = 0, // 1x1 (8x8)
+    JPEG_422,     // 2x1 (16x8)
+    JPEG_420      // 2x2 (16x16)
+} jpeg_subsampling;
+
+/**
+ * @brief Filter used to downsample chroma
+ */
+typedef enum jpeg_chroma_filter
+{
+    JPEG_FILTER_BOX = 0, // average of covered pixels
+    JPEG_FILTER_TRIANGLE // 1 3 3 1 taps, smoother, reads 1 pixel around MCU
+} jpeg_chroma_filter;
+
+/**
+ * @brief Layout of input pixels, see jpeg_input
+ */
+typedef enum jpeg_pixel_format
+{
+    JPEG_PIXEL_RGB = 0,    // 3 bytes per pixel
+    JPEG_PIXEL_BGR,        // 3 bytes per pixel
+    JPEG_PIXEL_RGBA,       // 4 bytes per pixel, alpha is ignored
+    JPEG_PIXEL_BGRA,       // 4 bytes per pixel, alpha is ignored
+    JPEG_PIXEL_GRAY,       // 1 byte per pixel, single component JPEG
+    JPEG_PIXEL_GRAY_ALPHA, // 2 bytes per pixel, single component JPEG
+    JPEG_PIXEL_PLANAR      // R, G, B in separate planes of 1 byte per pixel
+} jpeg_pixel_format;
+
+/**
+ * @brief Pixels to encode
+ * 
+ * @details 'data' - first row of interleaved pixels
+ *          'stride' - bytes between rows of 'data' or of every plane.
+ *          0 - rows are tightly packed
+ *          'planes' - R, G, B rows for JPEG_PIXEL_PLANAR, 'data' is unused
+ */
+typedef struct jpeg_input
+{
+    jpeg_pixel_format format;
+    const uint8_t *data;
+    size_t stride;
+    const uint8_t *planes[3];
+} jpeg_input;
+
+/**
+ * @brief Single scan of progressive JPEG, JPEG spec. G.1.1
+ * 
+ * @details 'comps' - components of scan, 0 Y; 1 Cb; 2 Cr in increasing order
+ *          'Ss', 'Se' - first and last coeff. in zig-zag order.
+ *          DC scans have Ss = Se = 0, AC scans have single component
+ *          'Ah', 'Al' - successive approximation. Al - bit position
+ *          sent by scan, Ah - previous one (Al + 1), 0 for first scan
+ */
+typedef struct jpeg_scan_info
+{
+    int n_comps;
+    int comps[3];
+    int Ss, Se;
+    int Ah, Al;
+} jpeg_scan_info;
+
+/**
+ * @brief Settings quantization tables are derived from
+ */
+typedef struct jpeg_q_key
+{
+    int compression_lvl;
+    int quality;
+    dct_method dct;
+} jpeg_q_key;
 
 /**
  * @brief   Baseline DCT JPEG Encoder of RGB data
@@ -27,6 +107,12 @@ extern "C" {
  *          2 - basic compression (tables from irfan viewer)
  *          3 - high compression (JPEG spec defaults)
  * 
+ *          'quality' - 1..100, IJG quality scale of JPEG spec tables
+ *          (or 'custom_q_table'), 50 keeps them as is.
+ *          0 - 'compression_lvl' picks tables. defaults to 0
+ *          'custom_q_table' - natural order tables set by jpeg_set_q_tables()
+ *          'custom_q' - 1 when custom tables are used
+ * 
  *          Encoder doesn't generate tables on the go
  *          So predefined tables are used
  *          each table corresponds to specific coeff. being encoded
@@ -36,30 +122,121 @@ extern "C" {
  *          'ht_bits' - default sizes
  *          'ht_vals' - default values
  * 
+ *          'optimize_huffman' - 1: two passes, first one gathers statistics
+ *          of quantized blocks and builds tables for the image
+ *          into 'opt_bits', 'opt_vals'. Second pass only Huffman codes
+ *          stored blocks. defaults to 0
+ *          'trellis' - 1: rate-distortion optimized quantization of AC
+ *          coeffs. under Huffman tables used for coding. Several times
+ *          slower, 0 - plain rounding. defaults to 0
+ *          'progressive' - 1: progressive JPEG (SOF2), whole image
+ *          is transformed once and stored blocks are coded by scans
+ *          of 'scan_script'. Every scan gets its own optimal Huffman
+ *          tables, 'optimize_huffman' doesn't matter. Scans have no
+ *          restart markers: 'restart_rows' must be 0, intervals picked
+ *          for 'num_threads' are dropped. defaults to 0
+ *          'scan_script', 'num_scans' - scans of progressive JPEG.
+ *          NULL - default script of libjpeg jpeg_simple_progression()
+ * 
  *          'width' - width in pixels
  *          'height' - height in pixels
  * 
- *          'q_table' - quantization tables
+ *          'q_table' - quantization tables in zig-zag (file) order
  *          1 - Luma; 2 - Chroma
+ *          'fdct_q_table' - reciprocal quantization factors in natural order
+ *          matching output of selected 'dct'
+ * 
+ *          'dct' - forward DCT implementation, see dct_method
+ *          defaults to DCT_SEPARABLE
+ *          'fdct_aan' - kernel used by DCT_AAN. picked by CPU in jpeg_alloc()
+ *          'color_row', 'color_row_fixed' - RGB to YCbCr kernels for
+ *          float and DCT_ISLOW paths. picked by CPU in jpeg_alloc()
+ *          'islow_recip', 'islow_bias', 'islow_shift' - DCT_ISLOW quantization
+ *          q = ((|coeff| + bias) * recip) >> shift, natural order
+ * 
+ *          'num_components' - 1 (grayscale) or 3 (YCbCr), set from input format
+ *          'subsampling' - chroma subsampling. defaults to JPEG_444
+ *          'chroma_filter' - chroma downsampling filter. defaults to JPEG_FILTER_BOX
+ * 
+ *          'num_threads' - threads used by jpeg_encode_data(). defaults to 1
+ *          'restart_rows' - MCU rows per restart interval. 0 - no restart
+ *          markers, unless 'num_threads' > 1, then picked automatically
+ *          'restart_interval' - MCUs per restart interval of encoded data
+ *          (DRI segment). 0 - no restart markers
  * 
  *          'result' - after encoding contains encoded data 
  *          (Start of Scan/SOS segment JPEG spec.) 
+ *          progressive JPEG has all scans there, each with DHT and SOS
+ *          'output' - complete JFIF stream from jpeg_encode_to_memory()
+ * 
+ *          Encoder is meant to be reused for many images. Derived tables
+ *          are rebuilt only when settings in 'q_key' change, 'huffman_default'
+ *          is set while ehuff* tables hold default codes.
+ *          'bands', 'coef', 'freq' - scratch memory of jpeg_encode_data(),
+ *          kept between images along with 'result' and 'output'
+ *          'raw', 'sse' - same for rate control
+ *          'stream' - state of jpeg_stream_begin() .. jpeg_stream_finish()
  */
 struct jpeg_encoder {
-    int use_fdct;
+    dct_method dct;
+    dct_aan_fn fdct_aan;
+    color_row_fn color_row;
+    color_row_fixed_fn color_row_fixed;
     int compression_lvl;
+    int quality;
+    int custom_q;
+    uint8_t custom_q_table[2][64];
 
     uint8_t         ehuffsize[4][257];
     uint16_t        ehuffcode[4][256];
     uint8_t const * ht_bits[4];
     uint8_t const * ht_vals[4];
 
+    int optimize_huffman;
+    uint8_t opt_bits[4][16];
+    uint8_t opt_vals[4][256];
+
+    int trellis;
+
+    int progressive;
+    const jpeg_scan_info *scan_script;
+    int num_scans;
+
     uint16_t width;
     uint16_t height;
+    int num_components;
     uint8_t q_table[2][64];//Quantization table
-    float* fdct_q_table[2];
+    float fdct_q_table[2][64];
+    uint32_t islow_recip[2][64];
+    uint16_t islow_bias[2][64];
+    uint8_t islow_shift[2][64];
+
+    jpeg_subsampling subsampling;
+    jpeg_chroma_filter chroma_filter;
+
+    int num_threads;
+    unsigned restart_rows;
+    uint16_t restart_interval;
 
     buffer_t result;
+    buffer_t output;
+
+    jpeg_q_key q_key;
+    int q_valid;
+    int huffman_default;
+
+    buffer_t *bands;
+    size_t bands_cap;
+    int16_t (*coef)[64];
+    size_t coef_cap;
+    uint32_t (*freq)[4][257];
+    size_t freq_cap;
+    int16_t (*raw)[64];
+    size_t raw_cap;
+    double *sse;
+    size_t sse_cap;
+
+    struct jpeg_stream *stream;
 };
 
 //convenience typedef
@@ -81,6 +258,17 @@ jpeg_encoder_t jpeg_alloc();
  */
 void jpeg_free(jpeg_encoder_t);
 
+/**
+ * @brief Prepares encoder for next image
+ * 
+ * @details Clears 'result' and 'output' but keeps their memory and
+ *          cached tables, so encoding similar images doesn't allocate.
+ *          Called by jpeg_encode_data()
+ * 
+ * @param enc 
+ */
+void jpeg_reset(jpeg_encoder_t enc);
+
 /**
  * @brief Creates default Huffman tables
  * 
@@ -88,17 +276,92 @@ void jpeg_free(jpeg_encoder_t);
  */
 void jpeg_setup_default_huffman_tables(jpeg_encoder_t enc);
 
+/**
+ * @brief Fills extended tables 'ehuffsize', 'ehuffcode' from 'ht_bits', 'ht_vals'
+ * 
+ * @param enc jpeg encoder instance
+ */
+void jpeg_setup_huffman_codes(jpeg_encoder_t enc);
+
+/**
+ * @brief Builds optimal Huffman table limited to 16 bit codes (JPEG spec. K.2)
+ * 
+ * @param freq symbol counts, last element is ignored
+ * @param bits[out] number of codes of every length 1..16
+ * @param vals[out] symbols ordered by code length
+ */
+void jpeg_build_huffman_table(const uint32_t freq[257], uint8_t bits[16], uint8_t vals[256]);
+
 void _jpeg_copy_table(uint8_t* dest, const uint8_t* src);
 
 /**
- * @brief Creates default quantization tables
+ * @brief Scales quantization table by IJG quality factor
+ * 
+ * @details quality < 50: 5000 / quality percent; else 200 - 2 * quality.
+ *          Values are clamped to 1..255 for baseline
+ * 
+ * @param dest[out] zig-zag order, as in 'q_table'
+ * @param src natural order
+ * @param quality 1..100, 0 copies 'src' as is
+ */
+void jpeg_scale_q_table(uint8_t* dest, const uint8_t* src, int quality);
+
+/**
+ * @brief Uses custom quantization tables instead of JPEG spec ones
+ * 
+ * @details Tables are copied and scaled by 'quality' like spec tables
+ * 
+ * @param enc 
+ * @param luma natural order. NULL - back to built in tables
+ * @param chroma natural order. NULL - same as luma
+ */
+void jpeg_set_q_tables(jpeg_encoder_t enc, const uint8_t luma[64], const uint8_t chroma[64]);
+
+/**
+ * @brief Creates quantization tables for 'quality' or 'compression_lvl'
+ * 
+ * @note Always rebuilds. jpeg_encode_data() calls it only when
+ *       'quality', 'compression_lvl' or 'dct' changed since last image
  * 
  * @param enc 
  */
 void jpeg_setup_q_tables(jpeg_encoder_t enc);
 
 /**
- * @brief Encodes data into enc->result buffer
+ * @brief Input of tightly packed 'format' pixels
+ * 
+ * @param data 
+ * @param format any but JPEG_PIXEL_PLANAR
+ * @return jpeg_input 
+ */
+jpeg_input jpeg_input_packed(const uint8_t* data, jpeg_pixel_format format);
+
+/**
+ * @brief Pixel format for 'channels' bytes per pixel, as returned by stbi_load()
+ * 
+ * @param channels 1 gray, 2 gray + alpha, 3 RGB, 4 RGBA
+ * @return jpeg_pixel_format 
+ */
+jpeg_pixel_format jpeg_format_from_channels(int channels);
+
+/**
+ * @brief Encodes pixels of 'input' into enc->result buffer
+ * 
+ * @details With restart intervals every interval is encoded separately
+ *          on one of 'num_threads' threads and results are joined
+ *          with RSTn markers in between.
+ *          Gray formats produce single component JPEG, one block per MCU
+ *          and 'subsampling' is ignored
+ * 
+ * @param enc 
+ * @param width 
+ * @param height 
+ * @param input 
+ */
+void jpeg_encode_input(jpeg_encoder_t enc, unsigned width, unsigned height, const jpeg_input* input);
+
+/**
+ * @brief jpeg_encode_input() of tightly packed RGB data
  * 
  * @param enc 
  * @param width 
@@ -107,6 +370,111 @@ void jpeg_setup_q_tables(jpeg_encoder_t enc);
  */
 void jpeg_encode_data(jpeg_encoder_t enc, unsigned width, unsigned height, const uint8_t* data);
 
+// PSNR reported for lossless result
+#define JPEG_PSNR_MAX 99.0
+
+/**
+ * @brief Encodes pixels of 'input' at highest quality that fits 'max_bytes'
+ * 
+ * @details DCT runs once, unquantized coeffs. are kept. Quality is binary
+ *          searched by quantizing them and counting Huffman code lengths
+ *          without writing bits. Only chosen quality is Huffman coded.
+ *          Coefficients are quantized as in DCT_ISLOW for every 'dct',
+ *          so results may differ slightly from jpeg_encode_data().
+ *          'trellis' and 'optimize_huffman' are honored while measuring.
+ *          'progressive' images are coded at every step of the search,
+ *          slower but their size is exact
+ * 
+ * @note 'quality' of encoder is set to chosen value
+ * 
+ * @param enc 
+ * @param width 
+ * @param height 
+ * @param input 
+ * @param max_bytes size of complete JFIF stream
+ * @return int quality used. 1 when even quality 1 doesn't fit 'max_bytes'
+ */
+int jpeg_encode_target_size(jpeg_encoder_t enc, unsigned width, unsigned height, const jpeg_input* input,
+                            size_t max_bytes);
+
+/**
+ * @brief Encodes pixels of 'input' at lowest quality with luma PSNR of at least 'min_psnr'
+ * 
+ * @details Same search as jpeg_encode_target_size(). PSNR is measured
+ *          in DCT domain over coded luma blocks, rounding of decoded
+ *          samples to 8 bits is not included
+ * 
+ * @note 'quality' of encoder is set to chosen value
+ * 
+ * @param enc 
+ * @param width 
+ * @param height 
+ * @param input 
+ * @param min_psnr dB
+ * @return int quality used. 100 when 'min_psnr' can't be reached
+ */
+int jpeg_encode_target_psnr(jpeg_encoder_t enc, unsigned width, unsigned height, const jpeg_input* input,
+                            double min_psnr);
+
+/**
+ * @brief Estimated size of encoded data for current settings
+ * 
+ * @details Used to pre-size output buffers from image dimensions
+ *          Quantization tables must be set up
+ * 
+ * @param enc 
+ * @param width 
+ * @param height 
+ * @return size_t bytes
+ */
+size_t jpeg_estimate_size(jpeg_encoder_t enc, unsigned width, unsigned height);
+
+/**
+ * @brief Appends JFIF headers up to and including SOS segment
+ * 
+ * @note Call after jpeg_encode_data(), tables and restart interval
+ *       of encoded data are written
+ * 
+ * @param enc 
+ * @param out 
+ */
+void jpeg_write_headers(jpeg_encoder_t enc, buffer_t out);
+
+/**
+ * @brief Appends complete JFIF stream (SOI..EOI) of encoded data to 'out'
+ * 
+ * @param enc 
+ * @param out caller owned buffer
+ */
+void jpeg_write_to_buffer(jpeg_encoder_t enc, buffer_t out);
+
+/**
+ * @brief Encodes data into complete JFIF stream in memory
+ * 
+ * @param enc 
+ * @param width 
+ * @param height 
+ * @param data 
+ * @return buffer_t enc->output. Owned by encoder, valid until next call or jpeg_free()
+ */
+buffer_t jpeg_encode_to_memory(jpeg_encoder_t enc, unsigned width, unsigned height, const uint8_t* data);
+
+/**
+ * @brief Sink for encoded bytes. Same signature as stbi_write_func
+ */
+typedef void jpeg_write_func(void* context, void* data, int size);
+
+/**
+ * @brief Passes complete JFIF stream of encoded data to 'func'
+ * 
+ * @details 'func' is called few times: headers, entropy coded data, EOI
+ * 
+ * @param enc 
+ * @param func 
+ * @param context passed to 'func' as is
+ */
+void jpeg_write_to_func(jpeg_encoder_t enc, jpeg_write_func* func, void* context);
+
 /**
  * @brief Writes data from enc->result into file
  * 
@@ -116,47 +484,46 @@ void jpeg_encode_data(jpeg_encoder_t enc, unsigned width, unsigned height, const
 void jpeg_write_to_file(jpeg_encoder_t enc, const char* filename);
 
 /**
- * @brief Bitstack
+ * @brief Starts encoding image pushed row by row with jpeg_stream_write_rows()
  * 
- * @note Function adapted from https://github.com/serge-rgb/TinyJPEG
+ * @details Only one MCU row (8 or 16 image rows) is buffered, so memory
+ *          doesn't depend on image height. Headers are passed to 'func'
+ *          right away, entropy coded data after every MCU row.
+ *          Default Huffman tables are used, 'optimize_huffman' and
+ *          'num_threads' are ignored, 'progressive' must be 0. 'restart_rows'
+ *          and 'trellis' are honored, output is the same as of jpeg_encode_input()
+ *          with 'optimize_huffman' 0.
+ *          enc->result is not used
  * 
  * @param enc 
- * @param bitbuffer 
- * @param location 
- * @param num_bits 
- * @param bits 
+ * @param width 
+ * @param height 
+ * @param format any but JPEG_PIXEL_PLANAR
+ * @param func sink for encoded bytes
+ * @param context passed to 'func' as is
  */
-static inline void tjei_write_bits(jpeg_encoder_t enc,
-                                       uint32_t* bitbuffer, uint32_t* location,
-                                       uint16_t num_bits, uint16_t bits)
-{
-    //   v-- location
-    //  [                     ]   <-- bit buffer
-    // 32                     0
-    //
-    // This call pushes to the bitbuffer and saves the location. Data is pushed
-    // from most significant to less significant.
-    // When we can write a full byte, we write a byte and shift.
-
-    // Push the stack.
-    uint32_t nloc = *location + num_bits;
-    *bitbuffer |= (uint32_t)(bits << (32 - nloc));
-    *location = nloc;
-    while ( *location >= 8 ) {
-        // Grab the most significant byte.
-        uint8_t c = (uint8_t)((*bitbuffer) >> 24);
-        // Write it to file.
-        buffer_append(enc->result, &c, 1);
-        if ( c == 0xff )  {
-            // Special case: tell JPEG this is not a marker.
-            uint8_t z = 0;
-            buffer_append(enc->result, &z, 1);
-        }
-        // Pop the stack.
-        *bitbuffer <<= 8;
-        *location -= 8;
-    }
-}
+void jpeg_stream_begin(jpeg_encoder_t enc, unsigned width, unsigned height, jpeg_pixel_format format,
+                       jpeg_write_func* func, void* context);
+
+/**
+ * @brief Pushes next 'n_rows' image rows, top to bottom
+ * 
+ * @details Rows may come in chunks of any size, MCU rows are encoded
+ *          and flushed as soon as they are complete
+ * 
+ * @param enc 
+ * @param rows first row in format given to jpeg_stream_begin()
+ * @param n_rows 
+ * @param stride bytes between rows. 0 - tightly packed
+ */
+void jpeg_stream_write_rows(jpeg_encoder_t enc, const uint8_t* rows, unsigned n_rows, size_t stride);
+
+/**
+ * @brief Writes remaining bits and EOI. All rows must be pushed
+ * 
+ * @param enc 
+ */
+void jpeg_stream_finish(jpeg_encoder_t enc);
 
 typedef struct {
     uint8_t category: 4;
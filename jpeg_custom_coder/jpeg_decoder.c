@@ -0,0 +1,1089 @@
+#include "jpeg_decoder.h"
+
+// natural position of zigzag index, padded so corrupt runs past 63 stay in block
+static const uint8_t jpeg_natural[64 + 16] = {
+     0,  1,  8, 16,  9,  2,  3, 10,
+    17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63,
+    63, 63, 63, 63, 63, 63, 63, 63,
+    63, 63, 63, 63, 63, 63, 63, 63
+};
+
+jpeg_decoder_t jpeg_decoder_alloc()
+{
+    jpeg_decoder_t dec = (jpeg_decoder_t)calloc(1, sizeof(struct jpeg_decoder));
+
+    dec->idct = idct_select();
+    dec->scale_denom = 1;
+
+    return dec;
+}
+
+void jpeg_decoder_free(jpeg_decoder_t dec)
+{
+    for (int c = 0; c < 3; c++)
+    {
+        free(dec->comp[c].plane);
+        free(dec->comp[c].coef);
+    }
+
+    free(dec->pixels);
+    free(dec->row);
+    free(dec->colsum);
+    free(dec);
+}
+
+static inline int jpeg_dec_fail(jpeg_decoder_t dec, const char *error)
+{
+    dec->error = error;
+    return -1;
+}
+
+/**
+ * @brief Grows 'ptr' to at least 'size' bytes, old contents are dropped
+ *
+ * @return 0 or -1 when out of memory
+ */
+static int jpeg_dec_reserve(void **ptr, size_t *cap, size_t size)
+{
+    if (size <= *cap)
+        return 0;
+
+    free(*ptr);
+    *ptr = malloc(size);
+    *cap = *ptr ? size : 0;
+
+    return *ptr ? 0 : -1;
+}
+
+//-----------------------------------------------------------------------------
+// Bit reader
+//-----------------------------------------------------------------------------
+
+/**
+ * @brief Tops 'acc' up to at least 57 bits
+ *
+ * @details 0xFF00 is unstuffed to 0xFF. Reader stops in front of any other
+ *          marker and feeds zeros from then on, 'marker' is set
+ */
+static void jpeg_dec_fill(jpeg_decoder_t dec)
+{
+    while (dec->bits <= 56)
+    {
+        uint32_t c = 0;
+
+        if (!dec->marker && dec->pos < dec->size)
+        {
+            c = dec->data[dec->pos];
+
+            if (c != 0xFF)
+                dec->pos++;
+            else if (dec->pos + 1 < dec->size && dec->data[dec->pos + 1] == 0x00)
+                dec->pos += 2;
+            else
+            {
+                dec->marker = 1;
+                c = 0;
+            }
+        }
+
+        dec->acc |= (uint64_t)c << (56 - dec->bits);
+        dec->bits += 8;
+    }
+}
+
+// next 'n' bits, 0 < n <= 16
+static inline uint32_t jpeg_dec_bits(jpeg_decoder_t dec, int n)
+{
+    if (dec->bits < n)
+        jpeg_dec_fill(dec);
+
+    uint32_t v = (uint32_t)(dec->acc >> (64 - n));
+    dec->acc <<= n;
+    dec->bits -= n;
+
+    return v;
+}
+
+static inline int jpeg_dec_bit(jpeg_decoder_t dec)
+{
+    return (int)jpeg_dec_bits(dec, 1);
+}
+
+// 's' bit magnitude category value to signed number (JPEG F.12)
+static inline int jpeg_dec_extend(uint32_t v, int s)
+{
+    return v < (1u << (s - 1)) ? (int)v - (1 << s) + 1 : (int)v;
+}
+
+// signed value of category 's', 0 for s = 0
+static inline int jpeg_dec_receive(jpeg_decoder_t dec, int s)
+{
+    return s ? jpeg_dec_extend(jpeg_dec_bits(dec, s), s) : 0;
+}
+
+/**
+ * @brief Drops buffered bits and moves 'pos' in front of next marker
+ *
+ * @details bytes left before marker are padding of entropy coded segment
+ */
+static void jpeg_dec_align(jpeg_decoder_t dec)
+{
+    dec->acc = 0;
+    dec->bits = 0;
+    dec->marker = 0;
+
+    while (dec->pos + 1 < dec->size &&
+           !(dec->data[dec->pos] == 0xFF && dec->data[dec->pos + 1] != 0x00 && dec->data[dec->pos + 1] != 0xFF))
+        dec->pos++;
+}
+
+//-----------------------------------------------------------------------------
+// Huffman decoding
+//-----------------------------------------------------------------------------
+
+/**
+ * @brief Builds decoding tables from BITS and HUFFVAL of DHT segment
+ *
+ * @return 0 or -1 if lengths don't describe a prefix code
+ */
+static int jpeg_huff_decoder_build(jpeg_huff_decoder *h, const uint8_t bits[16], const uint8_t *vals, int n)
+{
+    int32_t code = 0;
+    int k = 0;
+
+    memset(h->fast, 0, sizeof(h->fast));
+    memcpy(h->vals, vals, (size_t)n);
+
+    for (int l = 1; l <= 16; l++)
+    {
+        h->delta[l] = k - code;
+
+        for (int i = 0; i < bits[l - 1]; i++, k++, code++)
+        {
+            // more codes than 'l' bits can hold, checked before 'fast' is written
+            if (code >= (1 << l))
+                return -1;
+
+            if (l <= JPEG_HUFF_LOOKAHEAD)
+            {
+                int shift = JPEG_HUFF_LOOKAHEAD - l;
+                for (int j = 0; j < (1 << shift); j++)
+                    h->fast[(code << shift) + j] = (uint16_t)((l << 8) | vals[k]);
+            }
+        }
+
+        h->maxcode[l] = code;
+        code <<= 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Decodes one Huffman coded symbol
+ *
+ * @return symbol or -1 for bits which are no code
+ */
+static inline int jpeg_dec_huff(jpeg_decoder_t dec, const jpeg_huff_decoder *h)
+{
+    if (dec->bits < 16)
+        jpeg_dec_fill(dec);
+
+    uint32_t e = h->fast[dec->acc >> (64 - JPEG_HUFF_LOOKAHEAD)];
+
+    if (e)
+    {
+        dec->acc <<= e >> 8;
+        dec->bits -= (int)(e >> 8);
+        return (int)(e & 0xFF);
+    }
+
+    for (int l = JPEG_HUFF_LOOKAHEAD + 1; l <= 16; l++)
+    {
+        int32_t code = (int32_t)(dec->acc >> (64 - l));
+
+        if (code < h->maxcode[l])
+        {
+            dec->acc <<= l;
+            dec->bits -= l;
+            return h->vals[(code + h->delta[l]) & 0xFF];
+        }
+    }
+
+    return -1;
+}
+
+//-----------------------------------------------------------------------------
+// Block decoding
+//-----------------------------------------------------------------------------
+
+/**
+ * @brief Decodes sequential block into natural order coeffs.
+ */
+static int jpeg_dec_block(jpeg_decoder_t dec, jpeg_component *c, int16_t blk[64])
+{
+    const jpeg_huff_decoder *ac = &dec->huff[1][c->ta];
+    int t = jpeg_dec_huff(dec, &dec->huff[0][c->td]);
+
+    if (t < 0 || t > 15)
+        return jpeg_dec_fail(dec, "bad Huffman code");
+
+    // 1/8 scale needs only DC
+    if (dec->zz_max)
+        memset(blk, 0, 64 * sizeof(int16_t));
+
+    c->dc_pred += jpeg_dec_receive(dec, t);
+    blk[0] = (int16_t)c->dc_pred;
+
+    for (int k = 1; k < 64; k++)
+    {
+        int rs = jpeg_dec_huff(dec, ac);
+
+        if (rs < 0)
+            return jpeg_dec_fail(dec, "bad Huffman code");
+
+        int r = rs >> 4;
+        int s = rs & 15;
+
+        if (s == 0)
+        {
+            if (r != 15)
+                break; // EOB
+            k += 15;   // ZRL
+            continue;
+        }
+
+        k += r;
+        if (k > 63)
+            return jpeg_dec_fail(dec, "coefficient index past end of block");
+
+        // value bits of coeffs. reduced IDCT won't read are only skipped
+        if (k <= dec->zz_max)
+            blk[jpeg_natural[k]] = (int16_t)jpeg_dec_receive(dec, s);
+        else
+            jpeg_dec_bits(dec, s);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief First DC scan of progressive image, value is scaled by 2^Al
+ */
+static int jpeg_dec_dc_first(jpeg_decoder_t dec, jpeg_component *c, int16_t blk[64])
+{
+    int t = jpeg_dec_huff(dec, &dec->huff[0][c->td]);
+
+    if (t < 0 || t > 15)
+        return jpeg_dec_fail(dec, "bad Huffman code");
+
+    c->dc_pred += jpeg_dec_receive(dec, t);
+    blk[0] = (int16_t)(c->dc_pred * (1 << dec->Al));
+
+    return 0;
+}
+
+/**
+ * @brief DC refinement, one more bit of every DC
+ */
+static int jpeg_dec_dc_refine(jpeg_decoder_t dec, int16_t blk[64])
+{
+    if (jpeg_dec_bit(dec))
+        blk[0] = (int16_t)(blk[0] | (1 << dec->Al));
+
+    return 0;
+}
+
+/**
+ * @brief First AC scan of band Ss..Se, with runs of empty bands (EOBRUN)
+ */
+static int jpeg_dec_ac_first(jpeg_decoder_t dec, jpeg_component *c, int16_t blk[64])
+{
+    const jpeg_huff_decoder *ac = &dec->huff[1][c->ta];
+
+    if (dec->eobrun)
+    {
+        dec->eobrun--;
+        return 0;
+    }
+
+    for (int k = dec->Ss; k <= dec->Se; k++)
+    {
+        int rs = jpeg_dec_huff(dec, ac);
+
+        if (rs < 0)
+            return jpeg_dec_fail(dec, "bad Huffman code");
+
+        int r = rs >> 4;
+        int s = rs & 15;
+
+        if (s == 0)
+        {
+            if (r < 15)
+            {
+                dec->eobrun = (1u << r) - 1;
+                if (r)
+                    dec->eobrun += jpeg_dec_bits(dec, r);
+                break;
+            }
+            k += 15;
+            continue;
+        }
+
+        k += r;
+        if (k > 63)
+            return jpeg_dec_fail(dec, "coefficient index past end of block");
+
+        blk[jpeg_natural[k]] = (int16_t)(jpeg_dec_receive(dec, s) * (1 << dec->Al));
+    }
+
+    return 0;
+}
+
+// correction bit of already nonzero coeff.
+static inline void jpeg_dec_refine_coef(jpeg_decoder_t dec, int16_t *coef, int p1)
+{
+    if (jpeg_dec_bit(dec) && (*coef & p1) == 0)
+        *coef = (int16_t)(*coef >= 0 ? *coef + p1 : *coef - p1);
+}
+
+/**
+ * @brief AC refinement of band Ss..Se (JPEG G.1.2.3)
+ *
+ * @details new coeffs. are +-1 << Al, skipped zero run counts only coeffs.
+ *          which are still zero. Every nonzero coeff. passed gets correction bit
+ */
+static int jpeg_dec_ac_refine(jpeg_decoder_t dec, jpeg_component *c, int16_t blk[64])
+{
+    const jpeg_huff_decoder *ac = &dec->huff[1][c->ta];
+    const int p1 = 1 << dec->Al;
+    int k = dec->Ss;
+
+    if (dec->eobrun == 0)
+    {
+        for (; k <= dec->Se; k++)
+        {
+            int rs = jpeg_dec_huff(dec, ac);
+
+            if (rs < 0)
+                return jpeg_dec_fail(dec, "bad Huffman code");
+
+            int r = rs >> 4;
+            int s = rs & 15;
+            int value = 0;
+
+            if (s)
+            {
+                if (s != 1)
+                    return jpeg_dec_fail(dec, "bad refinement value");
+                value = jpeg_dec_bit(dec) ? p1 : -p1;
+            }
+            else if (r != 15)
+            {
+                dec->eobrun = 1u << r;
+                if (r)
+                    dec->eobrun += jpeg_dec_bits(dec, r);
+                break;
+            }
+
+            // skip 'r' zero coeffs., refining nonzero ones on the way
+            for (; k <= dec->Se; k++)
+            {
+                int16_t *coef = &blk[jpeg_natural[k]];
+
+                if (*coef)
+                    jpeg_dec_refine_coef(dec, coef, p1);
+                else if (--r < 0)
+                    break;
+            }
+
+            if (value && k <= dec->Se)
+                blk[jpeg_natural[k]] = (int16_t)value;
+        }
+    }
+
+    if (dec->eobrun)
+    {
+        for (; k <= dec->Se; k++)
+        {
+            int16_t *coef = &blk[jpeg_natural[k]];
+
+            if (*coef)
+                jpeg_dec_refine_coef(dec, coef, p1);
+        }
+
+        dec->eobrun--;
+    }
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Scans
+//-----------------------------------------------------------------------------
+
+/**
+ * @brief Decodes block (bx, by) of component 'c' in current scan
+ *
+ * @details sequential blocks are transformed into plane right away,
+ *          progressive ones are accumulated in 'coef'
+ */
+static int jpeg_dec_unit(jpeg_decoder_t dec, jpeg_component *c, unsigned bx, unsigned by)
+{
+    if (!dec->progressive)
+    {
+        int16_t blk[64];
+
+        if (jpeg_dec_block(dec, c, blk))
+            return -1;
+
+        dec->block_idct(blk, &dec->q_table[c->tq],
+                        c->plane + (size_t)by * dec->block_size * c->stride + bx * dec->block_size, c->stride);
+        return 0;
+    }
+
+    int16_t *blk = c->coef[(size_t)by * c->bw + bx];
+
+    if (dec->Ss == 0)
+        return dec->Ah ? jpeg_dec_dc_refine(dec, blk) : jpeg_dec_dc_first(dec, c, blk);
+
+    return dec->Ah ? jpeg_dec_ac_refine(dec, c, blk) : jpeg_dec_ac_first(dec, c, blk);
+}
+
+/**
+ * @brief Expects RSTn after every 'restart_interval' MCUs, resets predictors
+ */
+static void jpeg_dec_restart(jpeg_decoder_t dec)
+{
+    jpeg_dec_align(dec);
+
+    if (dec->pos + 1 < dec->size && dec->data[dec->pos + 1] >= 0xD0 && dec->data[dec->pos + 1] <= 0xD7)
+        dec->pos += 2;
+
+    for (int i = 0; i < dec->scan_n; i++)
+        dec->scan_comp[i]->dc_pred = 0;
+    dec->eobrun = 0;
+}
+
+/**
+ * @brief Decodes entropy coded data of scan, leaves 'pos' at next marker
+ *
+ * @details single component scans code 'scan_bw' x 'scan_bh' blocks one
+ *          by one, interleaved ones whole MCUs of h x v blocks per component
+ */
+static int jpeg_dec_scan(jpeg_decoder_t dec)
+{
+    unsigned units_x, units_y;
+    unsigned todo = dec->restart_interval;
+
+    if (dec->scan_n == 1)
+    {
+        units_x = dec->scan_comp[0]->scan_bw;
+        units_y = dec->scan_comp[0]->scan_bh;
+    }
+    else
+    {
+        units_x = dec->mcus_x;
+        units_y = dec->mcus_y;
+    }
+
+    // band reduced IDCT won't read: entropy coded data is skipped, RSTn included
+    if (dec->Ss > dec->zz_max && dec->scan_comp[0]->skip_ac)
+    {
+        do
+        {
+            jpeg_dec_align(dec);
+            dec->pos += 2;
+        } while (dec->pos < dec->size && dec->data[dec->pos - 1] >= 0xD0 && dec->data[dec->pos - 1] <= 0xD7);
+        dec->pos -= 2;
+        return 0;
+    }
+
+    dec->acc = 0;
+    dec->bits = 0;
+    dec->marker = 0;
+    dec->eobrun = 0;
+    for (int i = 0; i < dec->scan_n; i++)
+        dec->scan_comp[i]->dc_pred = 0;
+
+    for (unsigned my = 0; my < units_y; my++)
+    {
+        for (unsigned mx = 0; mx < units_x; mx++)
+        {
+            if (dec->scan_n == 1)
+            {
+                if (jpeg_dec_unit(dec, dec->scan_comp[0], mx, my))
+                    return -1;
+            }
+            else
+            {
+                for (int i = 0; i < dec->scan_n; i++)
+                {
+                    jpeg_component *c = dec->scan_comp[i];
+
+                    for (int y = 0; y < c->v; y++)
+                        for (int x = 0; x < c->h; x++)
+                            if (jpeg_dec_unit(dec, c, mx * c->h + x, my * c->v + y))
+                                return -1;
+                }
+            }
+
+            if (dec->restart_interval && --todo == 0)
+            {
+                if (my != units_y - 1 || mx != units_x - 1)
+                    jpeg_dec_restart(dec);
+                todo = dec->restart_interval;
+            }
+        }
+    }
+
+    jpeg_dec_align(dec);
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Marker segments
+//-----------------------------------------------------------------------------
+
+// big endian u16 at 'p'
+static inline unsigned jpeg_dec_u16(const uint8_t *p)
+{
+    return (unsigned)p[0] << 8 | p[1];
+}
+
+static int jpeg_dec_dqt(jpeg_decoder_t dec, const uint8_t *p, size_t len)
+{
+    while (len > 0)
+    {
+        int pq = p[0] >> 4;
+        int tq = p[0] & 15;
+        size_t n = 1 + 64 * (size_t)(pq + 1);
+
+        if (pq > 1 || tq > 3 || len < n)
+            return jpeg_dec_fail(dec, "bad DQT segment");
+
+        uint16_t q[64];
+        for (int k = 0; k < 64; k++)
+            q[jpeg_natural[k]] = (uint16_t)(pq ? jpeg_dec_u16(p + 1 + 2 * k) : p[1 + k]);
+        idct_table_init(&dec->q_table[tq], q);
+
+        dec->q_valid[tq] = 1;
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int jpeg_dec_dht(jpeg_decoder_t dec, const uint8_t *p, size_t len)
+{
+    while (len > 0)
+    {
+        int tc = p[0] >> 4;
+        int th = p[0] & 15;
+        int n = 0;
+
+        if (tc > 1 || th > 3 || len < 17)
+            return jpeg_dec_fail(dec, "bad DHT segment");
+
+        for (int i = 0; i < 16; i++)
+            n += p[1 + i];
+
+        if (n > 256 || len < 17 + (size_t)n)
+            return jpeg_dec_fail(dec, "bad DHT segment");
+
+        if (jpeg_huff_decoder_build(&dec->huff[tc][th], p + 1, p + 17, n))
+            return jpeg_dec_fail(dec, "bad Huffman table");
+
+        dec->huff_valid[tc][th] = 1;
+        p += 17 + n;
+        len -= 17 + (size_t)n;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Clears 'skip_ac' of components refined across 'zz_max' later on
+ *
+ * @details refinement of band Ss..Se sends correction bits only for coeffs.
+ *          which are already nonzero, so it can't be decoded after first
+ *          scans of its upper part were skipped. Walks SOS headers of
+ *          whole file, entropy coded data is passed with memchr()
+ */
+static void jpeg_dec_plan_skips(jpeg_decoder_t dec)
+{
+    size_t pos = dec->pos;
+
+    for (int i = 0; i < dec->num_components; i++)
+        dec->comp[i].skip_ac = 1;
+
+    while (pos + 4 <= dec->size)
+    {
+        const uint8_t *ff = (const uint8_t *)memchr(dec->data + pos, 0xFF, dec->size - pos);
+        if (ff == NULL)
+            break;
+        pos = (size_t)(ff - dec->data);
+
+        int marker = pos + 1 < dec->size ? dec->data[pos + 1] : 0;
+        if (marker == 0x00 || marker == 0xFF || (marker >= 0xD0 && marker <= 0xD7))
+        {
+            pos += marker == 0xFF ? 1 : 2;
+            continue;
+        }
+        if (marker == 0xD9 || pos + 4 > dec->size)
+            break;
+
+        size_t len = jpeg_dec_u16(dec->data + pos + 2);
+        const uint8_t *p = dec->data + pos + 4;
+
+        // component count is checked against length before fields past it are read
+        if (marker == 0xDA && len >= 6 && pos + 2 + len <= dec->size && len == 6 + 2 * (size_t)p[0])
+        {
+            int n = p[0];
+            int Ss = p[1 + 2 * n], Se = p[2 + 2 * n], Ah = p[3 + 2 * n] >> 4;
+
+            if (Ah && Ss <= dec->zz_max && Se > dec->zz_max)
+                for (int i = 0; i < n; i++)
+                    for (int k = 0; k < dec->num_components; k++)
+                        if (dec->comp[k].id == p[1 + 2 * i])
+                            dec->comp[k].skip_ac = 0;
+        }
+
+        pos += 2 + len;
+    }
+}
+
+/**
+ * @brief Reads frame header, sizes component planes
+ */
+static int jpeg_dec_sof(jpeg_decoder_t dec, const uint8_t *p, size_t len)
+{
+    if (dec->num_components)
+        return jpeg_dec_fail(dec, "more than one frame");
+
+    if (len < 6 || p[0] != 8)
+        return jpeg_dec_fail(dec, "only 8 bit precision is supported");
+
+    dec->image_height = jpeg_dec_u16(p + 1);
+    dec->image_width = jpeg_dec_u16(p + 3);
+    int n = p[5];
+
+    if (dec->image_width == 0 || dec->image_height == 0)
+        return jpeg_dec_fail(dec, "bad image size");
+
+    if ((n != 1 && n != 3) || len < 6 + 3 * (size_t)n)
+        return jpeg_dec_fail(dec, "only 1 and 3 component images are supported");
+
+    dec->hmax = dec->vmax = 1;
+    for (int i = 0; i < n; i++)
+    {
+        jpeg_component *c = &dec->comp[i];
+        const uint8_t *q = p + 6 + 3 * i;
+
+        c->id = q[0];
+        c->h = q[1] >> 4;
+        c->v = q[1] & 15;
+        c->tq = q[2];
+
+        if (c->h < 1 || c->h > 4 || c->v < 1 || c->v > 4 || c->tq > 3)
+            return jpeg_dec_fail(dec, "bad component in frame header");
+
+        dec->hmax = c->h > dec->hmax ? c->h : dec->hmax;
+        dec->vmax = c->v > dec->vmax ? c->v : dec->vmax;
+    }
+
+    dec->mcus_x = (dec->image_width + 8 * dec->hmax - 1) / (8 * dec->hmax);
+    dec->mcus_y = (dec->image_height + 8 * dec->vmax - 1) / (8 * dec->vmax);
+
+    // every block becomes block_size x block_size samples
+    const unsigned bs = (unsigned)dec->block_size;
+    dec->width = (dec->image_width * bs + 7) / 8;
+    dec->height = (dec->image_height * bs + 7) / 8;
+
+    for (int i = 0; i < n; i++)
+    {
+        jpeg_component *c = &dec->comp[i];
+
+        if (dec->hmax % c->h || dec->vmax % c->v)
+            return jpeg_dec_fail(dec, "non-integer sampling ratios are not supported");
+
+        unsigned hmax = (unsigned)dec->hmax, vmax = (unsigned)dec->vmax;
+
+        c->width = (dec->image_width * c->h * bs + 8 * hmax - 1) / (8 * hmax);
+        c->height = (dec->image_height * c->v * bs + 8 * vmax - 1) / (8 * vmax);
+        c->bw = dec->mcus_x * c->h;
+        c->bh = dec->mcus_y * c->v;
+        c->scan_bw = ((dec->image_width * c->h + hmax - 1) / hmax + 7) / 8;
+        c->scan_bh = ((dec->image_height * c->v + vmax - 1) / vmax + 7) / 8;
+        c->stride = (size_t)c->bw * bs;
+
+        if (jpeg_dec_reserve((void **)&c->plane, &c->plane_cap, c->stride * c->bh * bs))
+            return jpeg_dec_fail(dec, "out of memory");
+
+        if (dec->progressive)
+        {
+            size_t bytes = (size_t)c->bw * c->bh * sizeof(c->coef[0]);
+
+            if (jpeg_dec_reserve((void **)&c->coef, &c->coef_cap, bytes))
+                return jpeg_dec_fail(dec, "out of memory");
+            memset(c->coef, 0, bytes);
+        }
+    }
+
+    dec->num_components = n;
+
+    if (dec->progressive && dec->zz_max < 63)
+        jpeg_dec_plan_skips(dec);
+
+    return 0;
+}
+
+/**
+ * @brief Reads scan header and checks everything scan refers to
+ */
+static int jpeg_dec_sos(jpeg_decoder_t dec, const uint8_t *p, size_t len)
+{
+    if (!dec->num_components)
+        return jpeg_dec_fail(dec, "scan before frame header");
+
+    int n = len ? p[0] : 0;
+
+    if (n < 1 || n > dec->num_components || len != 4 + 2 * (size_t)n)
+        return jpeg_dec_fail(dec, "bad SOS segment");
+
+    for (int i = 0; i < n; i++)
+    {
+        jpeg_component *c = NULL;
+
+        for (int k = 0; k < dec->num_components; k++)
+            if (dec->comp[k].id == p[1 + 2 * i])
+                c = &dec->comp[k];
+
+        if (c == NULL)
+            return jpeg_dec_fail(dec, "scan refers to unknown component");
+
+        c->td = p[2 + 2 * i] >> 4;
+        c->ta = p[2 + 2 * i] & 15;
+        dec->scan_comp[i] = c;
+    }
+
+    dec->scan_n = n;
+    dec->Ss = p[1 + 2 * n];
+    dec->Se = p[2 + 2 * n];
+    dec->Ah = p[3 + 2 * n] >> 4;
+    dec->Al = p[3 + 2 * n] & 15;
+
+    if (dec->progressive)
+    {
+        if (dec->Ss > dec->Se || dec->Se > 63 || (dec->Ss == 0 && dec->Se != 0) ||
+            (dec->Ss > 0 && n != 1) || dec->Al > 13)
+            return jpeg_dec_fail(dec, "bad progressive scan parameters");
+    }
+    else
+    {
+        dec->Ss = 0;
+        dec->Se = 63;
+        dec->Ah = dec->Al = 0;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        jpeg_component *c = dec->scan_comp[i];
+        int need_dc = dec->Ss == 0 && dec->Ah == 0;
+        int need_ac = !dec->progressive || dec->Ss > 0;
+
+        if (c->td > 3 || c->ta > 3 ||
+            (need_dc && !dec->huff_valid[0][c->td]) || (need_ac && !dec->huff_valid[1][c->ta]))
+            return jpeg_dec_fail(dec, "scan uses undefined Huffman table");
+
+        if (!dec->progressive && !dec->q_valid[c->tq])
+            return jpeg_dec_fail(dec, "scan uses undefined quantization table");
+    }
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Output
+//-----------------------------------------------------------------------------
+
+/**
+ * @brief Transforms accumulated progressive coeffs. into planes
+ */
+static int jpeg_dec_finish_coef(jpeg_decoder_t dec)
+{
+    for (int i = 0; i < dec->num_components; i++)
+    {
+        jpeg_component *c = &dec->comp[i];
+
+        if (!dec->q_valid[c->tq])
+            return jpeg_dec_fail(dec, "undefined quantization table");
+
+        for (unsigned by = 0; by < c->bh; by++)
+            for (unsigned bx = 0; bx < c->bw; bx++)
+                dec->block_idct(c->coef[(size_t)by * c->bw + bx], &dec->q_table[c->tq],
+                                c->plane + (size_t)by * dec->block_size * c->stride + bx * dec->block_size,
+                                c->stride);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Row 'y' of component upsampled to full image width
+ *
+ * @details 2x horizontal, 2x vertical and 2x2 use triangle filter
+ *          ("fancy upsampling" of libjpeg): output sample is 3/4 of nearer
+ *          and 1/4 of farther input sample. Other ratios replicate samples
+ *
+ * @return pointer to plane row or 'out'
+ */
+static const uint8_t *jpeg_dec_upsample(jpeg_decoder_t dec, const jpeg_component *c, unsigned y, uint8_t *out)
+{
+    const int rh = dec->hmax / c->h;
+    const int rv = dec->vmax / c->v;
+    const unsigned cy = y / (unsigned)rv;
+    const unsigned w = c->width;
+    const uint8_t *near = c->plane + (size_t)cy * c->stride;
+
+    if (rh == 1 && rv == 1)
+        return near;
+
+    if (rv == 2 && rh <= 2)
+    {
+        // farther row is the one above for top half of input row
+        unsigned fy = (y & 1) ? (cy + 1 < c->height ? cy + 1 : cy) : (cy ? cy - 1 : 0);
+        const uint8_t *far = c->plane + (size_t)fy * c->stride;
+        int32_t *sum = dec->colsum;
+
+        for (unsigned x = 0; x < w; x++)
+            sum[x] = 3 * near[x] + far[x];
+
+        if (rh == 1)
+        {
+            for (unsigned x = 0; x < w; x++)
+                out[x] = (uint8_t)((sum[x] + 2) >> 2);
+            return out;
+        }
+
+        if (w == 1)
+        {
+            out[0] = out[1] = (uint8_t)((sum[0] + 2) >> 2);
+            return out;
+        }
+
+        out[0] = (uint8_t)((4 * sum[0] + 8) >> 4);
+        out[1] = (uint8_t)((3 * sum[0] + sum[1] + 7) >> 4);
+        for (unsigned x = 1; x < w - 1; x++)
+        {
+            out[2 * x] = (uint8_t)((3 * sum[x] + sum[x - 1] + 8) >> 4);
+            out[2 * x + 1] = (uint8_t)((3 * sum[x] + sum[x + 1] + 7) >> 4);
+        }
+        out[2 * w - 2] = (uint8_t)((3 * sum[w - 1] + sum[w - 2] + 8) >> 4);
+        out[2 * w - 1] = (uint8_t)((4 * sum[w - 1] + 7) >> 4);
+        return out;
+    }
+
+    if (rh == 2 && rv == 1)
+    {
+        if (w == 1)
+        {
+            out[0] = out[1] = near[0];
+            return out;
+        }
+
+        out[0] = near[0];
+        out[1] = (uint8_t)((3 * near[0] + near[1] + 2) >> 2);
+        for (unsigned x = 1; x < w - 1; x++)
+        {
+            out[2 * x] = (uint8_t)((3 * near[x] + near[x - 1] + 1) >> 2);
+            out[2 * x + 1] = (uint8_t)((3 * near[x] + near[x + 1] + 2) >> 2);
+        }
+        out[2 * w - 2] = (uint8_t)((3 * near[w - 1] + near[w - 2] + 1) >> 2);
+        out[2 * w - 1] = near[w - 1];
+        return out;
+    }
+
+    for (unsigned x = 0; x < dec->width; x++)
+        out[x] = near[x / (unsigned)rh];
+    return out;
+}
+
+/**
+ * @brief Upsamples and converts planes into packed 'pixels'
+ */
+static int jpeg_dec_output(jpeg_decoder_t dec)
+{
+    const size_t w = dec->width;
+    const size_t row_size = dec->mcus_x * (size_t)dec->block_size * dec->hmax;
+
+    dec->channels = dec->num_components == 1 ? 1 : 3;
+
+    if (jpeg_dec_reserve((void **)&dec->pixels, &dec->pixels_cap, w * dec->height * dec->channels) ||
+        jpeg_dec_reserve((void **)&dec->row, &dec->row_cap, 3 * row_size) ||
+        jpeg_dec_reserve((void **)&dec->colsum, &dec->colsum_cap, row_size * sizeof(int32_t)))
+        return jpeg_dec_fail(dec, "out of memory");
+
+    for (unsigned y = 0; y < dec->height; y++)
+    {
+        uint8_t *dst = dec->pixels + (size_t)y * w * dec->channels;
+
+        if (dec->channels == 1)
+        {
+            memcpy(dst, dec->comp[0].plane + (size_t)y * dec->comp[0].stride, w);
+            continue;
+        }
+
+        const uint8_t *src[3];
+        for (int i = 0; i < 3; i++)
+            src[i] = jpeg_dec_upsample(dec, &dec->comp[i], y, dec->row + i * row_size);
+
+        color_ycc_row(src[0], src[1], src[2], (int)w, dst);
+    }
+
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Public API
+//-----------------------------------------------------------------------------
+
+int jpeg_decode(jpeg_decoder_t dec, const uint8_t *data, size_t size)
+{
+    int scans = 0;
+
+    dec->error = NULL;
+    dec->width = dec->height = 0;
+    dec->image_width = dec->image_height = 0;
+    dec->channels = 0;
+    dec->num_components = 0;
+    dec->progressive = 0;
+    dec->restart_interval = 0;
+    memset(dec->q_valid, 0, sizeof(dec->q_valid));
+    memset(dec->huff_valid, 0, sizeof(dec->huff_valid));
+
+    switch (dec->scale_denom)
+    {
+    case 1: dec->block_idct = dec->idct; dec->zz_max = 63; break;
+    case 2: dec->block_idct = idct_4x4; dec->zz_max = 24; break; // zigzag index of (3, 3)
+    case 4: dec->block_idct = idct_2x2; dec->zz_max = 4; break;  // (1, 1)
+    case 8: dec->block_idct = idct_1x1; dec->zz_max = 0; break;
+    default:
+        return jpeg_dec_fail(dec, "scale_denom must be 1, 2, 4 or 8");
+    }
+    dec->block_size = 8 / dec->scale_denom;
+
+    dec->data = data;
+    dec->size = size;
+    dec->pos = 2;
+
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+        return jpeg_dec_fail(dec, "not a JPEG file");
+
+    for (;;)
+    {
+        // fill bytes 0xFF may precede any marker
+        while (dec->pos < size && data[dec->pos] != 0xFF)
+            dec->pos++;
+        while (dec->pos < size && data[dec->pos] == 0xFF)
+            dec->pos++;
+
+        if (dec->pos >= size)
+        {
+            // tolerate missing EOI after complete scans
+            if (scans)
+                break;
+            return jpeg_dec_fail(dec, "unexpected end of file");
+        }
+
+        int marker = data[dec->pos++];
+
+        if (marker == 0xD9) // EOI
+            break;
+        if (marker >= 0xD0 && marker <= 0xD7) // stray RSTn
+            continue;
+
+        if (dec->pos + 2 > size)
+            return jpeg_dec_fail(dec, "unexpected end of file");
+
+        size_t len = jpeg_dec_u16(data + dec->pos);
+        if (len < 2 || dec->pos + len > size)
+            return jpeg_dec_fail(dec, "bad segment length");
+
+        const uint8_t *p = data + dec->pos + 2;
+        len -= 2;
+        dec->pos += 2 + len;
+
+        int ret = 0;
+        switch (marker)
+        {
+        case 0xC0: // SOF0 baseline
+        case 0xC1: // SOF1 extended sequential
+        case 0xC2: // SOF2 progressive
+            dec->progressive = marker == 0xC2;
+            ret = jpeg_dec_sof(dec, p, len);
+            break;
+        case 0xC3: case 0xC5: case 0xC6: case 0xC7:
+        case 0xC9: case 0xCA: case 0xCB: case 0xCD: case 0xCE: case 0xCF:
+            return jpeg_dec_fail(dec, "lossless, hierarchical and arithmetic coding are not supported");
+        case 0xC4:
+            ret = jpeg_dec_dht(dec, p, len);
+            break;
+        case 0xDB:
+            ret = jpeg_dec_dqt(dec, p, len);
+            break;
+        case 0xDD:
+            if (len < 2)
+                return jpeg_dec_fail(dec, "bad DRI segment");
+            dec->restart_interval = jpeg_dec_u16(p);
+            break;
+        case 0xDA:
+            ret = jpeg_dec_sos(dec, p, len);
+            if (ret == 0)
+                ret = jpeg_dec_scan(dec);
+            scans++;
+            break;
+        default: // APPn, COM and others are skipped
+            break;
+        }
+
+        if (ret)
+            return -1;
+    }
+
+    if (!scans)
+        return jpeg_dec_fail(dec, "no image data");
+
+    if (dec->progressive && jpeg_dec_finish_coef(dec))
+        return -1;
+
+    return jpeg_dec_output(dec);
+}
+
+int jpeg_decode_file(jpeg_decoder_t dec, const char *filename)
+{
+    FILE *file = fopen(filename, "rb");
+    uint8_t *data = NULL;
+    long size;
+    int ret = -1;
+
+    if (file == NULL)
+        return jpeg_dec_fail(dec, "failed to open file");
+
+    if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) > 0 && fseek(file, 0, SEEK_SET) == 0 &&
+        (data = (uint8_t *)malloc((size_t)size)) != NULL && fread(data, 1, (size_t)size, file) == (size_t)size)
+        ret = jpeg_decode(dec, data, (size_t)size);
+    else
+        jpeg_dec_fail(dec, "failed to read file");
+
+    free(data);
+    fclose(file);
+    return ret;
+}
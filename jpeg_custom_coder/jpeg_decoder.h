@@ -0,0 +1,194 @@
+#ifndef JPEG_DECODER_H
+#define JPEG_DECODER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dct.h"
+#include "color.h"
+
+/**
+ * @file jpeg_decoder.h
+ * @brief Baseline and progressive JPEG decoder
+ *
+ * @details Counterpart of jpeg_encoder. Handles 8 bit sequential (SOF0, SOF1)
+ *          and progressive (SOF2) Huffman coded images with 1 or 3 components,
+ *          any sampling factors with integer ratios, restart markers.
+ *          3 component images are YCbCr, result is packed RGB or gray.
+ *
+ *          Input is untrusted: malformed streams are reported by return value
+ *          and 'error', never by assert.
+ */
+
+// bits resolved by one lookup of jpeg_huff_decoder 'fast'
+#define JPEG_HUFF_LOOKAHEAD 9
+
+/**
+ * @brief Huffman table prepared for decoding
+ *
+ * @details 'fast' - indexed by next JPEG_HUFF_LOOKAHEAD bits,
+ *          (code length << 8) | symbol, 0 if code is longer.
+ *          Longer codes: codes of length 'l' are below 'maxcode[l]',
+ *          symbol is vals[code + delta[l]]
+ */
+typedef struct jpeg_huff_decoder
+{
+    uint16_t fast[1 << JPEG_HUFF_LOOKAHEAD];
+    int32_t maxcode[17];
+    int32_t delta[17];
+    uint8_t vals[256];
+} jpeg_huff_decoder;
+
+/**
+ * @brief Image component of decoded frame
+ *
+ * @details 'h', 'v' - sampling factors, 'tq' - quantization table.
+ *          'bw' x 'bh' blocks cover whole MCUs, 'plane' holds their samples
+ *          'stride' bytes per row. Only 'width' x 'height' samples of the
+ *          plane are part of the image, 'scan_bw' x 'scan_bh' blocks are
+ *          coded by single component scans.
+ *          'coef' - quantized coeffs. in natural order, progressive only.
+ *          'skip_ac' - AC scans past decoder's 'zz_max' can be skipped,
+ *          no later refinement scan needs their nonzero coeffs.
+ */
+typedef struct jpeg_component
+{
+    int id;
+    int h;
+    int v;
+    int tq;
+    int td;
+    int ta;
+    int dc_pred;
+
+    unsigned width;
+    unsigned height;
+    unsigned bw;
+    unsigned bh;
+    unsigned scan_bw;
+    unsigned scan_bh;
+
+    uint8_t *plane;
+    size_t plane_cap;
+    size_t stride;
+
+    int16_t (*coef)[64];
+    size_t coef_cap;
+    int skip_ac;
+} jpeg_component;
+
+/**
+ * @brief Decoder object
+ *
+ * @details Decoder is meant to be reused for many images, planes, coeffs.
+ *          and 'pixels' are kept between calls to jpeg_decode().
+ *          'idct' - kernel used for every block, idct_select() by default.
+ *          Set to idct_islow() for output independent of FPU and SIMD.
+ *          'scale_denom' - 1, 2, 4 or 8, image is decoded at 1/scale_denom
+ *          of its size by reduced IDCTs (idct_4x4() .. idct_1x1())
+ *          Result: 'pixels' - 'width' x 'height' pixels of 'channels' bytes,
+ *          rows are packed. 'image_width' x 'image_height' - size stored
+ *          in file. 'error' - static message of last failure.
+ *          Remaining fields are state of current image, 'block_size' -
+ *          output samples per block side, coeffs. past zigzag index 'zz_max'
+ *          are not needed by 'block_idct'
+ */
+struct jpeg_decoder {
+    idct_fn idct;
+    int scale_denom;
+
+    unsigned image_width;
+    unsigned image_height;
+    unsigned width;
+    unsigned height;
+    int channels;
+    uint8_t *pixels;
+    size_t pixels_cap;
+    const char *error;
+
+    idct_table q_table[4];
+    int q_valid[4];
+    jpeg_huff_decoder huff[2][4];
+    int huff_valid[2][4];
+
+    int progressive;
+    int num_components;
+    jpeg_component comp[3];
+    int hmax;
+    int vmax;
+    unsigned mcus_x;
+    unsigned mcus_y;
+    unsigned restart_interval;
+    int block_size;
+    int zz_max;
+    idct_fn block_idct;
+
+    int scan_n;
+    jpeg_component *scan_comp[3];
+    int Ss, Se, Ah, Al;
+    unsigned eobrun;
+
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+    uint64_t acc;
+    int bits;
+    int marker;
+
+    uint8_t *row;
+    size_t row_cap;
+    int32_t *colsum;
+    size_t colsum_cap;
+};
+
+//convenience typedef
+typedef struct jpeg_decoder* jpeg_decoder_t;
+
+/**
+ * @brief allocate jpeg decoder object
+ *
+ * @details dont forget to call jpeg_decoder_free()
+ *
+ * @return jpeg_decoder_t
+ */
+jpeg_decoder_t jpeg_decoder_alloc();
+
+/**
+ * @brief free decoder and decoded pixels
+ */
+void jpeg_decoder_free(jpeg_decoder_t dec);
+
+/**
+ * @brief Decode JPEG file from memory
+ *
+ * @details On success 'pixels' hold 'width' x 'height' RGB (3 channels)
+ *          or gray (1 channel) pixels, valid until next call.
+ *          'width' and 'height' are image size divided by 'scale_denom',
+ *          rounded up
+ *
+ * @param dec
+ * @param data whole JPEG file
+ * @param size bytes in 'data'
+ * @return 0 on success, -1 on malformed or unsupported stream, see 'error'
+ */
+int jpeg_decode(jpeg_decoder_t dec, const uint8_t *data, size_t size);
+
+/**
+ * @brief jpeg_decode() of file contents
+ *
+ * @return 0 on success, -1 if file can't be read or decoded
+ */
+int jpeg_decode_file(jpeg_decoder_t dec, const char *filename);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // JPEG_DECODER_H
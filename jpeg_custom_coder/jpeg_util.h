@@ -15,6 +15,11 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+
+#include "buffer.h"
 
 //Memory order as big endian.
 //On little-endian machines: 0xhilo -> 0xlohi which looks as 0xhi 0xlo in memory
@@ -138,26 +143,48 @@ static inline void get_magnitude(int value, uint16_t out[2])
  */
 static inline void rgb_to_ycbcr(uint8_t red, uint8_t green, uint8_t blue, float res[3])
 {
-    res[0] = 0.299 * red + 0.587 * green + 0.114 * blue - 128; // Y
-    res[1] = -0.1687 * red - 0.3313 * green + 0.5 * blue;      // Cb
-    res[2] = 0.5 * red - 0.4187 * green - 0.0813 * blue;       // Cr
+    // float constants, SIMD kernels in color.c use the same ones
+    res[0] = 0.299f * red + 0.587f * green + 0.114f * blue - 128; // Y
+    res[1] = -0.1687f * red - 0.3313f * green + 0.5f * blue;      // Cb
+    res[2] = 0.5f * red - 0.4187f * green - 0.0813f * blue;       // Cr
+}
+
+/**
+ * @brief converts pixel from RGB to YCbCr using 16 bit fixed-point math
+ * 
+ * @note Same as libjpeg's jccolor.c. All components are centered over zero
+ * 
+ * @param red 
+ * @param green 
+ * @param blue 
+ * @param res[out]
+ */
+static inline void rgb_to_ycbcr_fixed(uint8_t red, uint8_t green, uint8_t blue, int16_t res[3])
+{
+    // FIX(x) = x * 2^16; (128 << 16) keeps sums positive before shifting
+    const int32_t half = 1 << 15;
+    const int32_t offset = (128 << 16) + half - 1;
+
+    res[0] = (int16_t)(((19595 * red + 38470 * green + 7471 * blue + half) >> 16) - 128);
+    res[1] = (int16_t)(((-11059 * red - 21709 * green + 32768 * blue + offset) >> 16) - 128);
+    res[2] = (int16_t)(((32768 * red - 27439 * green - 5329 * blue + offset) >> 16) - 128);
 }
 
 /**
- * @brief Write huffman tables to file
+ * @brief Write huffman tables to buffer
  * 
  * @note DHT section of JPEG file interchange format
  * 
  * @note matrix_len contains count of codes for each length 1...15 inclusive
  *       matrix_val contains data (uint8_t) which is coded with huffcodes
  * 
- * @param state 
+ * @param out 
  * @param matrix_len 
  * @param matrix_val 
  * @param ht_class 
  * @param id 
  */
-static inline void write_DHT(FILE* state,
+static inline void write_DHT(buffer_t out,
                            uint8_t const * matrix_len,
                            uint8_t const * matrix_val,
                            int ht_class,
@@ -169,17 +196,15 @@ static inline void write_DHT(FILE* state,
         num_values += matrix_len[i];
     }
 
-    uint16_t DHT = tjei_be_word(0xffc4);
-    // 2(len) + 1(Tc|th) + 16 (num lengths) + ?? (num values)
-    uint16_t len = tjei_be_word(2 + 1 + 16 + (uint16_t)num_values);
     assert(id < 4);
     uint8_t tc_th = (uint8_t)((((uint8_t)ht_class) << 4) | id);
 
-    fwrite(&DHT, sizeof(uint16_t), 1, state);
-    fwrite(&len, sizeof(uint16_t), 1, state);
-    fwrite(&tc_th, sizeof(uint8_t), 1, state);
-    fwrite(matrix_len, sizeof(uint8_t), 16, state);
-    fwrite(matrix_val, sizeof(uint8_t), num_values, state);
+    buffer_append_u16be(out, 0xffc4); // DHT
+    // 2(len) + 1(Tc|th) + 16 (num lengths) + ?? (num values)
+    buffer_append_u16be(out, (uint16_t)(2 + 1 + 16 + num_values));
+    buffer_append_u8(out, tc_th);
+    buffer_append(out, (uint8_t *)matrix_len, 16);
+    buffer_append(out, (uint8_t *)matrix_val, num_values);
 }
 
 //JFIF headers helpers
@@ -208,41 +233,6 @@ typedef struct
     char     com_str[28];
 } TJEJPEGComment;
 
-// Helper struct for TJEFrameHeader (below).
-typedef struct
-{
-    uint8_t  component_id;
-    uint8_t  sampling_factors;    // most significant 4 bits: horizontal. 4 LSB: vertical (A.1.1)
-    uint8_t  qt;                  // Quantization table selector.
-} TJEComponentSpec;
-
-typedef struct
-{
-    uint16_t         SOF;
-    uint16_t         len;                   // 8 + 3 * frame.num_components
-    uint8_t          precision;             // Sample precision (bits per sample).
-    uint16_t         height;
-    uint16_t         width;
-    uint8_t          num_components;        // For this implementation, will be equal to 3.
-    TJEComponentSpec component_spec[3];
-} TJEFrameHeader;
-
-typedef struct
-{
-    uint8_t component_id;                 // Just as with TJEComponentSpec
-    uint8_t dc_ac;                        // (dc|ac)
-} TJEFrameComponentSpec;
-
-typedef struct
-{
-    uint16_t              SOS;
-    uint16_t              len;
-    uint8_t               num_components;  // 3.
-    TJEFrameComponentSpec component_spec[3];
-    uint8_t               first;  // 0
-    uint8_t               last;  // 63
-    uint8_t               ah_al;  // o
-} TJEScanHeader;
 #pragma pack(pop)
 
 #endif //JPEG_UTIL_H
\ No newline at end of file
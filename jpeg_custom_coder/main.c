@@ -1,13 +1,925 @@
 #include "ppmm.h"
 #include "timer.h"
 #include "jpeg.h"
+#include "jpeg_decoder.h"
+#include "quality.h"
 
+// max abs. difference between fast DCT paths and dct_2d()
+// well below 0.5 so quantized coeffs. are the same except for rounding ties
+#define DCT_TOLERANCE 0.01f
+// same for DCT_ISLOW. 13 bit constants, output has 3 fractional bits
+#define DCT_ISLOW_TOLERANCE 0.25f
+
+/**
+ * @brief Compare fast DCT paths against reference dct_2d() on random blocks
+ * 
+ * @return 0 if all coeffs. agree within DCT_TOLERANCE
+ */
+int test_dct()
+{
+    float block[64], ref[64], sep[64], aan[64], simd[64];
+    float err_sep = 0, err_aan = 0, err_simd = 0, err_islow = 0, diff;
+    int16_t block_i[64];
+    int32_t islow[64];
+    dct_aan_fn fdct_aan = dct_aan_select();
+
+    srand(1);
+    for (int n = 0; n < 1000; n++)
+    {
+        for (int i = 0; i < 64; i++)
+        {
+            block_i[i] = (int16_t)(rand() % 256 - 128);
+            block[i] = block_i[i];
+        }
+
+        dct_2d(block, ref);
+        dct_2d_separable(block, sep);
+
+        // AAN output is scaled, see jpeg_setup_q_tables()
+        for (int i = 0; i < 64; i++)
+            aan[i] = simd[i] = block[i];
+        tjei_fdct(aan);
+        fdct_aan(simd);
+        dct_islow(block_i, islow);
+
+        for (int v = 0; v < 8; v++)
+        {
+            for (int u = 0; u < 8; u++)
+            {
+                int i = v * 8 + u;
+
+                // selected kernel vs scalar, both scaled
+                diff = fabsf(simd[i] - aan[i]);
+                err_simd = diff > err_simd ? diff : err_simd;
+
+                aan[i] /= 8 * aan_scales[u] * aan_scales[v];
+
+                diff = fabsf(sep[i] - ref[i]);
+                err_sep = diff > err_sep ? diff : err_sep;
+
+                diff = fabsf(aan[i] - ref[i]);
+                err_aan = diff > err_aan ? diff : err_aan;
+
+                diff = fabsf(islow[i] / 8.0f - ref[i]);
+                err_islow = diff > err_islow ? diff : err_islow;
+            }
+        }
+    }
+
+    printf("DCT max abs. error vs reference: separable %f, aan %f (tolerance %f)\n",
+           err_sep, err_aan, DCT_TOLERANCE);
+    printf("AAN kernel: %s, max abs. error vs scalar %f\n",
+           fdct_aan == dct_aan_scalar ? "scalar" : "simd", err_simd);
+    printf("DCT max abs. error vs reference: islow %f (tolerance %f)\n",
+           err_islow, DCT_ISLOW_TOLERANCE);
+
+    if (err_sep > DCT_TOLERANCE || err_aan > DCT_TOLERANCE || err_simd > DCT_TOLERANCE ||
+        err_islow > DCT_ISLOW_TOLERANCE)
+    {
+        printf("DCT test FAILED\n");
+        return -1;
+    }
+
+    printf("DCT test passed\n");
+    return 0;
+}
+
+// max abs. difference of IDCT kernels vs rounded idct_2d_separable(), in 0..255 samples
+#define IDCT_TOLERANCE 1
+
+/**
+ * @brief Compare IDCT kernels against idct_2d_separable() on random blocks
+ * 
+ * @details blocks are forward transformed and quantized random pixels,
+ *          every 3rd one keeps only DC, every 3rd only top-left 4x4 coeffs.
+ *          so shortcut paths are covered. Shortcuts must match full path
+ *          of idct_islow() exactly
+ *
+ * @return 0 if all samples agree within IDCT_TOLERANCE
+ */
+int test_idct()
+{
+    const idct_fn kernels[] = {idct_aan_scalar, idct_islow, idct_select()};
+    const char *names[] = {"aan", "islow", "selected"};
+    int err[3] = {0, 0, 0}, err_short = 0;
+    float block[64], coef_f[64], ref[64];
+    int16_t coef[64], full[64];
+    uint16_t q[64];
+    uint8_t out[64], out_full[64];
+    idct_table t;
+
+    srand(2);
+    for (int n = 0; n < 3000; n++)
+    {
+        for (int i = 0; i < 64; i++)
+        {
+            block[i] = (float)(rand() % 256 - 128);
+            q[i] = (uint16_t)(1 + rand() % (n % 2 ? 4 : 40));
+        }
+        idct_table_init(&t, q);
+
+        dct_2d_separable(block, coef_f);
+        for (int i = 0; i < 64; i++)
+        {
+            int keep = n % 3 == 0 || (n % 3 == 1 && i % 8 < 4 && i / 8 < 4) || i == 0;
+            coef[i] = keep ? (int16_t)lrintf(coef_f[i] / q[i]) : 0;
+            coef_f[i] = (float)coef[i] * q[i];
+        }
+
+        idct_2d_separable(coef_f, ref);
+
+        for (int k = 0; k < 3; k++)
+        {
+            kernels[k](coef, &t, out, 8);
+
+            for (int i = 0; i < 64; i++)
+            {
+                int r = (int)lrintf(ref[i]) + 128;
+                int diff = abs(out[i] - (r < 0 ? 0 : (r > 255 ? 255 : r)));
+                err[k] = diff > err[k] ? diff : err[k];
+            }
+        }
+
+        // nonzero coeff. with zero quantizer forces full path on the same values
+        if (n % 3)
+        {
+            idct_islow(coef, &t, out, 8);
+            memcpy(full, coef, sizeof(full));
+            full[63] = 1;
+            t.q[63] = 0;
+            idct_islow(full, &t, out_full, 8);
+            err_short |= memcmp(out, out_full, sizeof(out)) != 0;
+        }
+    }
+
+    for (int k = 0; k < 3; k++)
+        printf("IDCT max abs. error vs separable: %s %d (tolerance %d)\n", names[k], err[k], IDCT_TOLERANCE);
+    printf("IDCT kernel: %s, islow shortcuts %s full path\n",
+           kernels[2] == idct_aan_scalar ? "scalar" : "simd", err_short ? "differ from" : "match");
+
+    if (err[0] > IDCT_TOLERANCE || err[1] > IDCT_TOLERANCE || err[2] > IDCT_TOLERANCE || err_short)
+    {
+        printf("IDCT test FAILED\n");
+        return -1;
+    }
+
+    printf("IDCT test passed\n");
+    return 0;
+}
+
+// max relative difference of mean SSIM between kernels and band splits
+#define QUALITY_TOLERANCE 1e-5
+
+/**
+ * @brief Check SSIM kernels against each other and PSNR on mixed layouts
+ *
+ * @details Planes are not a multiple of 8 wide, so SIMD tails are used.
+ *          Identical planes must give SSIM 1, two bands the same sums
+ *          as whole image
+ *
+ * @return 0 if all checks pass
+ */
+int test_quality()
+{
+    enum { W = 67, H = 45 };
+    static float x[W * H], y[W * H];
+    static uint8_t gray[W * H], rgb[W * H * 3];
+    int failed = 0;
+
+    srand(3);
+    for (int i = 0; i < W * H; i++)
+    {
+        x[i] = (float)((i % W) * 3 + (i / W) * 2 % 256);
+        y[i] = x[i] + (float)(rand() % 21 - 10);
+        gray[i] = (uint8_t)(rand() % 256);
+        rgb[3 * i] = rgb[3 * i + 1] = rgb[3 * i + 2] = gray[i];
+    }
+
+    const quality_ssim_fn kernels[] = {quality_ssim_rows_scalar, quality_ssim_select()};
+    const unsigned rows = H - QUALITY_SSIM_WINDOW + 1;
+    double mean[2];
+
+    for (int k = 0; k < 2; k++)
+    {
+        quality_ssim_sum same = {0}, whole = {0}, bands = {0};
+
+        kernels[k](x, x, W, 0, rows, &same);
+        kernels[k](x, y, W, 0, rows, &whole);
+        kernels[k](x, y, W, 0, 7, &bands);
+        kernels[k](x, y, W, 7, rows, &bands);
+
+        mean[k] = whole.ssim / whole.count;
+        failed |= fabs(same.ssim / same.count - 1.0) > QUALITY_TOLERANCE;
+        failed |= bands.count != whole.count || fabs(bands.ssim - whole.ssim) > QUALITY_TOLERANCE * whole.count;
+    }
+
+    failed |= fabs(mean[0] - mean[1]) > QUALITY_TOLERANCE;
+
+    // gray against itself as RGB
+    uint64_t sse = quality_sse_rows(gray, 1, rgb, 3, W, 0, H);
+    failed |= sse != 0 || quality_psnr(sse, 3 * W * H) != QUALITY_PSNR_MAX;
+
+    printf("SSIM scalar %.6f selected %.6f, kernel: %s\n", mean[0], mean[1],
+           kernels[1] == quality_ssim_rows_scalar ? "scalar" : "simd");
+
+    if (failed)
+    {
+        printf("Quality test FAILED\n");
+        return -1;
+    }
+
+    printf("Quality test passed\n");
+    return 0;
+}
+
+/**
+ * @brief Decoder must reject broken streams without touching memory out of bounds
+ *
+ * @details DHT with more codes of some length than its bits can hold used
+ *          to overflow the lookup table before the check, SOS component
+ *          count was trusted before its length. Run under ASan
+ *
+ * @return 0 if every stream is rejected
+ */
+int test_malformed()
+{
+    // counts of code lengths 1 .. 16, all over-full
+    static const uint8_t overfull[][16] = {
+        {200},                          // 1 bit: 200 codes, 2 fit
+        {0, 5},                         // 2 bits: 5 codes, 4 fit
+        {1, 1, 1, 1, 1, 1, 1, 1, 1, 3}, // 10 bits: 3 codes, 2 left, beyond lookup
+    };
+    uint8_t stream[2 + 5 + 16 + 255 + 2];
+    int failed = 0;
+
+    jpeg_decoder_t dec = jpeg_decoder_alloc();
+
+    for (size_t t = 0; t < sizeof(overfull) / sizeof(overfull[0]); t++)
+    {
+        size_t n = 0, pos = 0;
+        for (int l = 0; l < 16; l++)
+            n += overfull[t][l];
+
+        stream[pos++] = 0xFF, stream[pos++] = 0xD8;
+        stream[pos++] = 0xFF, stream[pos++] = 0xC4;
+        stream[pos++] = (uint8_t)((3 + 16 + n) >> 8), stream[pos++] = (uint8_t)(3 + 16 + n);
+        stream[pos++] = 0x00; // DC table 0
+        memcpy(stream + pos, overfull[t], 16), pos += 16;
+        for (size_t i = 0; i < n; i++)
+            stream[pos++] = (uint8_t)i;
+        stream[pos++] = 0xFF, stream[pos++] = 0xD9;
+
+        int ret = jpeg_decode(dec, stream, pos);
+        printf("Over-full DHT %zu: %s\n", t, ret ? dec->error : "accepted");
+        failed |= ret != -1;
+    }
+
+    // SOS claiming 255 components in 6 byte segment, last bytes of input.
+    // Scaled progressive decoding walks SOS headers ahead of time
+    static const uint8_t sos[] = {
+        0xFF, 0xD8,
+        0xFF, 0xC2, 0x00, 0x0B, 0x08, 0x00, 0x08, 0x00, 0x08, 0x01, 0x01, 0x11, 0x00,
+        0xFF, 0xDA, 0x00, 0x06, 0xFF, 0x00, 0x00, 0x00,
+    };
+    uint8_t *exact = (uint8_t *)malloc(sizeof(sos)); // ASan sees reads past the end
+    memcpy(exact, sos, sizeof(sos));
+
+    dec->scale_denom = 8;
+    int ret = jpeg_decode(dec, exact, sizeof(sos));
+    printf("Short SOS: %s\n", ret ? dec->error : "accepted");
+    failed |= ret != -1;
+    free(exact);
+
+    jpeg_decoder_free(dec);
+
+    if (failed)
+    {
+        printf("Malformed stream test FAILED\n");
+        return -1;
+    }
+
+    printf("Malformed stream test passed\n");
+    return 0;
+}
+
+// encoder quality of round trip tests
+#define ROUNDTRIP_QUALITY 90
+// min PSNR of decoded image vs source, dB. Synthetic image gets ~40 at 4:2:0
+#define ROUNDTRIP_PSNR 32.0
+
+/**
+ * @brief Synthetic RGB test image: gradients, waves and a few sharp edges
+ */
+static void roundtrip_image(uint8_t *rgb, unsigned width, unsigned height)
+{
+    for (unsigned y = 0; y < height; y++)
+    {
+        for (unsigned x = 0; x < width; x++)
+        {
+            uint8_t *p = rgb + 3 * (y * width + x);
+            int edge = (x / 16 + y / 16) % 2 ? 40 : 0;
+            p[0] = (uint8_t)(x * 200 / width + edge);
+            p[1] = (uint8_t)(y * 200 / height + edge);
+            p[2] = (uint8_t)(128 + 100 * sin(x * 0.21) * cos(y * 0.13));
+        }
+    }
+}
+
+/**
+ * @brief Decodes 'size' bytes of 'jpeg' and compares them with source pixels
+ *
+ * @param src tightly packed pixels of 'src_channels'
+ * @return double PSNR in dB, -1 if decoding failed or size differs
+ */
+static double roundtrip_psnr(jpeg_decoder_t dec, const uint8_t *jpeg, size_t size, const uint8_t *src,
+                             int src_channels, unsigned width, unsigned height)
+{
+    if (jpeg_decode(dec, jpeg, size))
+    {
+        printf("Error: %s\n", dec->error);
+        return -1;
+    }
+
+    if (dec->width != width || dec->height != height)
+        return -1;
+
+    uint64_t sse = quality_sse_rows(src, src_channels, dec->pixels, dec->channels, width, 0, height);
+    return quality_psnr(sse, 3 * (uint64_t)width * height);
+}
+
+/**
+ * @brief Encodes packed 'src' with current settings of 'enc', decodes and compares with source
+ *
+ * @param channels 1 - gray; 3 - RGB; 4 - RGBA
+ * @param out[out] encoded image, previous content is dropped
+ * @return double PSNR in dB, -1 if decoding failed or size differs
+ */
+static double roundtrip_encode(jpeg_encoder_t enc, jpeg_decoder_t dec, const uint8_t *src, int channels,
+                               unsigned width, unsigned height, buffer_t out)
+{
+    jpeg_input input = jpeg_input_packed(src, jpeg_format_from_channels(channels));
+
+    jpeg_encode_input(enc, width, height, &input);
+    out->size = 0;
+    jpeg_write_to_buffer(enc, out);
+
+    return roundtrip_psnr(dec, out->data, out->size, src, channels, width, height);
+}
+
+/**
+ * @brief Green channel of roundtrip_image() as gray image
+ */
+static void roundtrip_gray(uint8_t *gray, const uint8_t *rgb, unsigned width, unsigned height)
+{
+    for (size_t i = 0; i < (size_t)width * height; i++)
+        gray[i] = rgb[3 * i + 1];
+}
+
+/**
+ * @brief Prints result line of test 'name'
+ *
+ * @return 0 if passed, -1 if 'failed'
+ */
+static int roundtrip_report(const char *name, int failed)
+{
+    printf("%s test %s\n", name, failed ? "FAILED" : "passed");
+    return failed ? -1 : 0;
+}
+
+/**
+ * @brief Encode synthetic image in every mode, decode and compare with source
+ *
+ * @details Baseline and progressive, 4:4:4, 4:2:2, 4:2:0. Baseline with and
+ *          without restart markers and optimized Huffman tables. Image size
+ *          is not a multiple of MCU size, so edge padding is covered too
+ *
+ * @return 0 if every decoded image is within ROUNDTRIP_PSNR
+ */
+int test_roundtrip()
+{
+    enum { W = 75, H = 53 };
+    static uint8_t rgb[W * H * 3];
+    const jpeg_subsampling subsampling[] = {JPEG_444, JPEG_422, JPEG_420};
+    const char *sub_names[] = {"4:4:4", "4:2:2", "4:2:0"};
+    buffer_t out = buffer_alloc(0);
+    int failed = 0;
+
+    roundtrip_image(rgb, W, H);
+
+    jpeg_encoder_t enc = jpeg_alloc();
+    jpeg_decoder_t dec = jpeg_decoder_alloc();
+    enc->quality = ROUNDTRIP_QUALITY;
+
+    for (int progressive = 0; progressive < 2; progressive++)
+    {
+        for (int s = 0; s < 3; s++)
+        {
+            for (unsigned restart_rows = 0; restart_rows < 3; restart_rows += 2)
+            {
+                for (int optimize = 0; optimize < 2; optimize++)
+                {
+                    // progressive scans carry own tables and no restart markers
+                    if (progressive && (restart_rows || optimize))
+                        continue;
+
+                    enc->progressive = progressive;
+                    enc->subsampling = subsampling[s];
+                    enc->restart_rows = restart_rows;
+                    enc->optimize_huffman = optimize;
+
+                    double psnr = roundtrip_encode(enc, dec, rgb, 3, W, H, out);
+
+                    printf("%-11s %s restart %u optimized %d: %zu bytes, PSNR %.2f dB\n",
+                           progressive ? "progressive" : "baseline", sub_names[s], restart_rows, optimize,
+                           out->size, psnr);
+                    failed |= psnr < ROUNDTRIP_PSNR;
+                }
+            }
+        }
+    }
+
+    buffer_free(out);
+    jpeg_decoder_free(dec);
+    jpeg_free(enc);
+
+    return roundtrip_report("Round trip", failed);
+}
+
+/**
+ * @brief Number of RSTn markers in entropy coded data
+ *
+ * @param dri[out] 1 if headers have DRI segment
+ */
+static unsigned roundtrip_rst_count(const uint8_t *jpeg, size_t size, int *dri)
+{
+    size_t pos = 2;
+    unsigned count = 0;
+
+    // marker segments up to and including SOS
+    *dri = 0;
+    while (pos + 4 <= size)
+    {
+        uint8_t marker = jpeg[pos + 1];
+        *dri |= marker == 0xDD;
+        pos += 2 + ((size_t)jpeg[pos + 2] << 8 | jpeg[pos + 3]);
+        if (marker == 0xDA)
+            break;
+    }
+
+    for (; pos + 1 < size; pos++)
+        count += jpeg[pos] == 0xFF && jpeg[pos + 1] >= 0xD0 && jpeg[pos + 1] <= 0xD7;
+
+    return count;
+}
+
+/**
+ * @brief Restart intervals: explicit and picked for threads, decoded and counted
+ *
+ * @details 4:2:0 image of 5x4 MCUs. Intervals of 3 MCU rows leave
+ *          a short last one, more rows than image means no markers.
+ *          Threads must not change the stream
+ *
+ * @return 0 if all checks pass
+ */
+int test_restart()
+{
+    enum { W = 75, H = 53, MCUS = 5 * 4 };
+    static uint8_t rgb[W * H * 3];
+    static const struct { unsigned restart_rows; int num_threads; } cases[] = {
+        {1, 1}, {3, 1}, {9, 1}, {1, 3}, {0, 2},
+    };
+    buffer_t single = buffer_alloc(0), out = buffer_alloc(0);
+    int failed = 0;
+
+    roundtrip_image(rgb, W, H);
+
+    jpeg_encoder_t enc = jpeg_alloc();
+    jpeg_decoder_t dec = jpeg_decoder_alloc();
+    enc->quality = ROUNDTRIP_QUALITY;
+    enc->subsampling = JPEG_420;
+
+    for (size_t t = 0; t < sizeof(cases) / sizeof(cases[0]); t++)
+    {
+        enc->restart_rows = cases[t].restart_rows;
+        enc->num_threads = cases[t].num_threads;
+
+        double psnr = roundtrip_encode(enc, dec, rgb, 3, W, H, out);
+        int dri;
+        unsigned rst = roundtrip_rst_count(out->data, out->size, &dri);
+        unsigned expected = enc->restart_interval ? (MCUS - 1) / enc->restart_interval : 0;
+
+        printf("restart rows %u threads %d: interval %u, %u RSTn, PSNR %.2f dB\n", cases[t].restart_rows,
+               cases[t].num_threads, enc->restart_interval, rst, psnr);
+        failed |= psnr < ROUNDTRIP_PSNR || rst != expected || dri != (enc->restart_interval != 0);
+
+        // same intervals on one thread give the same bytes
+        if (t == 0)
+        {
+            buffer_append(single, out->data, out->size);
+        }
+        else if (cases[t].restart_rows == cases[0].restart_rows)
+        {
+            failed |= out->size != single->size || memcmp(out->data, single->data, out->size) != 0;
+        }
+    }
+
+    failed |= enc->restart_interval == 0; // threads pick intervals
+
+    buffer_free(single);
+    buffer_free(out);
+    jpeg_decoder_free(dec);
+    jpeg_free(enc);
+
+    return roundtrip_report("Restart", failed);
+}
+
+/**
+ * @brief Chroma subsampling of odd sized images, both filters, float and fixed point path
+ *
+ * @details Sampling factors in SOF must match 'subsampling'. Gray input
+ *          ignores it and gives single 1x1 component
+ *
+ * @return 0 if all checks pass
+ */
+int test_subsampling()
+{
+    enum { W = 75, H = 53 };
+    static uint8_t rgb[W * H * 3], gray[W * H];
+    static const unsigned sizes[][2] = {{1, 1}, {17, 9}, {33, 31}, {W, H}};
+    const jpeg_subsampling subsampling[] = {JPEG_422, JPEG_420};
+    const dct_method dcts[] = {DCT_SEPARABLE, DCT_ISLOW};
+    buffer_t out = buffer_alloc(0);
+    int failed = 0;
+
+    jpeg_encoder_t enc = jpeg_alloc();
+    jpeg_decoder_t dec = jpeg_decoder_alloc();
+    enc->quality = ROUNDTRIP_QUALITY;
+
+    for (size_t n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++)
+    {
+        unsigned w = sizes[n][0], h = sizes[n][1];
+        double min_psnr = QUALITY_PSNR_MAX;
+
+        roundtrip_image(rgb, w, h);
+
+        for (int s = 0; s < 2; s++)
+        {
+            for (int f = JPEG_FILTER_BOX; f <= JPEG_FILTER_TRIANGLE; f++)
+            {
+                for (int d = 0; d < 2; d++)
+                {
+                    enc->subsampling = subsampling[s];
+                    enc->chroma_filter = (jpeg_chroma_filter)f;
+                    enc->dct = dcts[d];
+
+                    double psnr = roundtrip_encode(enc, dec, rgb, 3, w, h, out);
+
+                    min_psnr = psnr < min_psnr ? psnr : min_psnr;
+                    failed |= dec->num_components != 3 || dec->comp[0].h != 2 ||
+                              dec->comp[0].v != (subsampling[s] == JPEG_420 ? 2 : 1) ||
+                              dec->comp[1].h != 1 || dec->comp[1].v != 1;
+                }
+            }
+        }
+
+        printf("subsampled %ux%u: min PSNR %.2f dB\n", w, h, min_psnr);
+        failed |= min_psnr < ROUNDTRIP_PSNR;
+    }
+
+    // gray, subsampling doesn't apply
+    roundtrip_image(rgb, W, H);
+    roundtrip_gray(gray, rgb, W, H);
+
+    enc->subsampling = JPEG_420;
+    double psnr = roundtrip_encode(enc, dec, gray, 1, W, H, out);
+    printf("gray with 4:2:0 set: %d component(s) %dx%d, PSNR %.2f dB\n", dec->num_components,
+           dec->comp[0].h, dec->comp[0].v, psnr);
+    failed |= psnr < ROUNDTRIP_PSNR || dec->num_components != 1 || dec->comp[0].h != 1 || dec->comp[0].v != 1;
+
+    buffer_free(out);
+    jpeg_decoder_free(dec);
+    jpeg_free(enc);
+
+    return roundtrip_report("Subsampling", failed);
+}
+
+/**
+ * @brief Optimized Huffman tables must only change entropy coding
+ *
+ * @details Decoded pixels have to be identical to default tables and
+ *          stream must not grow. Flat image leaves tables with a single
+ *          symbol, noise at quality 100 uses most of the AC alphabet.
+ *          Statistics are gathered over several restart intervals
+ *
+ * @return 0 if all checks pass
+ */
+int test_optimized()
+{
+    enum { W = 75, H = 53 };
+    static uint8_t images[3][W * H * 3], decoded[W * H * 3];
+    const char *names[] = {"synthetic", "flat", "noise"};
+    int failed = 0;
+
+    roundtrip_image(images[0], W, H);
+    memset(images[1], 90, sizeof(images[1]));
+    srand(4);
+    for (int i = 0; i < W * H * 3; i++)
+        images[2][i] = (uint8_t)(rand() % 256);
+
+    jpeg_encoder_t enc = jpeg_alloc();
+    jpeg_decoder_t dec = jpeg_decoder_alloc();
+    enc->subsampling = JPEG_420;
+    enc->restart_rows = 1;
+    enc->num_threads = 2;
+
+    for (int n = 0; n < 3; n++)
+    {
+        for (int channels = 1; channels <= 3; channels += 2)
+        {
+            buffer_t out[2] = {buffer_alloc(0), buffer_alloc(0)};
+            double psnr = -1;
+
+            enc->quality = n == 2 ? 100 : ROUNDTRIP_QUALITY;
+
+            for (int optimize = 0; optimize < 2; optimize++)
+            {
+                enc->optimize_huffman = optimize;
+                psnr = roundtrip_encode(enc, dec, images[n], channels, W, H, out[optimize]);
+                if (psnr < 0)
+                    break;
+
+                if (optimize == 0)
+                    memcpy(decoded, dec->pixels, (size_t)W * H * dec->channels);
+                else
+                    failed |= memcmp(decoded, dec->pixels, (size_t)W * H * dec->channels) != 0;
+            }
+
+            printf("%-9s %s: default %zu bytes, optimized %zu bytes, PSNR %.2f dB\n", names[n],
+                   channels == 1 ? "gray" : "RGB ", out[0]->size, out[1]->size, psnr);
+            failed |= psnr < 0 || out[1]->size > out[0]->size;
+
+            buffer_free(out[0]);
+            buffer_free(out[1]);
+        }
+    }
+
+    jpeg_decoder_free(dec);
+    jpeg_free(enc);
+
+    return roundtrip_report("Optimized Huffman", failed);
+}
+
+// jpeg_write_func over buffer_t
+static void buffer_write_func(void *context, void *data, int size)
+{
+    buffer_append((buffer_t)context, (uint8_t *)data, (size_t)size);
+}
+
+/**
+ * @brief Streaming API must give the same bytes as whole image encoding
+ *
+ * @details Rows are pushed one at a time, 13 at a time (not a multiple
+ *          of MCU height) and all at once, with padded stride. RGB, RGBA
+ *          and gray, 4:4:4 and 4:2:0 with triangle filter and restart
+ *          intervals, with and without trellis. Result must equal
+ *          whole image of roundtrip_encode(), which is decoded
+ *
+ * @return 0 if all checks pass
+ */
+int test_stream()
+{
+    enum { W = 75, H = 53, PAD = 5 };
+    static uint8_t rgb[W * H * 3], packed[W * H * 4], padded[(W * 4 + PAD) * H];
+    static const jpeg_pixel_format formats[] = {JPEG_PIXEL_RGB, JPEG_PIXEL_RGBA, JPEG_PIXEL_GRAY};
+    static const char *names[] = {"RGB ", "RGBA", "gray"};
+    static const unsigned chunks[] = {1, 13, H};
+    buffer_t whole = buffer_alloc(0), stream = buffer_alloc(0);
+    int failed = 0;
+
+    roundtrip_image(rgb, W, H);
+
+    jpeg_encoder_t enc = jpeg_alloc();
+    jpeg_decoder_t dec = jpeg_decoder_alloc();
+    enc->quality = ROUNDTRIP_QUALITY;
+
+    for (int f = 0; f < 3; f++)
+    {
+        int channels = formats[f] == JPEG_PIXEL_RGBA ? 4 : (formats[f] == JPEG_PIXEL_GRAY ? 1 : 3);
+        size_t stride = (size_t)W * channels + PAD;
+
+        for (int i = 0; i < W * H; i++)
+            for (int c = 0; c < channels; c++)
+                packed[i * channels + c] = c < 3 ? rgb[3 * i + (channels == 1 ? 1 : c)] : 255;
+        for (int y = 0; y < H; y++)
+            memcpy(padded + y * stride, packed + (size_t)y * W * channels, (size_t)W * channels);
+
+        // mode 2 adds trellis to 4:2:0 with restart intervals
+        for (int mode = 0; mode < 3; mode++)
+        {
+            int identical = 1;
+
+            enc->subsampling = mode ? JPEG_420 : JPEG_444;
+            enc->chroma_filter = mode ? JPEG_FILTER_TRIANGLE : JPEG_FILTER_BOX;
+            enc->restart_rows = mode ? 1 : 0;
+            enc->trellis = mode == 2;
+
+            double psnr = roundtrip_encode(enc, dec, packed, channels, W, H, whole);
+
+            for (size_t k = 0; k < sizeof(chunks) / sizeof(chunks[0]); k++)
+            {
+                stream->size = 0;
+                jpeg_stream_begin(enc, W, H, formats[f], buffer_write_func, stream);
+                for (unsigned y = 0; y < H; y += chunks[k])
+                    jpeg_stream_write_rows(enc, padded + y * stride, H - y < chunks[k] ? H - y : chunks[k], stride);
+                jpeg_stream_finish(enc);
+
+                identical &= stream->size == whole->size && memcmp(stream->data, whole->data, whole->size) == 0;
+            }
+
+            printf("stream %s %s restart %u trellis %d: %zu bytes, %s whole image, PSNR %.2f dB\n", names[f],
+                   mode ? "4:2:0" : "4:4:4", enc->restart_rows, enc->trellis, stream->size,
+                   identical ? "same as" : "differs from", psnr);
+            failed |= !identical || psnr < ROUNDTRIP_PSNR;
+        }
+    }
+
+    buffer_free(whole);
+    buffer_free(stream);
+    jpeg_decoder_free(dec);
+    jpeg_free(enc);
+
+    return roundtrip_report("Stream", failed);
+}
+
+// DC and AC in spectral bands only, no successive approximation
+static const jpeg_scan_info test_script_spectral[] = {
+    {3, {0, 1, 2}, 0, 0, 0, 0},
+    {1, {0}, 1, 5, 0, 0},
+    {1, {1}, 1, 63, 0, 0},
+    {1, {2}, 1, 63, 0, 0},
+    {1, {0}, 6, 63, 0, 0},
+};
+
+// 3 refinement steps of luma, 2 of chroma and DC
+static const jpeg_scan_info test_script_refine[] = {
+    {3, {0, 1, 2}, 0, 0, 0, 2},
+    {1, {0}, 1, 63, 0, 3},
+    {1, {1}, 1, 63, 0, 2},
+    {1, {2}, 1, 63, 0, 2},
+    {3, {0, 1, 2}, 0, 0, 2, 1},
+    {1, {0}, 1, 63, 3, 2},
+    {1, {0}, 1, 63, 2, 1},
+    {1, {1}, 1, 63, 2, 1},
+    {1, {2}, 1, 63, 2, 1},
+    {3, {0, 1, 2}, 0, 0, 1, 0},
+    {1, {0}, 1, 63, 1, 0},
+    {1, {1}, 1, 63, 1, 0},
+    {1, {2}, 1, 63, 1, 0},
+};
+
+/**
+ * @brief Progressive JPEG must decode to the same pixels as baseline
+ *
+ * @details Scans only reorder coding of the same quantized blocks.
+ *          Default scripts of RGB and gray, subsampling, trellis and
+ *          custom scripts. Flat gray image over 0x7FFF blocks needs
+ *          more than one EOB run per AC scan
+ *
+ * @return 0 if all checks pass
+ */
+int test_progressive()
+{
+    enum { W = 75, H = 53, FLAT = 1456 };
+    static uint8_t rgb[W * H * 3], gray[W * H], flat[FLAT * FLAT], baseline[W * H * 3];
+    const uint8_t *images[] = {rgb, gray, flat};
+    static const struct
+    {
+        const char *name;
+        int image; // 0 RGB; 1 gray; 2 flat gray
+        jpeg_subsampling subsampling;
+        int trellis;
+        const jpeg_scan_info *script;
+        int num_scans;
+    } cases[] = {
+        {"default RGB 4:4:4", 0, JPEG_444, 0, NULL, 0},
+        {"default RGB 4:2:0", 0, JPEG_420, 0, NULL, 0},
+        {"default gray", 1, JPEG_444, 0, NULL, 0},
+        {"trellis RGB 4:2:0", 0, JPEG_420, 1, NULL, 0},
+        {"spectral RGB 4:2:2", 0, JPEG_422, 0, test_script_spectral, 5},
+        {"refinement RGB 4:2:0", 0, JPEG_420, 0, test_script_refine, 13},
+        {"default flat gray", 2, JPEG_444, 0, NULL, 0},
+    };
+    int failed = 0;
+
+    roundtrip_image(rgb, W, H);
+    roundtrip_gray(gray, rgb, W, H);
+    memset(flat, 90, sizeof(flat));
+
+    jpeg_encoder_t enc = jpeg_alloc();
+    jpeg_decoder_t dec = jpeg_decoder_alloc();
+    enc->quality = ROUNDTRIP_QUALITY;
+
+    for (size_t t = 0; t < sizeof(cases) / sizeof(cases[0]); t++)
+    {
+        unsigned w = cases[t].image == 2 ? FLAT : W, h = cases[t].image == 2 ? FLAT : H;
+        int channels = cases[t].image == 0 ? 3 : 1;
+        const uint8_t *src = images[cases[t].image];
+        buffer_t out = buffer_alloc(0);
+        double psnr[2] = {-1, -1};
+        int same = 1;
+
+        enc->subsampling = cases[t].subsampling;
+        enc->trellis = cases[t].trellis;
+        enc->scan_script = cases[t].script;
+        enc->num_scans = cases[t].num_scans;
+
+        for (int progressive = 0; progressive < 2; progressive++)
+        {
+            enc->progressive = progressive;
+            psnr[progressive] = roundtrip_encode(enc, dec, src, channels, w, h, out);
+            if (psnr[progressive] < 0)
+                break;
+
+            // flat image is too big for 'baseline', compare with its value
+            if (cases[t].image == 2)
+            {
+                for (size_t i = 0; i < (size_t)w * h; i++)
+                    same &= dec->pixels[i] == 90;
+            }
+            else if (progressive == 0)
+            {
+                memcpy(baseline, dec->pixels, (size_t)w * h * dec->channels);
+            }
+            else
+            {
+                same &= memcmp(baseline, dec->pixels, (size_t)w * h * dec->channels) == 0;
+            }
+        }
+
+        printf("progressive %-20s: %zu bytes, %s baseline, PSNR %.2f dB\n", cases[t].name, out->size,
+               same ? "same pixels as" : "differs from", psnr[1]);
+        failed |= !same || psnr[0] < ROUNDTRIP_PSNR || psnr[1] < ROUNDTRIP_PSNR;
+
+        buffer_free(out);
+    }
+
+    jpeg_decoder_free(dec);
+    jpeg_free(enc);
+
+    return roundtrip_report("Progressive", failed);
+}
+
+// jpeg_write_func over FILE*
+static void fwrite_func(void *context, void *data, int size)
+{
+    fwrite(data, 1, (size_t)size, (FILE *)context);
+}
+
+/**
+ * @brief Encode .ppm image with streaming API, pushing few rows at a time
+ */
+int stream_encode(jpeg_encoder_t enc, PPMImg *img, const char *out_filename)
+{
+    const unsigned chunk = 13; // not a multiple of MCU height on purpose
+    FILE *out_file = fopen(out_filename, "wb");
+
+    if (out_file == NULL)
+    {
+        printf("Error: failed to open %s\n", out_filename);
+        return -1;
+    }
+
+    jpeg_stream_begin(enc, img->width, img->height, JPEG_PIXEL_RGB, fwrite_func, out_file);
+
+    for (unsigned y = 0; y < img->height; y += chunk)
+    {
+        unsigned n = img->height - y < chunk ? img->height - y : chunk;
+        jpeg_stream_write_rows(enc, (const uint8_t *)(img->data + y * img->width), n, 0);
+    }
+
+    jpeg_stream_finish(enc);
+
+    fclose(out_file);
+    return 0;
+}
+
+/**
+ * @brief Encode .ppm file into .jpg
+ * 
+ * @details argv[3] optional rate control target:
+ *          "<N>kb" - largest quality under N kilobytes
+ *          "<X>db" - smallest quality with luma PSNR of X dB
+ *          or "stream" to encode with streaming API
+ */
 int test_encode(int argc, char **argv)
 {
     char *in_filename;
     char *out_filename;
+    double target = 0;
+    char unit[3] = "";
     PPMImg *img = NULL;
     jpeg_encoder_t enc = NULL;
+    int stream = 0;
 
     if (argc < 2)
         in_filename = "/home/a/win/Pictures/borabora_1.ppm";
@@ -19,6 +931,17 @@ int test_encode(int argc, char **argv)
     else
         out_filename = argv[2];
 
+    if (argc > 3 && strcmp(argv[3], "stream") == 0)
+    {
+        stream = 1;
+    }
+    else if (argc > 3 && (sscanf(argv[3], "%lf%2s", &target, unit) != 2 ||
+                     (strcmp(unit, "kb") != 0 && strcmp(unit, "db") != 0)))
+    {
+        printf("Error: rate target must be like 100kb or 38db\n");
+        return -1;
+    }
+
     img = PPMImg_from_file(in_filename);
 
     if (img == NULL)
@@ -35,7 +958,31 @@ int test_encode(int argc, char **argv)
 
     Timer_t timer;
     timer_start(&timer);
-    jpeg_encode_data(enc, img->width, img->height, (const uint8_t*)img->data);
+    if (stream)
+    {
+        int ret = stream_encode(enc, img, out_filename);
+        printf("Encoded and written in: %ldms\n", timer_delta_ms(&timer));
+
+        jpeg_free(enc);
+        PPMImg_free(img);
+        return ret;
+    }
+    else if (unit[0] == 'k')
+    {
+        jpeg_input input = jpeg_input_packed((const uint8_t*)img->data, JPEG_PIXEL_RGB);
+        int q = jpeg_encode_target_size(enc, img->width, img->height, &input, (size_t)(target * 1024));
+        printf("Quality for %.0fkb: %d\n", target, q);
+    }
+    else if (unit[0] == 'd')
+    {
+        jpeg_input input = jpeg_input_packed((const uint8_t*)img->data, JPEG_PIXEL_RGB);
+        int q = jpeg_encode_target_psnr(enc, img->width, img->height, &input, target);
+        printf("Quality for %.1fdB: %d\n", target, q);
+    }
+    else
+    {
+        jpeg_encode_data(enc, img->width, img->height, (const uint8_t*)img->data);
+    }
 
     printf("Encoded in: %ldms\n", timer_delta_ms(&timer));
     printf("Compressed payload: %zu bytes\n", enc->result->size);
@@ -47,8 +994,66 @@ int test_encode(int argc, char **argv)
     return 0;
 }
 
+/**
+ * @brief Decode .jpg file into .ppm
+ *
+ * @details gray images are written with R = G = B
+ *
+ * @param scale_denom 1, 2, 4 or 8 - decode at reduced size
+ */
+int test_decode(const char *in_filename, const char *out_filename, int scale_denom)
+{
+    jpeg_decoder_t dec = jpeg_decoder_alloc();
+    dec->scale_denom = scale_denom;
+
+    Timer_t timer;
+    timer_start(&timer);
+    if (jpeg_decode_file(dec, in_filename))
+    {
+        printf("Error: %s\n", dec->error);
+        jpeg_decoder_free(dec);
+        return -1;
+    }
+    printf("Decoded %ux%u, %d channels in: %ldms\n", dec->width, dec->height, dec->channels,
+           timer_delta_ms(&timer));
+
+    PPMImg *img = PPMImg_alloc();
+    img->type = 1;
+    img->width = dec->width;
+    img->height = dec->height;
+    img->max_val = 255;
+    img->data = (RGBPixel *)malloc(img->width * img->height * sizeof(RGBPixel));
+
+    for (size_t i = 0; i < img->width * img->height; i++)
+    {
+        const uint8_t *p = dec->pixels + i * dec->channels;
+        img->data[i].red = p[0];
+        img->data[i].green = p[dec->channels == 3 ? 1 : 0];
+        img->data[i].blue = p[dec->channels == 3 ? 2 : 0];
+    }
+
+    PPMImg_to_file(img, out_filename);
+
+    PPMImg_free(img);
+    jpeg_decoder_free(dec);
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
+    if (argc > 1 && strcmp(argv[1], "--test-dct") == 0)
+        return test_dct() || test_idct();
+
+    if (argc > 1 && strcmp(argv[1], "--test-quality") == 0)
+        return test_quality();
+
+    if (argc > 1 && strcmp(argv[1], "--test-decode") == 0)
+        return test_malformed() || test_roundtrip() || test_restart() || test_subsampling() ||
+               test_optimized() || test_stream() || test_progressive();
+
+    if (argc > 2 && strcmp(argv[1], "--decode") == 0)
+        return test_decode(argv[2], argc > 3 ? argv[3] : "result.ppm", argc > 4 ? atoi(argv[4]) : 1);
+
     return test_encode(argc, argv);
 
     return 0;
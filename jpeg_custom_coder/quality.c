@@ -0,0 +1,335 @@
+#include "quality.h"
+#include "color.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#ifdef QUALITY_HAVE_AVX2
+#include <immintrin.h>
+#endif
+
+// (K1 * 255)^2 and (K2 * 255)^2, K1 = 0.01, K2 = 0.03
+#define QUALITY_SSIM_C1 6.5025f
+#define QUALITY_SSIM_C2 58.5225f
+
+// R, G, B of pixel, gray is replicated
+static inline void quality_rgb(const uint8_t *p, int channels, int rgb[3])
+{
+    if (channels >= 3)
+    {
+        rgb[0] = p[0];
+        rgb[1] = p[1];
+        rgb[2] = p[2];
+    }
+    else
+        rgb[0] = rgb[1] = rgb[2] = p[0];
+}
+
+uint64_t quality_sse_rows(const uint8_t *a, int a_channels, const uint8_t *b, int b_channels,
+                          unsigned width, unsigned y0, unsigned y1)
+{
+    assert(a_channels >= 1 && a_channels <= 4);
+    assert(b_channels >= 1 && b_channels <= 4);
+
+    uint64_t sse = 0;
+
+    for (unsigned y = y0; y < y1; y++)
+    {
+        const uint8_t *pa = a + (size_t)y * width * a_channels;
+        const uint8_t *pb = b + (size_t)y * width * b_channels;
+        uint64_t row = 0;
+
+        // same layout: plain loop over samples, vectorized by compiler
+        if (a_channels == b_channels && a_channels != 2 && a_channels != 4)
+        {
+            for (unsigned i = 0; i < width * a_channels; i++)
+            {
+                int d = pa[i] - pb[i];
+                row += (uint64_t)(d * d);
+            }
+            // gray counts 3 times, as R = G = B
+            sse += a_channels == 1 ? 3 * row : row;
+            continue;
+        }
+
+        for (unsigned i = 0; i < width; i++)
+        {
+            int ca[3], cb[3];
+            quality_rgb(pa + i * a_channels, a_channels, ca);
+            quality_rgb(pb + i * b_channels, b_channels, cb);
+
+            for (int c = 0; c < 3; c++)
+                row += (uint64_t)((ca[c] - cb[c]) * (ca[c] - cb[c]));
+        }
+        sse += row;
+    }
+
+    return sse;
+}
+
+double quality_psnr(uint64_t sse, uint64_t samples)
+{
+    if (sse == 0 || samples == 0)
+        return QUALITY_PSNR_MAX;
+
+    double mse = (double)sse / (double)samples;
+    double psnr = 10.0 * log10(255.0 * 255.0 / mse);
+
+    return psnr < QUALITY_PSNR_MAX ? psnr : QUALITY_PSNR_MAX;
+}
+
+void quality_luma_rows(const uint8_t *pixels, int channels, unsigned width, unsigned y0, unsigned y1, float *luma)
+{
+    assert(channels >= 1 && channels <= 4);
+
+    color_row_fn color_row = color_row_select();
+    float *chroma = channels >= 3 ? (float *)malloc(2 * (size_t)width * sizeof(float)) : NULL;
+
+    for (unsigned y = y0; y < y1; y++)
+    {
+        const uint8_t *src = pixels + (size_t)y * width * channels;
+        float *dst = luma + (size_t)y * width;
+
+        if (channels >= 3)
+            color_row(src, src + 1, src + 2, channels, (int)width, dst, chroma, chroma + width);
+        else
+            color_gray_row(src, channels, (int)width, dst);
+
+        for (unsigned i = 0; i < width; i++)
+            dst[i] += 128.0f;
+    }
+
+    free(chroma);
+}
+
+void quality_downsample_rows(const float *in, unsigned width, unsigned y0, unsigned y1, float *out)
+{
+    unsigned out_width = width / 2;
+
+    for (unsigned y = y0; y < y1; y++)
+    {
+        const float *r0 = in + (size_t)(2 * y) * width;
+        const float *r1 = r0 + width;
+        float *dst = out + (size_t)y * out_width;
+
+        for (unsigned i = 0; i < out_width; i++)
+            dst[i] = (r0[2 * i] + r0[2 * i + 1] + r1[2 * i] + r1[2 * i + 1]) * 0.25f;
+    }
+}
+
+// normalized 1D gaussian of SSIM window, sigma 1.5
+static void quality_gaussian(float g[QUALITY_SSIM_WINDOW])
+{
+    float sum = 0.0f;
+
+    for (int i = 0; i < QUALITY_SSIM_WINDOW; i++)
+    {
+        float d = (float)(i - QUALITY_SSIM_WINDOW / 2);
+        g[i] = expf(-d * d / (2.0f * 1.5f * 1.5f));
+        sum += g[i];
+    }
+
+    for (int i = 0; i < QUALITY_SSIM_WINDOW; i++)
+        g[i] /= sum;
+}
+
+// SSIM and contrast * structure from filtered moments
+static inline void quality_ssim_point(float mx, float my, float mxx, float myy, float mxy, float *ssim, float *cs)
+{
+    float vx = mxx - mx * mx;
+    float vy = myy - my * my;
+    float cov = mxy - mx * my;
+
+    *cs = (2.0f * cov + QUALITY_SSIM_C2) / (vx + vy + QUALITY_SSIM_C2);
+    *ssim = (2.0f * mx * my + QUALITY_SSIM_C1) / (mx * mx + my * my + QUALITY_SSIM_C1) * *cs;
+}
+
+// horizontal pass of 'm' (5 rows of moments) for windows from 'c0' on
+static void quality_ssim_hpass(const float *m, unsigned width, unsigned c0, const float g[QUALITY_SSIM_WINDOW],
+                               double *ssim_sum, double *cs_sum)
+{
+    unsigned n = width - QUALITY_SSIM_WINDOW + 1;
+
+    for (unsigned c = c0; c < n; c++)
+    {
+        float f[5] = {0};
+
+        for (int k = 0; k < 5; k++)
+            for (int i = 0; i < QUALITY_SSIM_WINDOW; i++)
+                f[k] += g[i] * m[k * width + c + i];
+
+        float ssim, cs;
+        quality_ssim_point(f[0], f[1], f[2], f[3], f[4], &ssim, &cs);
+        *ssim_sum += ssim;
+        *cs_sum += cs;
+    }
+}
+
+void quality_ssim_rows_scalar(const float *x, const float *y, unsigned width, unsigned y0, unsigned y1,
+                              quality_ssim_sum *sum)
+{
+    if (width < QUALITY_SSIM_WINDOW || y0 >= y1)
+        return;
+
+    float g[QUALITY_SSIM_WINDOW];
+    quality_gaussian(g);
+
+    // x, y, x^2, y^2, xy filtered down the window
+    float *m = (float *)malloc(5 * (size_t)width * sizeof(float));
+
+    for (unsigned r = y0; r < y1; r++)
+    {
+        for (unsigned i = 0; i < 5 * width; i++)
+            m[i] = 0.0f;
+
+        for (int j = 0; j < QUALITY_SSIM_WINDOW; j++)
+        {
+            const float *px = x + (size_t)(r + j) * width;
+            const float *py = y + (size_t)(r + j) * width;
+
+            for (unsigned c = 0; c < width; c++)
+            {
+                m[c] += g[j] * px[c];
+                m[width + c] += g[j] * py[c];
+                m[2 * width + c] += g[j] * px[c] * px[c];
+                m[3 * width + c] += g[j] * py[c] * py[c];
+                m[4 * width + c] += g[j] * px[c] * py[c];
+            }
+        }
+
+        quality_ssim_hpass(m, width, 0, g, &sum->ssim, &sum->cs);
+    }
+
+    sum->count += (uint64_t)(y1 - y0) * (width - QUALITY_SSIM_WINDOW + 1);
+    free(m);
+}
+
+#ifdef QUALITY_HAVE_AVX2
+#define AVX2_FN __attribute__((target("avx2,fma")))
+
+AVX2_FN static inline double quality_avx2_hsum(__m256 v)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    __m128d d = _mm_add_pd(_mm_cvtps_pd(s), _mm_cvtps_pd(_mm_movehl_ps(s, s)));
+    return _mm_cvtsd_f64(_mm_add_sd(d, _mm_unpackhi_pd(d, d)));
+}
+
+AVX2_FN void quality_ssim_rows_avx2(const float *x, const float *y, unsigned width, unsigned y0, unsigned y1,
+                                    quality_ssim_sum *sum)
+{
+    if (width < QUALITY_SSIM_WINDOW || y0 >= y1)
+        return;
+
+    float g[QUALITY_SSIM_WINDOW];
+    quality_gaussian(g);
+
+    float *m = (float *)malloc(5 * (size_t)width * sizeof(float));
+    unsigned n = width - QUALITY_SSIM_WINDOW + 1;
+
+    const __m256 c1 = _mm256_set1_ps(QUALITY_SSIM_C1);
+    const __m256 c2 = _mm256_set1_ps(QUALITY_SSIM_C2);
+    const __m256 two = _mm256_set1_ps(2.0f);
+
+    for (unsigned r = y0; r < y1; r++)
+    {
+        // vertical pass, 8 columns with all 5 moments in registers
+        unsigned c = 0;
+        for (; c + 8 <= width; c += 8)
+        {
+            __m256 sx = _mm256_setzero_ps(), sy = _mm256_setzero_ps();
+            __m256 sxx = _mm256_setzero_ps(), syy = _mm256_setzero_ps(), sxy = _mm256_setzero_ps();
+
+            for (int j = 0; j < QUALITY_SSIM_WINDOW; j++)
+            {
+                __m256 w = _mm256_set1_ps(g[j]);
+                __m256 vx = _mm256_loadu_ps(x + (size_t)(r + j) * width + c);
+                __m256 vy = _mm256_loadu_ps(y + (size_t)(r + j) * width + c);
+                __m256 wx = _mm256_mul_ps(w, vx);
+                __m256 wy = _mm256_mul_ps(w, vy);
+
+                sx = _mm256_add_ps(sx, wx);
+                sy = _mm256_add_ps(sy, wy);
+                sxx = _mm256_fmadd_ps(wx, vx, sxx);
+                syy = _mm256_fmadd_ps(wy, vy, syy);
+                sxy = _mm256_fmadd_ps(wx, vy, sxy);
+            }
+
+            _mm256_storeu_ps(m + c, sx);
+            _mm256_storeu_ps(m + width + c, sy);
+            _mm256_storeu_ps(m + 2 * width + c, sxx);
+            _mm256_storeu_ps(m + 3 * width + c, syy);
+            _mm256_storeu_ps(m + 4 * width + c, sxy);
+        }
+        for (; c < width; c++)
+        {
+            float f[5] = {0};
+
+            for (int j = 0; j < QUALITY_SSIM_WINDOW; j++)
+            {
+                float vx = x[(size_t)(r + j) * width + c];
+                float vy = y[(size_t)(r + j) * width + c];
+                f[0] += g[j] * vx;
+                f[1] += g[j] * vy;
+                f[2] += g[j] * vx * vx;
+                f[3] += g[j] * vy * vy;
+                f[4] += g[j] * vx * vy;
+            }
+
+            for (int k = 0; k < 5; k++)
+                m[k * width + c] = f[k];
+        }
+
+        // horizontal pass and SSIM of 8 windows at once
+        __m256 ssim_acc = _mm256_setzero_ps(), cs_acc = _mm256_setzero_ps();
+
+        c = 0;
+        for (; c + 8 <= n; c += 8)
+        {
+            __m256 f[5];
+
+            for (int k = 0; k < 5; k++)
+            {
+                const float *row = m + k * width + c;
+                __m256 acc = _mm256_mul_ps(_mm256_set1_ps(g[0]), _mm256_loadu_ps(row));
+
+                for (int i = 1; i < QUALITY_SSIM_WINDOW; i++)
+                    acc = _mm256_fmadd_ps(_mm256_set1_ps(g[i]), _mm256_loadu_ps(row + i), acc);
+                f[k] = acc;
+            }
+
+            __m256 mxy = _mm256_mul_ps(f[0], f[1]);
+            __m256 mxx = _mm256_mul_ps(f[0], f[0]);
+            __m256 myy = _mm256_mul_ps(f[1], f[1]);
+
+            __m256 cs_num = _mm256_fmadd_ps(two, _mm256_sub_ps(f[4], mxy), c2);
+            __m256 cs_den = _mm256_add_ps(_mm256_add_ps(_mm256_sub_ps(f[2], mxx), _mm256_sub_ps(f[3], myy)), c2);
+            __m256 cs = _mm256_div_ps(cs_num, cs_den);
+
+            __m256 l_num = _mm256_fmadd_ps(two, mxy, c1);
+            __m256 l_den = _mm256_add_ps(_mm256_add_ps(mxx, myy), c1);
+
+            cs_acc = _mm256_add_ps(cs_acc, cs);
+            ssim_acc = _mm256_add_ps(ssim_acc, _mm256_mul_ps(_mm256_div_ps(l_num, l_den), cs));
+        }
+
+        sum->ssim += quality_avx2_hsum(ssim_acc);
+        sum->cs += quality_avx2_hsum(cs_acc);
+        quality_ssim_hpass(m, width, c, g, &sum->ssim, &sum->cs);
+    }
+
+    sum->count += (uint64_t)(y1 - y0) * n;
+    free(m);
+}
+
+#undef AVX2_FN
+#endif // QUALITY_HAVE_AVX2
+
+quality_ssim_fn quality_ssim_select()
+{
+#ifdef QUALITY_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return quality_ssim_rows_avx2;
+#endif
+    return quality_ssim_rows_scalar;
+}
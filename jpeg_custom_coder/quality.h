@@ -0,0 +1,134 @@
+#ifndef QUALITY_H
+#define QUALITY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @file quality.h
+ * @brief Full reference image quality: PSNR, SSIM, MS-SSIM
+ *
+ * @details Work is split into bands of rows. Every function takes a row
+ *          range and writes or adds up only its part, so bands can be
+ *          spread over threads and partial sums added afterwards.
+ *
+ *          Pixels are packed rows of 1 - 4 channels: gray, gray + alpha,
+ *          RGB, RGBA. Alpha is ignored, gray compares as R = G = B, so a
+ *          gray decode of RGB source is measured too.
+ *
+ *          SSIM is computed on luma (BT.601, same as encoder) with 11x11
+ *          gaussian window, sigma 1.5 and constants of Wang et al.
+ *          Only windows lying fully inside the image are used
+ */
+
+// window side of SSIM, images smaller than this have no SSIM
+#define QUALITY_SSIM_WINDOW 11
+
+// PSNR reported for identical images
+#define QUALITY_PSNR_MAX 99.0
+
+/**
+ * @brief Sum of squared differences of RGB samples in rows y0 .. y1 - 1
+ *
+ * @param a packed pixels of 'a_channels'
+ * @param b packed pixels of 'b_channels', same size as 'a'
+ * @param width pixels per row of both images
+ * @return uint64_t sum over 3 samples per pixel
+ */
+uint64_t quality_sse_rows(const uint8_t *a, int a_channels, const uint8_t *b, int b_channels,
+                          unsigned width, unsigned y0, unsigned y1);
+
+/**
+ * @brief PSNR of 8 bit samples
+ *
+ * @param sse sum of squared differences
+ * @param samples compared samples, 3 per pixel for quality_sse_rows()
+ * @return double dB, QUALITY_PSNR_MAX for sse 0
+ */
+double quality_psnr(uint64_t sse, uint64_t samples);
+
+/**
+ * @brief Luma of rows y0 .. y1 - 1 as float 0 .. 255
+ *
+ * @details color_row_select() kernel, result is moved back from zero
+ *          centered encoder range
+ *
+ * @param luma plane of 'width' floats per row, rows y0 .. y1 - 1 are written
+ */
+void quality_luma_rows(const uint8_t *pixels, int channels, unsigned width, unsigned y0, unsigned y1, float *luma);
+
+/**
+ * @brief 2x2 average of plane, output rows y0 .. y1 - 1
+ *
+ * @details Output is (width / 2) x (height / 2), odd last row and column
+ *          are dropped. Same low-pass as reference MS-SSIM
+ *
+ * @param in 'width' floats per row
+ * @param out 'width / 2' floats per row
+ */
+void quality_downsample_rows(const float *in, unsigned width, unsigned y0, unsigned y1, float *out);
+
+/**
+ * @brief Partial SSIM of band of windows
+ *
+ * @details 'ssim' - sum of SSIM of every window, 'cs' - sum of its
+ *          contrast * structure term, 'count' - windows
+ */
+typedef struct quality_ssim_sum
+{
+    double ssim;
+    double cs;
+    uint64_t count;
+} quality_ssim_sum;
+
+/**
+ * @brief Adds SSIM of windows with top row y0 .. y1 - 1 to 'sum'
+ *
+ * @details Windows are at every pixel, rows 0 .. height - QUALITY_SSIM_WINDOW
+ *
+ * @param x luma plane of reference
+ * @param y luma plane of distorted image
+ * @param width floats per row of both planes
+ * @param y0 first window row
+ * @param y1 window row past the band, at most height - QUALITY_SSIM_WINDOW + 1
+ * @param sum partial sums, added to
+ */
+typedef void (*quality_ssim_fn)(const float *x, const float *y, unsigned width, unsigned y0, unsigned y1,
+                                quality_ssim_sum *sum);
+
+/**
+ * @brief Picks fastest SSIM kernel supported by the CPU
+ *
+ * @details checked at runtime via CPUID. Falls back to quality_ssim_rows_scalar()
+ *
+ * @return quality_ssim_fn
+ */
+quality_ssim_fn quality_ssim_select();
+
+/**
+ * @brief Separable gaussian, vertical pass of all 5 moments per row
+ */
+void quality_ssim_rows_scalar(const float *x, const float *y, unsigned width, unsigned y0, unsigned y1,
+                              quality_ssim_sum *sum);
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define QUALITY_HAVE_AVX2 1
+
+/**
+ * @brief 8 columns per step, moments stay in registers during vertical pass
+ *
+ * @warning CPU must support AVX2 and FMA. Use quality_ssim_select()
+ */
+void quality_ssim_rows_avx2(const float *x, const float *y, unsigned width, unsigned y0, unsigned y1,
+                            quality_ssim_sum *sum);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // QUALITY_H
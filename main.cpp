@@ -5,9 +5,17 @@
 #include <filesystem>
 #include <fstream>
 #include <numeric>
+#include <cmath>
 #include <iomanip>
+#include <sstream>
 #include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "thread_pool.h"
 #include "jpeg_custom_coder/jpeg.h"
+#include "jpeg_custom_coder/jpeg_decoder.h"
+#include "jpeg_custom_coder/quality.h"
 
 #define QOI_IMPLEMENTATION
 #include "qoi.h"
@@ -20,181 +28,756 @@
 
 using namespace std;
 
-std::vector<unsigned long> TimeQOI;
-std::vector<unsigned long> TimeJPEG;
-std::vector<unsigned long> TimeCustomJPEG;
-std::vector<unsigned long> TimePNG;
+//codecs under test, index of their numbers in Results
+enum Codec {
+    CODEC_QOI,
+    CODEC_JPEG,
+    CODEC_PNG,
+    CODEC_CUSTOM_JPEG,
+    CODEC_CUSTOM_JPEG_TRELLIS,
+    CODEC_COUNT
+};
+
+//monotonic, high_resolution_clock may follow wall clock adjustments
+using Clock = std::chrono::steady_clock;
+
+template <typename T>
+void append(std::vector<T>& to, const std::vector<T>& from){
+    to.insert(to.end(), from.begin(), from.end());
+}
 
-std::vector<unsigned long> CompressionQOI;
-std::vector<unsigned long> CompressionJPEG;
-std::vector<unsigned long> CompressionCustomJPEG;
-std::vector<unsigned long> CompressionPNG;
-std::vector<unsigned long> Uncompressed;
+//one operation on one image: median of Repetitions timed runs
+struct Timing {
+    unsigned long long ns;
+    //stddev / mean of the timed runs, noise of this measurement
+    double cv;
+};
+
+//timings of one operation, one entry per image
+struct TimeResults {
+    std::vector<unsigned long long> ns;
+    std::vector<double> cv;
+    //uncompressed bytes and pixels of the images, for throughput
+    unsigned long long bytes = 0;
+    unsigned long long pixels = 0;
+
+    void add(const Timing& timing, unsigned long long image_bytes, unsigned long long image_pixels){
+        ns.push_back(timing.ns);
+        cv.push_back(timing.cv);
+        bytes += image_bytes;
+        pixels += image_pixels;
+    }
 
-void qoi_test(const char * filename, const void * data, unsigned width, unsigned height, uint8_t channels){
-    //init vals
-	int size{};
-	void * encoded;
-    qoi_desc desc{ width, height, channels, 0 };
+    void merge(const TimeResults& other){
+        append(ns, other.ns);
+        append(cv, other.cv);
+        bytes += other.bytes;
+        pixels += other.pixels;
+    }
+};
+
+//full reference quality of decoded images against source, one entry per image.
+//Images smaller than SSIM window have PSNR only. Size of the images for bits per pixel
+struct QualityResults {
+    std::vector<double> psnr;
+    std::vector<double> ssim;
+    std::vector<double> msssim;
+    unsigned long long bytes = 0;
+    unsigned long long pixels = 0;
+
+    void merge(const QualityResults& other){
+        append(psnr, other.psnr);
+        append(ssim, other.ssim);
+        append(msssim, other.msssim);
+        bytes += other.bytes;
+        pixels += other.pixels;
+    }
+};
+
+//numbers of one codec, one entry per image
+struct CodecResults {
+    //encoding into memory
+    TimeResults time;
+    //writing encoded image to file, single run, only with output enabled
+    TimeResults io;
+    //decoding encoded image from memory, images which failed are left out
+    TimeResults decode;
+    //bytes of encoded image
+    std::vector<unsigned long> compression;
+    //lossy codecs only
+    QualityResults quality;
+
+    void merge(const CodecResults& other){
+        time.merge(other.time);
+        io.merge(other.io);
+        decode.merge(other.decode);
+        quality.merge(other.quality);
+        append(compression, other.compression);
+    }
+};
+
+//numbers of images done by one worker thread, merged after all images are done
+struct Results {
+    CodecResults codec[CODEC_COUNT];
+    //points of --sweep, same order as SweepQualities, lossy codecs only
+    std::vector<QualityResults> sweep[CODEC_COUNT];
+    std::vector<unsigned long> Uncompressed;
+
+    void merge(const Results& other){
+        for (int i = 0; i < CODEC_COUNT; i++){
+            codec[i].merge(other.codec[i]);
+            sweep[i].resize(std::max(sweep[i].size(), other.sweep[i].size()));
+            for (size_t k = 0; k < other.sweep[i].size(); k++)
+                sweep[i][k].merge(other.sweep[i][k]);
+        }
+        append(Uncompressed, other.Uncompressed);
+    }
+};
+
+//name in report and messages, same order as Codec
+const char * CodecNames[CODEC_COUNT] = { "QOI", "JPEG", "PNG", "Custom", "CustomTr" };
+
+//quality is measured and swept for these, all take JpegQuality
+const bool CodecLossy[CODEC_COUNT] = { false, true, false, true, true };
+
+//codec objects and results of one worker thread, nothing is shared between threads
+struct Worker {
+    //reused for every image, tables and buffers are kept between calls
+    jpeg_encoder_t CustomEncoder;
+    //same settings + trellis quantization, separate numbers of slower effort level
+    jpeg_encoder_t CustomEncoderTrellis;
+    //decodes images of both custom encoders, buffers are kept between calls
+    jpeg_decoder_t CustomDecoder;
+
+    //encoded image of stb writers and custom encoders, capacity is kept between calls
+    std::vector<uint8_t> Encoded;
+    buffer_t CustomEncoded;
+
+    Results results;
+};
 
-    //clock start
-    auto start = std::chrono::high_resolution_clock::now();
+std::vector<Worker> Workers;
 
-    //init file
-    std::ofstream file(filename, std::ios_base::binary);
+//image shared by codec tasks of --split-codecs, freed by the last one
+using Image = std::shared_ptr<uint8_t>;
 
-    //encode
-	encoded = qoi_encode(data, &desc, &size);
-    assert(encoded);
+//quality of both JPEG encoders, same scale of same spec tables
+int JpegQuality = 90;
 
-    //write file
-    file.write(static_cast<char *>(encoded), size);
+//encoded images are written to codec directories after timing, --no-write disables
+bool WriteOutput = true;
+
+//timed runs of every operation, its median is the result. Warm-up runs are not timed
+int Repetitions = 1;
+int Warmup = 0;
+
+//PSNR, SSIM and MS-SSIM of lossy codecs, --no-quality disables
+bool MeasureQuality = true;
+
+//qualities of --sweep, lossy codecs encode every image once more at each of them for bits per pixel vs quality curves
+std::vector<int> SweepQualities;
+
+//pool of the run, quality metrics spread bands of rows over it
+ThreadPool * Pool = nullptr;
+
+//rows per band of quality metrics
+const unsigned QualityBand = 32;
+
+std::filesystem::path QoiOutPath;
+std::filesystem::path JpegOutPath;
+std::filesystem::path PngOutPath;
+std::filesystem::path CustomJpegOutPath;
+std::filesystem::path CustomJpegTrellisOutPath;
+
+//keeps messages of worker threads whole
+std::mutex LogMutex;
+
+//output file of image 'path' in codec directory 'dir'
+std::string out_name(const std::filesystem::path& dir, const std::filesystem::path& path, const char * extension){
+    auto ofname = dir / path.filename();
+    ofname.replace_extension(extension);
+    return ofname.string();
+}
+
+unsigned long long elapsed_ns(Clock::time_point start){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+//distribution of samples, percentiles are nearest rank
+struct Stats {
+    double min = 0, median = 0, p90 = 0, p99 = 0, mean = 0, stddev = 0;
+};
+
+template <typename T>
+Stats stats(std::vector<T> values){
+    Stats st;
+    if (values.empty()) return st;
+
+    std::sort(values.begin(), values.end());
+    auto rank = [&](double p){
+        size_t i = static_cast<size_t>(std::ceil(p * values.size()));
+        return static_cast<double>(values[std::clamp<size_t>(i, 1, values.size()) - 1]);
+    };
+    st.min = static_cast<double>(values.front());
+    st.median = values.size() % 2 ? static_cast<double>(values[values.size() / 2])
+        : (static_cast<double>(values[values.size() / 2 - 1]) + static_cast<double>(values[values.size() / 2])) / 2.0;
+    st.p90 = rank(0.90);
+    st.p99 = rank(0.99);
+
+    double sum = 0.0;
+    for (T value : values) sum += static_cast<double>(value);
+    st.mean = sum / values.size();
+
+    double var = 0.0;
+    for (T value : values) var += (static_cast<double>(value) - st.mean) * (static_cast<double>(value) - st.mean);
+    st.stddev = values.size() > 1 ? std::sqrt(var / (values.size() - 1)) : 0.0;
+
+    return st;
+}
+
+//'reset' runs untimed before every run, it discards output of previous one
+template <typename Run, typename Reset>
+Timing measure(Run run, Reset reset){
+    std::vector<unsigned long long> samples;
+    samples.reserve(Repetitions);
+
+    for (int i = 0; i < Warmup + Repetitions; i++){
+        reset();
+        auto start = Clock::now();
+        run();
+        auto ns = elapsed_ns(start);
+        if (i >= Warmup) samples.push_back(ns);
+    }
+
+    Stats st = stats(samples);
+    return { static_cast<unsigned long long>(st.median), st.mean > 0.0 ? st.stddev / st.mean : 0.0 };
+}
+
+template <typename Run>
+Timing measure(Run run){
+    return measure(run, []{});
+}
+
+//stbi_write_func appending to std::vector<uint8_t> 'context'
+void append_to_vector(void * context, void * data, int size){
+    auto& out = *static_cast<std::vector<uint8_t> *>(context);
+    out.insert(out.end(), static_cast<uint8_t *>(data), static_cast<uint8_t *>(data) + size);
+}
+
+//records encoding and size of encoded image, writes it if enabled. Writing is timed once, apart from encoding
+void store_output(CodecResults& results, const Timing& timing, const std::filesystem::path& dir, const std::filesystem::path& path,
+                  const char * extension, const void * data, size_t size, unsigned width, unsigned height, uint8_t channels){
+    unsigned long long pixels = static_cast<unsigned long long>(width) * height;
+
+    results.time.add(timing, pixels * channels, pixels);
+    results.compression.push_back(size);
+
+    if (!WriteOutput) return;
+
+    auto start = Clock::now();
+
+    std::ofstream file(out_name(dir, path, extension), std::ios_base::binary);
+    file.write(static_cast<const char *>(data), size);
     file.close();
 
-    //clock end
-    auto end = std::chrono::high_resolution_clock::now() - start;
+    results.io.add({ elapsed_ns(start), 0.0 }, pixels * channels, pixels);
+}
+
+//result of one decode, 'pixels' is null on failure
+struct Decoded {
+    const uint8_t * pixels;
+    unsigned width;
+    unsigned height;
+    int channels;
+    const char * error;
+};
+
+//times 'decode' of encoded image and checks size of the result.
+//'reset' frees result of previous run, result of the last one is returned to caller, 'pixels' null if it failed
+template <typename Decode, typename Reset>
+Decoded decode_test(CodecResults& results, Codec codec, const std::filesystem::path& path, unsigned width, unsigned height, uint8_t channels,
+                 Decode decode, Reset reset){
+    Decoded decoded{};
+
+    Timing timing = measure([&]{ decoded = decode(); }, reset);
+
+    if (decoded.pixels == nullptr || decoded.width != width || decoded.height != height){
+        std::lock_guard<std::mutex> lock(LogMutex);
+        std::cerr << "Failed to decode " << CodecNames[codec] << ": " << path << " "
+                  << (decoded.pixels ? "size mismatch" : decoded.error) << std::endl;
+        decoded.pixels = nullptr;
+        return decoded;
+    }
+
+    unsigned long long pixels = static_cast<unsigned long long>(width) * height;
+    results.decode.add(timing, pixels * channels, pixels);
+    return decoded;
+}
+
+//sums of bands of quality_ssim_fn over 'pool', mean SSIM and contrast * structure of the plane
+std::pair<double, double> ssim_plane(const float * x, const float * y, unsigned width, unsigned height){
+    quality_ssim_fn ssim_rows = quality_ssim_select();
+    unsigned rows = height - QUALITY_SSIM_WINDOW + 1;
+    std::vector<quality_ssim_sum> sums((rows + QualityBand - 1) / QualityBand, quality_ssim_sum{});
+
+    Pool->parallel_for(static_cast<unsigned>(sums.size()), [&](unsigned b){
+        ssim_rows(x, y, width, b * QualityBand, std::min(b * QualityBand + QualityBand, rows), &sums[b]);
+    });
+
+    quality_ssim_sum total{};
+    for (auto& sum : sums){
+        total.ssim += sum.ssim;
+        total.cs += sum.cs;
+        total.count += sum.count;
+    }
+    return { total.ssim / total.count, total.cs / total.count };
+}
+
+//PSNR of RGB samples, SSIM and MS-SSIM of luma. Bands of rows are spread over Pool
+void quality_test(QualityResults& results, const uint8_t * src, uint8_t channels, const Decoded& decoded, size_t size){
+    unsigned width = decoded.width, height = decoded.height;
+    unsigned bands = (height + QualityBand - 1) / QualityBand;
+    std::vector<uint64_t> sse(bands);
+    std::vector<float> x(static_cast<size_t>(width) * height), y(x.size());
+
+    Pool->parallel_for(bands, [&](unsigned b){
+        unsigned y0 = b * QualityBand, y1 = std::min(y0 + QualityBand, height);
+        sse[b] = quality_sse_rows(src, channels, decoded.pixels, decoded.channels, width, y0, y1);
+        quality_luma_rows(src, channels, width, y0, y1, x.data());
+        quality_luma_rows(decoded.pixels, decoded.channels, width, y0, y1, y.data());
+    });
+
+    results.psnr.push_back(quality_psnr(std::accumulate(sse.begin(), sse.end(), 0ULL), 3ULL * width * height));
+    results.bytes += size;
+    results.pixels += static_cast<unsigned long long>(width) * height;
+
+    if (width < QUALITY_SSIM_WINDOW || height < QUALITY_SSIM_WINDOW)
+        return;
+
+    //MS-SSIM of Wang et al.: contrast * structure of finer scales, SSIM of the coarsest one.
+    //Scales stop before window doesn't fit, weights of used ones are renormalized
+    const double weights[5] = { 0.0448, 0.2856, 0.3001, 0.2363, 0.1333 };
+    std::vector<float> x2, y2;
+    double cs[5], ssim = 0.0, weight_sum = 0.0;
+    int scales = 0;
+
+    for (;;){
+        auto [scale_ssim, scale_cs] = ssim_plane(x.data(), y.data(), width, height);
+        if (scales == 0) results.ssim.push_back(scale_ssim);
+
+        ssim = scale_ssim;
+        cs[scales] = scale_cs;
+        weight_sum += weights[scales++];
+
+        if (scales == 5 || width / 2 < QUALITY_SSIM_WINDOW || height / 2 < QUALITY_SSIM_WINDOW)
+            break;
+
+        x2.resize(static_cast<size_t>(width / 2) * (height / 2));
+        y2.resize(x2.size());
+        Pool->parallel_for((height / 2 + QualityBand - 1) / QualityBand, [&](unsigned b){
+            unsigned y0 = b * QualityBand, y1 = std::min(y0 + QualityBand, height / 2);
+            quality_downsample_rows(x.data(), width, y0, y1, x2.data());
+            quality_downsample_rows(y.data(), width, y0, y1, y2.data());
+        });
+        x.swap(x2);
+        y.swap(y2);
+        width /= 2;
+        height /= 2;
+    }
+
+    double msssim = std::pow(std::max(ssim, 0.0), weights[scales - 1] / weight_sum);
+    for (int i = 0; i < scales - 1; i++)
+        msssim *= std::pow(std::max(cs[i], 0.0), weights[i] / weight_sum);
+    results.msssim.push_back(msssim);
+}
+
+//stb_image decoding of encoded image in worker.Encoded
+void stb_decode_test(Worker& worker, Codec codec, const std::filesystem::path& path, const Image& img,
+                     unsigned width, unsigned height, uint8_t channels){
+    stbi_uc * decoded = nullptr;
+    auto free_decoded = [&]{ stbi_image_free(decoded); decoded = nullptr; };
+
+    Decoded result = decode_test(worker.results.codec[codec], codec, path, width, height, channels,
+                [&]{
+                    int w = 0, h = 0, c = 0;
+                    decoded = stbi_load_from_memory(worker.Encoded.data(), static_cast<int>(worker.Encoded.size()), &w, &h, &c, channels);
+                    return Decoded{ decoded, static_cast<unsigned>(w), static_cast<unsigned>(h), channels, stbi_failure_reason() };
+                },
+                free_decoded);
+
+    if (result.pixels && MeasureQuality && CodecLossy[codec])
+        quality_test(worker.results.codec[codec].quality, img.get(), channels, result, worker.Encoded.size());
+
+    free_decoded();
+}
+
+//quality and chroma subsampling of custom encoders, subsampled up to quality 90 like stb_image_write
+void set_custom_quality(jpeg_encoder_t encoder, int quality){
+    encoder->quality = quality;
+    encoder->subsampling = quality <= 90 ? JPEG_420 : JPEG_444;
+}
+
+//encodes image once at every quality of --sweep, decodes and measures it. Nothing is timed
+void sweep_test(Worker& worker, Codec codec, const Image& img, unsigned width, unsigned height, uint8_t channels){
+    std::vector<QualityResults>& sweep = worker.results.sweep[codec];
+    sweep.resize(SweepQualities.size());
+
+    for (size_t k = 0; k < SweepQualities.size(); k++){
+        int quality = SweepQualities[k];
+        Decoded decoded{};
+        size_t size = 0;
+        stbi_uc * stb_pixels = nullptr;
+
+        if (codec == CODEC_JPEG){
+            worker.Encoded.clear();
+            stbi_write_jpg_to_func(append_to_vector, &worker.Encoded, static_cast<int>(width), static_cast<int>(height),
+                                   channels, img.get(), quality);
+            size = worker.Encoded.size();
+
+            int w = 0, h = 0, c = 0;
+            stb_pixels = stbi_load_from_memory(worker.Encoded.data(), static_cast<int>(size), &w, &h, &c, channels);
+            decoded = Decoded{ stb_pixels, static_cast<unsigned>(w), static_cast<unsigned>(h), channels, nullptr };
+        } else {
+            jpeg_encoder_t encoder = codec == CODEC_CUSTOM_JPEG ? worker.CustomEncoder : worker.CustomEncoderTrellis;
+            jpeg_input input = jpeg_input_packed(img.get(), jpeg_format_from_channels(channels));
+
+            set_custom_quality(encoder, quality);
+            jpeg_encode_input(encoder, width, height, &input);
+            worker.CustomEncoded->size = 0;
+            jpeg_write_to_buffer(encoder, worker.CustomEncoded);
+            set_custom_quality(encoder, JpegQuality);
+            size = worker.CustomEncoded->size;
+
+            jpeg_decoder_t decoder = worker.CustomDecoder;
+            if (jpeg_decode(decoder, worker.CustomEncoded->data, size) == 0)
+                decoded = Decoded{ decoder->pixels, decoder->width, decoder->height, decoder->channels, nullptr };
+        }
+
+        if (decoded.pixels && decoded.width == width && decoded.height == height)
+            quality_test(sweep[k], img.get(), channels, decoded, size);
+
+        stbi_image_free(stb_pixels);
+    }
+}
+
+void qoi_test(Worker& worker, const std::filesystem::path& path, const Image& img, unsigned width, unsigned height, uint8_t channels){
+    //QOI takes 3 or 4 channels, gray and gray + alpha are expanded untimed
+    std::vector<uint8_t> expanded;
+    const uint8_t * pixels = img.get();
+    uint8_t qoi_channels = channels < 3 ? channels + 2 : channels;
+
+    if (channels < 3){
+        size_t count = static_cast<size_t>(width) * height;
+        expanded.resize(count * qoi_channels);
+        for (size_t i = 0; i < count; i++){
+            uint8_t * out = &expanded[i * qoi_channels];
+            out[0] = out[1] = out[2] = pixels[i * channels];
+            if (channels == 2) out[3] = pixels[i * channels + 1];
+        }
+        pixels = expanded.data();
+    }
+
+    //init vals
+    int size{};
+    void * encoded = nullptr;
+    qoi_desc desc{ width, height, qoi_channels, 0 };
+
+    //encode, result of previous run is freed untimed
+    Timing timing = measure([&]{ encoded = qoi_encode(pixels, &desc, &size); },
+                            [&]{ free(encoded); encoded = nullptr; });
+
+    //nothing is recorded for image QOI can't take
+    if (encoded == nullptr){
+        std::lock_guard<std::mutex> lock(LogMutex);
+        std::cerr << "Failed to encode QOI: " << path << std::endl;
+        return;
+    }
 
     //accumulate info
-    TimeQOI.push_back(std::chrono::duration_cast<std::chrono::milliseconds>(end).count());
-    CompressionQOI.push_back(size);
+    store_output(worker.results.codec[CODEC_QOI], timing, QoiOutPath, path, "qoi", encoded, size, width, height, channels);
 
+    //decode into format of source image
+    void * decoded = nullptr;
+    auto free_decoded = [&]{ free(decoded); decoded = nullptr; };
+
+    decode_test(worker.results.codec[CODEC_QOI], CODEC_QOI, path, width, height, channels,
+                [&]{
+                    qoi_desc out{};
+                    decoded = qoi_decode(encoded, size, &out, qoi_channels);
+                    return Decoded{ static_cast<const uint8_t *>(decoded), out.width, out.height, qoi_channels, "invalid QOI stream" };
+                },
+                free_decoded);
+
+    free_decoded();
     free(encoded);
 }
 
-void jpeg_test(const char * filename, const void * data, unsigned width, unsigned height, uint8_t channels){
-    auto start = std::chrono::high_resolution_clock::now();
+void jpeg_test(Worker& worker, const std::filesystem::path& path, const Image& img, unsigned width, unsigned height, uint8_t channels){
+    Timing timing = measure([&]{ stbi_write_jpg_to_func(append_to_vector, &worker.Encoded, static_cast<int>(width), static_cast<int>(height),
+                                                        channels, img.get(), JpegQuality); },
+                            [&]{ worker.Encoded.clear(); });
 
-    stbi_write_jpg(filename, static_cast<int>(width), static_cast<int>(height), channels, data, 0);
+    store_output(worker.results.codec[CODEC_JPEG], timing, JpegOutPath, path, "jpeg", worker.Encoded.data(), worker.Encoded.size(),
+                 width, height, channels);
+    stb_decode_test(worker, CODEC_JPEG, path, img, width, height, channels);
+    sweep_test(worker, CODEC_JPEG, img, width, height, channels);
+}
 
-    auto end = std::chrono::high_resolution_clock::now() - start;
+void png_test(Worker& worker, const std::filesystem::path& path, const Image& img, unsigned width, unsigned height, uint8_t channels){
+    Timing timing = measure([&]{ stbi_write_png_to_func(append_to_vector, &worker.Encoded, static_cast<int>(width), static_cast<int>(height),
+                                                        channels, img.get(), width * channels); },
+                            [&]{ worker.Encoded.clear(); });
 
-    TimeJPEG.push_back(std::chrono::duration_cast<std::chrono::milliseconds>(end).count());
-    CompressionJPEG.push_back(std::filesystem::file_size(filename));
+    store_output(worker.results.codec[CODEC_PNG], timing, PngOutPath, path, "png", worker.Encoded.data(), worker.Encoded.size(),
+                 width, height, channels);
+    stb_decode_test(worker, CODEC_PNG, path, img, width, height, channels);
 }
 
-void png_test(const char * filename, const void *data, unsigned width, unsigned height, uint8_t channels){
-    auto start = std::chrono::high_resolution_clock::now();
-
-    stbi_write_png(filename, static_cast<int>(width), static_cast<int>(height), channels, data, width * channels);
+//encodes into worker.CustomEncoded, complete JFIF stream, and decodes it by worker.CustomDecoder
+void custom_jpeg_test(Worker& worker, jpeg_encoder_t encoder, Codec codec, const std::filesystem::path& dir,
+                      const std::filesystem::path& path, const Image& img, unsigned width, unsigned height, uint8_t channels){
+    jpeg_input input = jpeg_input_packed(img.get(), jpeg_format_from_channels(channels));
+
+    Timing timing = measure([&]{
+                                jpeg_encode_input(encoder, width, height, &input);
+                                jpeg_write_to_buffer(encoder, worker.CustomEncoded);
+                            },
+                            [&]{ worker.CustomEncoded->size = 0; });
+
+    store_output(worker.results.codec[codec], timing, dir, path, "jpg", worker.CustomEncoded->data, worker.CustomEncoded->size,
+                 width, height, channels);
+
+    //pixels are kept by decoder, result is RGB or gray whatever the source
+    jpeg_decoder_t decoder = worker.CustomDecoder;
+
+    Decoded result = decode_test(worker.results.codec[codec], codec, path, width, height, channels,
+                                 [&]{
+                                     int ret = jpeg_decode(decoder, worker.CustomEncoded->data, worker.CustomEncoded->size);
+                                     return Decoded{ ret == 0 ? decoder->pixels : nullptr, decoder->width, decoder->height,
+                                                     decoder->channels, decoder->error };
+                                 },
+                                 []{});
+
+    if (result.pixels && MeasureQuality)
+        quality_test(worker.results.codec[codec].quality, img.get(), channels, result, worker.CustomEncoded->size);
+}
 
-    auto end = std::chrono::high_resolution_clock::now() - start;
+void test_custom_jpeg(Worker& worker, const std::filesystem::path& path, const Image& img, unsigned width, unsigned height, uint8_t channels){
+    custom_jpeg_test(worker, worker.CustomEncoder, CODEC_CUSTOM_JPEG, CustomJpegOutPath, path, img, width, height, channels);
+    sweep_test(worker, CODEC_CUSTOM_JPEG, img, width, height, channels);
+}
 
-    TimePNG.push_back(std::chrono::duration_cast<std::chrono::milliseconds>(end).count());
-    CompressionPNG.push_back(std::filesystem::file_size(filename));
+void test_custom_jpeg_trellis(Worker& worker, const std::filesystem::path& path, const Image& img, unsigned width, unsigned height, uint8_t channels){
+    custom_jpeg_test(worker, worker.CustomEncoderTrellis, CODEC_CUSTOM_JPEG_TRELLIS, CustomJpegTrellisOutPath, path, img, width, height, channels);
+    sweep_test(worker, CODEC_CUSTOM_JPEG_TRELLIS, img, width, height, channels);
 }
 
-void custom_jpeg_test(const char * filename, const void * data, unsigned width, unsigned height, uint8_t channels){
-    auto start = std::chrono::high_resolution_clock::now();
+using CodecTest = void (*)(Worker&, const std::filesystem::path&, const Image&, unsigned, unsigned, uint8_t);
 
-    jpeg_encoder_t enc = jpeg_alloc();
-    enc->compression_lvl = 3;
+//same order as Codec
+const CodecTest CodecTests[CODEC_COUNT] = { qoi_test, jpeg_test, png_test, test_custom_jpeg, test_custom_jpeg_trellis };
 
-    jpeg_encode_data(enc, width, height, static_cast<const uint8_t * >(data));
+//loads image and runs every codec on it, with 'split' codecs are tasks of their own
+void test_image(ThreadPool& pool, unsigned worker, const std::filesystem::path& path, bool split){
+    int width, height, channels;
+    Image img(stbi_load(path.string().c_str(), &width, &height, &channels, 0), stbi_image_free);
 
-    jpeg_write_to_file(enc, filename);
+    if (!img){
+        std::lock_guard<std::mutex> lock(LogMutex);
+        std::cerr << "Failed to load image: " << path << std::endl;
+        return;
+    }
 
-    auto end = std::chrono::high_resolution_clock::now() - start;
+    Workers[worker].results.Uncompressed.push_back(width * height * channels);
 
-    jpeg_free(enc);
+    for (CodecTest test : CodecTests){
+        if (split)
+            pool.submit([=](unsigned w){ test(Workers[w], path, img, width, height, channels); });
+        else
+            test(Workers[worker], path, img, width, height, channels);
+    }
+}
 
-    TimeCustomJPEG.push_back(std::chrono::duration_cast<std::chrono::milliseconds>(end).count());
-    CompressionCustomJPEG.push_back(std::filesystem::file_size(filename));
+//one row of time table. Throughput is of single thread: uncompressed size / summed time of the images
+void print_time(const char * name, const TimeResults& time){
+    Stats st = stats(time.ns);
+    double total = 0.0;
+    for (auto ns : time.ns) total += static_cast<double>(ns);
+
+    std::cout << std::left << std::setw(14) << name << std::right << std::fixed << std::setprecision(1)
+              << std::setw(9) << total / 1e6 << ' '
+              << std::setw(9) << st.min / 1e3 << ' ' << std::setw(9) << st.median / 1e3 << ' '
+              << std::setw(9) << st.p90 / 1e3 << ' ' << std::setw(9) << st.p99 / 1e3 << ' '
+              << std::setw(9) << st.mean / 1e3 << ' ' << std::setw(9) << st.stddev / 1e3 << ' '
+              << std::setw(9) << (total > 0.0 ? time.bytes * 1e3 / total : 0.0) << ' '
+              << std::setw(9) << (total > 0.0 ? time.pixels * 1e3 / total : 0.0) << ' '
+              << std::setw(8) << stats(time.cv).median * 100.0 << '\n'
+              << std::defaultfloat << std::setprecision(6);
+}
+
+//one row of quality table, 'quality' of sweep point or 0. Bits per pixel of all images together
+void print_quality(const char * name, const QualityResults& quality, int jpeg_quality = 0){
+    auto mean = [](const std::vector<double>& values){
+        return values.empty() ? 0.0 : std::accumulate(values.begin(), values.end(), 0.0) / values.size();
+    };
+
+    std::cout << std::left << std::setw(jpeg_quality ? 10 : 14) << name << std::right << std::fixed;
+    if (jpeg_quality)
+        std::cout << std::setw(4) << jpeg_quality;
+    std::cout << std::setprecision(3) << std::setw(8) << (quality.pixels ? quality.bytes * 8.0 / quality.pixels : 0.0) << ' '
+              << std::setprecision(2) << std::setw(9) << mean(quality.psnr) << ' '
+              << std::setprecision(5) << std::setw(9) << mean(quality.ssim) << ' ' << std::setw(9) << mean(quality.msssim) << '\n'
+              << std::defaultfloat << std::setprecision(6);
 }
 
 int main(int argc, char** argv){   
-    TimeQOI.reserve(20000);
-    TimeJPEG.reserve(20000);
-    TimeCustomJPEG.reserve(20000);
-    TimePNG.reserve(20000);
-
-    CompressionQOI.reserve(20000);
-    CompressionJPEG.reserve(20000);
-    CompressionCustomJPEG.reserve(20000);
-    CompressionPNG.reserve(20000);
-    Uncompressed.reserve(20000);
-
-    if (argc != 2){
+    unsigned jobs = 1;
+    bool split = false;
+    std::vector<char *> args;
+
+    for (int i = 1; i < argc; i++){
+        if (std::string(argv[i]) == "--jobs" && i + 1 < argc)
+            jobs = static_cast<unsigned>(std::max(std::atoi(argv[++i]), 0));
+        else if (std::string(argv[i]) == "--split-codecs")
+            split = true;
+        else if (std::string(argv[i]) == "--no-write")
+            WriteOutput = false;
+        else if (std::string(argv[i]) == "--reps" && i + 1 < argc)
+            Repetitions = std::max(std::atoi(argv[++i]), 1);
+        else if (std::string(argv[i]) == "--warmup" && i + 1 < argc)
+            Warmup = std::max(std::atoi(argv[++i]), 0);
+        else if (std::string(argv[i]) == "--no-quality")
+            MeasureQuality = false;
+        else if (std::string(argv[i]) == "--sweep" && i + 1 < argc){
+            std::stringstream list(argv[++i]);
+            for (std::string item; std::getline(list, item, ',');)
+                SweepQualities.push_back(std::clamp(std::atoi(item.c_str()), 1, 100));
+        }
+        else
+            args.push_back(argv[i]);
+    }
+
+    if (args.size() != 1 && args.size() != 2){
         std::cerr << "USAGE\n\n";
-        std::cerr << argv[0] << " [input_folder]" << std::endl;
+        std::cerr << argv[0] << " [--jobs N] [--split-codecs] [--no-write] [--reps K] [--warmup W] [--no-quality] [--sweep Q,Q,..] [input_folder] [jpeg_quality 1..100, default 90]\n\n";
+        std::cerr << "--jobs N        images are processed by N threads, 0 - one per core, default 1\n";
+        std::cerr << "--split-codecs  codecs of an image are separate tasks, so they run in parallel too\n";
+        std::cerr << "--no-write      encoded images stay in memory, no output directories\n";
+        std::cerr << "--reps K        timed runs of every codec on every image, median is taken, default 1\n";
+        std::cerr << "--warmup W      untimed runs before the timed ones, default 0\n";
+        std::cerr << "--no-quality    skip PSNR, SSIM and MS-SSIM of lossy codecs\n";
+        std::cerr << "--sweep Q,Q,..  bits per pixel vs quality of lossy codecs at these JPEG qualities" << std::endl;
         return -1;
     }
-    
-    std::filesystem::path input_path(argv[1]);
-    
-    std::filesystem::path qoi_out_path(input_path / "qoi");
-    std::filesystem::path jpeg_out_path(input_path / "jpeg");
-    std::filesystem::path png_out_path(input_path / "png");
-    std::filesystem::path custom_jpeg_out_path(input_path / "custom_jpeg");
 
-    std::filesystem::create_directory(qoi_out_path);
-    std::filesystem::create_directory(jpeg_out_path);
-    std::filesystem::create_directory(png_out_path);
-    std::filesystem::create_directory(custom_jpeg_out_path);
+    if (args.size() == 2)
+        JpegQuality = std::clamp(std::atoi(args[1]), 1, 100);
 
-    for (auto const& dir_entry : std::filesystem::directory_iterator(input_path))
-    {
-        if (!dir_entry.path().has_extension()) continue;
-        int width, height, channels;
-        uint8_t * img = stbi_load(dir_entry.path().string().c_str(), &width, &height, &channels, 0);
-
-        if (!img){
-            std::cerr << "Failed to load image: " << dir_entry.path() << std::endl;
-            continue;
-        }
+    if (jobs == 0)
+        jobs = std::max(std::thread::hardware_concurrency(), 1u);
+    
+    std::filesystem::path input_path(args[0]);
+    
+    QoiOutPath = input_path / "qoi";
+    JpegOutPath = input_path / "jpeg";
+    PngOutPath = input_path / "png";
+    CustomJpegOutPath = input_path / "custom_jpeg";
+    CustomJpegTrellisOutPath = input_path / "custom_jpeg_trellis";
+
+    if (WriteOutput){
+        std::filesystem::create_directory(QoiOutPath);
+        std::filesystem::create_directory(JpegOutPath);
+        std::filesystem::create_directory(PngOutPath);
+        std::filesystem::create_directory(CustomJpegOutPath);
+        std::filesystem::create_directory(CustomJpegTrellisOutPath);
+    }
 
-        //write QOI
-        auto ofname = qoi_out_path / dir_entry.path().filename();
-        ofname.replace_extension("qoi");
-        qoi_test(ofname.string().c_str(), img, width, height, channels);
+    Workers.resize(jobs);
+    for (Worker& worker : Workers){
+        worker.CustomEncoder = jpeg_alloc();
+        set_custom_quality(worker.CustomEncoder, JpegQuality);
 
-        //write JPEG
-        ofname = jpeg_out_path / dir_entry.path().filename();
-        ofname.replace_extension("jpeg");
-        jpeg_test(ofname.string().c_str(), img, width, height, channels);
+        worker.CustomEncoderTrellis = jpeg_alloc();
+        set_custom_quality(worker.CustomEncoderTrellis, JpegQuality);
+        worker.CustomEncoderTrellis->trellis = 1;
 
-        //write PNG
-        ofname = png_out_path / dir_entry.path().filename();
-        ofname.replace_extension("png");
-        png_test(ofname.string().c_str(), img, width, height, channels);
+        worker.CustomDecoder = jpeg_decoder_alloc();
+        worker.CustomEncoded = buffer_alloc(0);
+    }
 
-        //write custom JPEG
-        ofname = custom_jpeg_out_path / dir_entry.path().filename();
-        ofname.replace_extension("jpg");
-        custom_jpeg_test(ofname.string().c_str(), img, width, height, channels);
+    auto wall_start = Clock::now();
 
-        Uncompressed.push_back(width * height * channels);
+    {
+        ThreadPool pool(jobs);
+        Pool = &pool;
+
+        //directory is listed while first images are already processed
+        for (auto const& dir_entry : std::filesystem::directory_iterator(input_path))
+        {
+            if (!dir_entry.path().has_extension()) continue;
+            std::filesystem::path path = dir_entry.path();
+            pool.submit([&pool, path, split](unsigned w){ test_image(pool, w, path, split); });
+        }
 
-        stbi_image_free(img);
+        pool.wait();
+        Pool = nullptr;
     }
 
-    auto totalQOI = std::accumulate(TimeQOI.begin(), TimeQOI.end(), 0);
-    auto totalJPEG = std::accumulate(TimeJPEG.begin(), TimeJPEG.end(), 0);
-    auto totalPNG = std::accumulate(TimePNG.begin(), TimePNG.end(), 0);
-    auto totalCustomJPEG = std::accumulate(TimeCustomJPEG.begin(), TimeCustomJPEG.end(), 0);
+    auto wall = elapsed_ns(wall_start) / 1000000;
 
-    auto totalSize = std::accumulate(Uncompressed.begin(), Uncompressed.end(), 0);
-    auto totalQOISize = std::accumulate(CompressionQOI.begin(), CompressionQOI.end(), 0);
-    auto totalJPEGSize = std::accumulate(CompressionJPEG.begin(), CompressionJPEG.end(), 0);
-    auto totalPNGSize = std::accumulate(CompressionPNG.begin(), CompressionPNG.end(), 0);
-    auto totalCustomJPEGSize = std::accumulate(CompressionCustomJPEG.begin(), CompressionCustomJPEG.end(), 0);    
+    Results results;
+    for (Worker& worker : Workers){
+        results.merge(worker.results);
+        jpeg_free(worker.CustomEncoder);
+        jpeg_free(worker.CustomEncoderTrellis);
+        jpeg_decoder_free(worker.CustomDecoder);
+        buffer_free(worker.CustomEncoded);
+    }
 
-    std::cout << "Images     : " << Uncompressed.size() << '\n';
-    std::cout << "Time-------------------------------------\n";
-    std::cout << "TotalQOI   : " << totalQOI << "ms" << '\n';
-    std::cout << "TotalJPEG  : " << totalJPEG << "ms" << '\n';
-    std::cout << "TotalPNG   : " << totalPNG << "ms" << '\n';
-    std::cout << "TotalCus   : " << totalCustomJPEG << "ms" << '\n';
+    auto total = [](const std::vector<unsigned long>& values){ return std::accumulate(values.begin(), values.end(), 0UL); };
+
+    auto totalSize = total(results.Uncompressed);
+
+    std::cout << "Images     : " << results.Uncompressed.size() << '\n';
+    std::cout << "Jobs       : " << jobs << (split ? " split codecs" : "") << '\n';
+    std::cout << "Wall       : " << wall << "ms, " << (wall ? results.Uncompressed.size() * 1000.0 / wall : 0.0) << " images/s" << '\n';
+    std::cout << "Runs       : " << Repetitions << " timed after " << Warmup << " warm-up, median per image" << '\n';
+    std::cout << "Time per image, us-----------------------------------------------------------------------------------------\n";
+    std::cout << "              total ms       min    median       p90       p99      mean    stddev      MB/s      MP/s  noise %\n";
+    for (int i = 0; i < CODEC_COUNT; i++)
+        print_time(CodecNames[i], results.codec[i].time);
+    for (int i = 0; i < CODEC_COUNT; i++)
+        print_time((std::string(CodecNames[i]) + " dec").c_str(), results.codec[i].decode);
+    if (WriteOutput)
+        for (int i = 0; i < CODEC_COUNT; i++)
+            print_time((std::string(CodecNames[i]) + " io").c_str(), results.codec[i].io);
     std::cout << "Compression-------------------------------\n";
-    std::cout << "QOI %      : " << static_cast<double>(totalQOISize) / static_cast<double>(totalSize) * 100.0 << '\n';
-    std::cout << "JPEG %     : " << static_cast<double>(totalJPEGSize) / static_cast<double>(totalSize) * 100.0 << '\n';
-    std::cout << "PNG %      : " << static_cast<double>(totalPNGSize) / static_cast<double>(totalSize) * 100.0 << '\n';
-    std::cout << "Custom %   : " << static_cast<double>(totalCustomJPEGSize) / static_cast<double>(totalSize) * 100.0 << '\n';
+    for (int i = 0; i < CODEC_COUNT; i++)
+        std::cout << std::left << std::setw(14) << std::string(CodecNames[i]) + " %" << std::right << ": "
+                  << static_cast<double>(total(results.codec[i].compression)) / static_cast<double>(totalSize) * 100.0 << '\n';
     std::cout << "Compression-------------------------------\n";
-    std::cout << "Total size : " << totalSize << " bytes\n";
-    std::cout << "QOI        : " << std::setw(10) << totalQOISize << " d: " << std::setw(10) << totalSize - totalQOISize << '\n';
-    std::cout << "JPEG       : " << std::setw(10) << totalJPEGSize << " d: " << std::setw(10) << totalSize - totalJPEGSize << '\n';
-    std::cout << "PNG        : " << std::setw(10) << totalPNGSize << " d: " << std::setw(10) << totalSize - totalPNGSize << '\n';
-    std::cout << "Custom     : " << std::setw(10) << totalCustomJPEGSize << " d: " << std::setw(10) << totalSize - totalCustomJPEGSize << '\n';
+    std::cout << "Total size    : " << totalSize << " bytes\n";
+    for (int i = 0; i < CODEC_COUNT; i++){
+        auto size = total(results.codec[i].compression);
+        std::cout << std::left << std::setw(14) << CodecNames[i] << std::right << ": " << std::setw(10) << size
+                  << " d: " << std::setw(10) << static_cast<long long>(totalSize) - static_cast<long long>(size) << '\n';
+    }
+
+    if (MeasureQuality){
+        std::cout << "Quality, mean per image-------------------------------\n";
+        std::cout << "                   bpp   PSNR dB      SSIM   MS-SSIM\n";
+        for (int i = 0; i < CODEC_COUNT; i++)
+            if (CodecLossy[i])
+                print_quality(CodecNames[i], results.codec[i].quality);
+    }
+
+    if (!SweepQualities.empty()){
+        std::cout << "Bits per pixel vs quality, mean per image-------------\n";
+        std::cout << "              q    bpp   PSNR dB      SSIM   MS-SSIM\n";
+        for (int i = 0; i < CODEC_COUNT; i++)
+            for (size_t k = 0; k < results.sweep[i].size(); k++)
+                print_quality(CodecNames[i], results.sweep[i][k], SweepQualities[k]);
+    }
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,180 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Work stealing thread pool
+ *
+ * @details Every worker owns a deque. Tasks submitted by a worker go to its
+ *          own deque and are taken back LIFO, so subtasks of an image run
+ *          while the image is still in cache. Tasks from other threads are
+ *          spread round robin. Idle workers steal the oldest task of others.
+ *          Task gets index of the worker running it, 0 .. size() - 1, to
+ *          reach per thread state without locking.
+ */
+class ThreadPool {
+public:
+    using Task = std::function<void(unsigned)>;
+
+    explicit ThreadPool(unsigned threads) : queues(threads ? threads : 1) {
+        for (auto& queue : queues)
+            queue = std::make_unique<Queue>();
+        for (unsigned i = 0; i < queues.size(); i++)
+            workers.emplace_back([this, i] { run(i); });
+    }
+
+    ~ThreadPool() {
+        wait();
+        {
+            std::lock_guard<std::mutex> lock(idleMutex);
+            stop = true;
+        }
+        wakeup.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    unsigned size() const { return static_cast<unsigned>(queues.size()); }
+
+    void submit(Task task) {
+        unsigned target = Current != nullptr && Current->pool == this
+            ? Current->index : next++ % size();
+
+        {
+            std::lock_guard<std::mutex> lock(idleMutex);
+            pending++;
+        }
+        {
+            std::lock_guard<std::mutex> lock(queues[target]->mutex);
+            queues[target]->tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(idleMutex);
+            queued++;
+        }
+        wakeup.notify_one();
+    }
+
+    //blocks until every submitted task, subtasks included, is finished
+    void wait() {
+        std::unique_lock<std::mutex> lock(idleMutex);
+        done.wait(lock, [this] { return pending == 0; });
+    }
+
+    //runs fn(0) .. fn(count - 1), calling thread takes part. Idle workers join
+    //through helper tasks, busy ones don't hold it up: items are claimed one by one
+    //and caller runs whatever is left. Caller never runs unrelated tasks meanwhile
+    void parallel_for(unsigned count, const std::function<void(unsigned)>& fn) {
+        struct Group {
+            std::atomic<unsigned> next{ 0 };
+            std::atomic<unsigned> finished{ 0 };
+            unsigned count;
+            const std::function<void(unsigned)> *fn;
+            std::mutex mutex;
+            std::condition_variable done;
+        };
+
+        auto group = std::make_shared<Group>();
+        group->count = count;
+        group->fn = &fn;
+
+        //helpers started after the last item was claimed return without touching 'fn'
+        auto work = [](Group& g) {
+            for (unsigned i; (i = g.next++) < g.count;) {
+                (*g.fn)(i);
+                if (++g.finished == g.count) {
+                    std::lock_guard<std::mutex> lock(g.mutex);
+                    g.done.notify_all();
+                }
+            }
+        };
+
+        for (unsigned i = 1; i < std::min(count, size()); i++)
+            submit([group, work](unsigned) { work(*group); });
+
+        work(*group);
+
+        std::unique_lock<std::mutex> lock(group->mutex);
+        group->done.wait(lock, [&] { return group->finished == group->count; });
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    struct WorkerId {
+        const ThreadPool *pool;
+        unsigned index;
+    };
+
+    //own deque from back, then front of the others
+    bool pop(unsigned self, Task& task) {
+        for (unsigned i = 0; i < size(); i++) {
+            Queue& queue = *queues[(self + i) % size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty()) continue;
+
+            if (i == 0) {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            } else {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            queued--;
+            return true;
+        }
+        return false;
+    }
+
+    void run(unsigned self) {
+        WorkerId id{ this, self };
+        Current = &id;
+
+        for (;;) {
+            Task task;
+            if (pop(self, task)) {
+                task(self);
+
+                std::lock_guard<std::mutex> lock(idleMutex);
+                if (--pending == 0)
+                    done.notify_all();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(idleMutex);
+            wakeup.wait(lock, [this] { return stop || queued > 0; });
+            if (stop && queued <= 0) return;
+        }
+    }
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<unsigned> next{ 0 };
+
+    //'queued' may go below 0 for a moment: task is taken before submit() counts it
+    std::mutex idleMutex;
+    std::condition_variable wakeup;
+    std::condition_variable done;
+    std::atomic<long> queued{ 0 };
+    size_t pending = 0;
+    bool stop = false;
+
+    static inline thread_local const WorkerId *Current = nullptr;
+};
+
+#endif // THREAD_POOL_H